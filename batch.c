@@ -0,0 +1,644 @@
+/*---------------------------------------------------------------------*
+ *                                                                     *
+ *                         Batch Runner                                *
+ *                                                                     *
+ *                                                                     *
+ *       project: Gameboy Color Emulator                               *
+ *   module name: batch.c                                              *
+ *        author: tstr92                                               *
+ *          date: 2024-04-09                                           *
+ *                                                                     *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  include files                                                      *
+ *---------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "cpu.h"
+#include "batch.h"
+
+/*---------------------------------------------------------------------*
+ *  local definitions                                                  *
+ *---------------------------------------------------------------------*/
+#define BATCH_MAX_OUTPUT (64 * 1024)			// captured putc output per instance
+#define BATCH_DEFAULT_LIMIT (100000000ULL)		// instructions per instance
+#define BATCH_DEFAULT_RESULTS "batch_results.jsonl"
+#define BATCH_MAX_THREADS (256)
+
+#define DBG_ERROR() printf("Error: %s:%d\n", __FUNCTION__, __LINE__)
+
+/*---------------------------------------------------------------------*
+ *  local data types                                                   *
+ *---------------------------------------------------------------------*/
+typedef struct
+{
+	const char *path;
+	cpu_rom_t *image;		// mapped once, shared by all instances
+} batch_rom_t;
+
+typedef struct
+{
+	const batch_rom_t *rom;
+	uint32_t seed;			// 0: RAM cleared, otherwise RAM filled with noise
+
+	// results
+	bool stopped;			// false if the instruction limit was reached
+	uint64_t cycles;
+	uint64_t frames;
+	uint8_t regs[8];		// a, f, b, c, d, e, h, l
+	uint16_t pc;
+	uint16_t sp;
+	char *output;
+	uint32_t output_len;
+	uint32_t output_size;
+	bool output_truncated;
+} batch_job_t;
+
+/* Job indices of one worker. The owner takes jobs from the tail, idle
+ * workers steal from the head. */
+typedef struct
+{
+	pthread_mutex_t lock;
+	uint32_t *jobs;
+	uint32_t head;
+	uint32_t tail;
+} batch_queue_t;
+
+typedef struct
+{
+	batch_job_t *jobs;
+	uint32_t n_jobs;
+	batch_queue_t *queues;
+	uint32_t n_threads;
+	uint64_t limit;
+	const char *frame_dir;	// NULL: frames are not saved
+	uint32_t frame_skip;	// see cpu_set_frame_skip()
+	const char *audio_dir;	// NULL: no audio
+	uint32_t steals;		// jobs taken from other workers in the last run
+} batch_t;
+
+typedef struct
+{
+	batch_t *batch;
+	uint32_t id;
+	uint32_t steals;
+} batch_worker_t;
+
+/*---------------------------------------------------------------------*
+ *  external declarations                                              *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  public data                                                        *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  private data                                                       *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  private function declarations                                      *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  private functions                                                  *
+ *---------------------------------------------------------------------*/
+static void batch_usage(const char *name)
+{
+	printf("Invocation:\n\t'%s [options] <rom | @list> ...'\n", name);
+	printf("\t@list  file with one ROM path per line\n");
+	printf("\t-j <n> worker threads (default: number of cores)\n");
+	printf("\t-n <n> instances per ROM, instance i fills RAM with seed i (default: 1)\n");
+	printf("\t-m <n> instruction limit per instance (default: %llu)\n", BATCH_DEFAULT_LIMIT);
+	printf("\t-o <f> results file (default: %s)\n", BATCH_DEFAULT_RESULTS);
+	printf("\t-f <d> save the last frame of instance i as <d>/<i>.ppm, in the order of the results\n");
+	printf("\t-r <n> draw every nth frame, 0: only the frames saved with -f (default: 1)\n");
+	printf("\t-w <d> save the sound of instance i as <d>/<i>.wav, without -w no sound is synthesized\n");
+	printf("\t-s     scaling benchmark, run the batch with 1, 2, 4, ... threads\n");
+}
+
+static uint32_t batch_cores(void)
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (0 < n) ? (uint32_t) n : 1;
+#endif
+}
+
+static double batch_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static bool batch_load_rom(batch_rom_t *rom, const char *path)
+{
+	rom->path = path;
+	rom->image = cpu_rom_open(path);
+
+	return (NULL != rom->image);
+}
+
+// adds a ROM, or all ROMs of a list file ("@file")
+static bool batch_add_rom(batch_rom_t **roms, uint32_t *n_roms, const char *arg)
+{
+	if ('@' != arg[0])
+	{
+		batch_rom_t *tmp = realloc(*roms, (*n_roms + 1) * sizeof(**roms));
+		if (NULL == tmp)
+		{
+			DBG_ERROR();
+			return false;
+		}
+		*roms = tmp;
+		if (!batch_load_rom(&(*roms)[*n_roms], arg))
+		{
+			return false;
+		}
+		(*n_roms)++;
+		return true;
+	}
+
+	FILE *list = fopen(&arg[1], "r");
+	char line[1024];
+
+	if (NULL == list)
+	{
+		printf("Error: Could not open file '%s'.\n", &arg[1]);
+		return false;
+	}
+
+	while (NULL != fgets(line, sizeof(line), list))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if (('\0' == line[0]) || ('#' == line[0]))
+		{
+			continue;
+		}
+		if (!batch_add_rom(roms, n_roms, strdup(line)))
+		{
+			fclose(list);
+			return false;
+		}
+	}
+	fclose(list);
+
+	return true;
+}
+
+// collects the output of one instance in memory
+static void batch_putc(void *ctx, const uint8_t *data, uint32_t len)
+{
+	batch_job_t *job = ctx;
+
+	if ((BATCH_MAX_OUTPUT - job->output_len) < len)
+	{
+		len = BATCH_MAX_OUTPUT - job->output_len;
+		job->output_truncated = true;
+	}
+
+	if (job->output_size < (job->output_len + len))
+	{
+		uint32_t size = (0 == job->output_size) ? 256 : job->output_size;
+		while (size < (job->output_len + len))
+		{
+			size *= 2;
+		}
+		char *tmp = realloc(job->output, size);
+		if (NULL == tmp)
+		{
+			job->output_truncated = true;
+			return;
+		}
+		job->output = tmp;
+		job->output_size = size;
+	}
+
+	memcpy(&job->output[job->output_len], data, len);
+	job->output_len += len;
+}
+
+// work RAM and high RAM are not cleared on real hardware
+static void batch_seed_ram(sm83_t *cpu, uint32_t seed)
+{
+	uint32_t x = seed;
+
+	for (uint32_t addr = 0xC000; addr <= 0xFFFE; addr++)
+	{
+		if (0xE000 == addr)
+		{
+			addr = 0xFF80;
+		}
+		// xorshift32
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		cpu_set_memory(cpu, addr, (uint8_t) x);
+	}
+}
+
+static void batch_run_job(sm83_t *cpu, const batch_t *batch, uint32_t index)
+{
+	batch_job_t *job = &batch->jobs[index];
+
+	cpu_init(cpu);
+	cpu_set_putc(cpu, batch_putc, job);
+	cpu_set_frame_skip(cpu, batch->frame_skip);
+	cpu_attach_rom(cpu, job->rom->image);
+	if (0 != job->seed)
+	{
+		batch_seed_ram(cpu, job->seed);
+	}
+	if (NULL != batch->audio_dir)
+	{
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/%u.wav", batch->audio_dir, index);
+		cpu_save_audio(cpu, path);
+	}
+
+	cpu_run(cpu, batch->limit);
+	cpu_flush_putc(cpu);
+	// completes the WAV file
+	cpu_set_audio(cpu, NULL, 0, NULL, NULL);
+
+	job->stopped = cpu_is_stopped(cpu);
+	job->cycles = cpu_get_cycles(cpu);
+	job->frames = cpu_get_frame_count(cpu);
+	if (NULL != batch->frame_dir)
+	{
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/%u.ppm", batch->frame_dir, index);
+		cpu_save_frame(cpu, path);
+	}
+	cpu_get_state(cpu, &job->regs[0], &job->regs[1], &job->regs[2], &job->regs[3],
+	              &job->regs[4], &job->regs[5], &job->regs[6], &job->regs[7], &job->pc, &job->sp);
+}
+
+static bool batch_queue_pop(batch_queue_t *queue, uint32_t *job)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->head != queue->tail)
+	{
+		*job = queue->jobs[--queue->tail];
+		ret = true;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return ret;
+}
+
+static bool batch_queue_steal(batch_queue_t *queue, uint32_t *job)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->head != queue->tail)
+	{
+		*job = queue->jobs[queue->head++];
+		ret = true;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return ret;
+}
+
+static void *batch_worker(void *arg)
+{
+	batch_worker_t *worker = arg;
+	batch_t *batch = worker->batch;
+	sm83_t *cpu = cpu_create();
+	uint32_t job;
+
+	if (NULL == cpu)
+	{
+		return NULL;
+	}
+
+	for (;;)
+	{
+		bool found = batch_queue_pop(&batch->queues[worker->id], &job);
+
+		// no jobs are added while running, so empty queues stay empty
+		for (uint32_t i = 1; !found && (i < batch->n_threads); i++)
+		{
+			found = batch_queue_steal(&batch->queues[(worker->id + i) % batch->n_threads], &job);
+			worker->steals += found ? 1 : 0;
+		}
+
+		if (!found)
+		{
+			break;
+		}
+
+		batch_run_job(cpu, batch, job);
+	}
+
+	cpu_destroy(cpu);
+	return NULL;
+}
+
+// runs all jobs on n_threads workers, returns the wall-clock time
+static double batch_execute(batch_t *batch, uint32_t n_threads)
+{
+	pthread_t threads[BATCH_MAX_THREADS];
+	batch_worker_t workers[BATCH_MAX_THREADS];
+	double start;
+
+	for (uint32_t i = 0; i < batch->n_jobs; i++)
+	{
+		batch->jobs[i].output_len = 0;
+		batch->jobs[i].output_truncated = false;
+	}
+
+	// contiguous slices of the job list, stealing balances uneven run times
+	batch->n_threads = n_threads;
+	for (uint32_t t = 0; t < n_threads; t++)
+	{
+		batch_queue_t *queue = &batch->queues[t];
+		queue->head = 0;
+		queue->tail = 0;
+		for (uint32_t i = (uint64_t) t * batch->n_jobs / n_threads;
+		     i < (uint64_t) (t + 1) * batch->n_jobs / n_threads; i++)
+		{
+			queue->jobs[queue->tail++] = i;
+		}
+		// the owner pops from the tail, so reverse to run its slice in order
+		for (uint32_t i = 0; i < queue->tail / 2; i++)
+		{
+			uint32_t tmp = queue->jobs[i];
+			queue->jobs[i] = queue->jobs[queue->tail - 1 - i];
+			queue->jobs[queue->tail - 1 - i] = tmp;
+		}
+	}
+
+	start = batch_time();
+	for (uint32_t t = 0; t < n_threads; t++)
+	{
+		workers[t].batch = batch;
+		workers[t].id = t;
+		workers[t].steals = 0;
+		pthread_create(&threads[t], NULL, batch_worker, &workers[t]);
+	}
+	for (uint32_t t = 0; t < n_threads; t++)
+	{
+		pthread_join(threads[t], NULL);
+	}
+
+	batch->steals = 0;
+	for (uint32_t t = 0; t < n_threads; t++)
+	{
+		batch->steals += workers[t].steals;
+	}
+
+	return batch_time() - start;
+}
+
+static void batch_write_string(FILE *file, const char *str, uint32_t len)
+{
+	fputc('"', file);
+	for (uint32_t i = 0; i < len; i++)
+	{
+		uint8_t c = (uint8_t) str[i];
+		switch (c)
+		{
+		case '"':  fputs("\\\"", file); break;
+		case '\\': fputs("\\\\", file); break;
+		case '\n': fputs("\\n", file); break;
+		case '\r': fputs("\\r", file); break;
+		case '\t': fputs("\\t", file); break;
+		default:
+			if ((c < 0x20) || (c >= 0x7F))
+			{
+				fprintf(file, "\\u%04x", c);
+			}
+			else
+			{
+				fputc(c, file);
+			}
+			break;
+		}
+	}
+	fputc('"', file);
+}
+
+// one JSON object per instance and line, in job order
+static bool batch_write_results(const batch_t *batch, const char *path)
+{
+	FILE *file = fopen(path, "w");
+
+	if (NULL == file)
+	{
+		printf("Error: Could not open file '%s'.\n", path);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < batch->n_jobs; i++)
+	{
+		const batch_job_t *job = &batch->jobs[i];
+		fprintf(file, "{\"rom\": ");
+		batch_write_string(file, job->rom->path, strlen(job->rom->path));
+		fprintf(file, ", \"seed\": %u, \"status\": \"%s\", \"instructions\": %llu, \"frames\": %llu, ",
+		        job->seed, job->stopped ? "stopped" : "limit", (unsigned long long) job->cycles,
+		        (unsigned long long) job->frames);
+		fprintf(file, "\"a\": %u, \"f\": %u, \"b\": %u, \"c\": %u, \"d\": %u, \"e\": %u, \"h\": %u, \"l\": %u, \"pc\": %u, \"sp\": %u, ",
+		        job->regs[0], job->regs[1], job->regs[2], job->regs[3], job->regs[4],
+		        job->regs[5], job->regs[6], job->regs[7], job->pc, job->sp);
+		fprintf(file, "\"output\": ");
+		batch_write_string(file, job->output, job->output_len);
+		fprintf(file, ", \"truncated\": %s}\n", job->output_truncated ? "true" : "false");
+	}
+	fclose(file);
+
+	return true;
+}
+
+static uint64_t batch_instructions(const batch_t *batch)
+{
+	uint64_t sum = 0;
+
+	for (uint32_t i = 0; i < batch->n_jobs; i++)
+	{
+		sum += batch->jobs[i].cycles;
+	}
+
+	return sum;
+}
+
+static uint64_t batch_frames(const batch_t *batch)
+{
+	uint64_t sum = 0;
+
+	for (uint32_t i = 0; i < batch->n_jobs; i++)
+	{
+		sum += batch->jobs[i].frames;
+	}
+
+	return sum;
+}
+
+/*---------------------------------------------------------------------*
+ *  public functions                                                   *
+ *---------------------------------------------------------------------*/
+int batch_main(int argc, char *argv[])
+{
+	batch_rom_t *roms = NULL;
+	uint32_t n_roms = 0;
+	uint32_t n_threads = batch_cores();
+	uint32_t n_seeds = 1;
+	const char *results = BATCH_DEFAULT_RESULTS;
+	bool scaling = false;
+	batch_t batch;
+	int ret = 0;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.limit = BATCH_DEFAULT_LIMIT;
+	batch.frame_skip = 1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((0 == strcmp(argv[i], "-j")) && (i + 1 < argc))
+		{
+			n_threads = strtoul(argv[++i], NULL, 0);
+		}
+		else if ((0 == strcmp(argv[i], "-n")) && (i + 1 < argc))
+		{
+			n_seeds = strtoul(argv[++i], NULL, 0);
+		}
+		else if ((0 == strcmp(argv[i], "-m")) && (i + 1 < argc))
+		{
+			batch.limit = strtoull(argv[++i], NULL, 0);
+		}
+		else if ((0 == strcmp(argv[i], "-o")) && (i + 1 < argc))
+		{
+			results = argv[++i];
+		}
+		else if ((0 == strcmp(argv[i], "-f")) && (i + 1 < argc))
+		{
+			batch.frame_dir = argv[++i];
+		}
+		else if ((0 == strcmp(argv[i], "-r")) && (i + 1 < argc))
+		{
+			batch.frame_skip = strtoul(argv[++i], NULL, 0);
+		}
+		else if ((0 == strcmp(argv[i], "-w")) && (i + 1 < argc))
+		{
+			batch.audio_dir = argv[++i];
+		}
+		else if (0 == strcmp(argv[i], "-s"))
+		{
+			scaling = true;
+		}
+		else if ('-' == argv[i][0])
+		{
+			batch_usage(argv[0]);
+			return 1;
+		}
+		else if (!batch_add_rom(&roms, &n_roms, argv[i]))
+		{
+			return 1;
+		}
+	}
+
+	if ((0 == n_roms) || (0 == n_seeds) || (0 == n_threads) || (BATCH_MAX_THREADS < n_threads))
+	{
+		batch_usage(argv[0]);
+		return 1;
+	}
+
+	batch.n_jobs = n_roms * n_seeds;
+	batch.jobs = calloc(batch.n_jobs, sizeof(*batch.jobs));
+	batch.queues = calloc(n_threads, sizeof(*batch.queues));
+	if ((NULL == batch.jobs) || (NULL == batch.queues))
+	{
+		DBG_ERROR();
+		return 1;
+	}
+	for (uint32_t i = 0; i < batch.n_jobs; i++)
+	{
+		batch.jobs[i].rom = &roms[i / n_seeds];
+		batch.jobs[i].seed = i % n_seeds;
+	}
+	for (uint32_t t = 0; t < n_threads; t++)
+	{
+		pthread_mutex_init(&batch.queues[t].lock, NULL);
+		batch.queues[t].jobs = calloc(batch.n_jobs, sizeof(uint32_t));
+		if (NULL == batch.queues[t].jobs)
+		{
+			DBG_ERROR();
+			return 1;
+		}
+	}
+
+	if (scaling)
+	{
+		double base = 0;
+		printf("threads  seconds      MIPS  speedup  steals\n");
+		for (uint32_t t = 1; ; t = (2 * t < n_threads) ? (2 * t) : n_threads)
+		{
+			double seconds = batch_execute(&batch, t);
+			base = (1 == t) ? seconds : base;
+			printf("%7u  %7.3f  %8.2f  %7.2f  %6u\n", t, seconds,
+			       (double) batch_instructions(&batch) / seconds / 1e6, base / seconds, batch.steals);
+			if (t == n_threads)
+			{
+				break;
+			}
+		}
+	}
+	else
+	{
+		double seconds = batch_execute(&batch, n_threads);
+		uint64_t instructions = batch_instructions(&batch);
+		uint64_t frames = batch_frames(&batch);
+		printf("%u instances on %u threads: %.3f s, %llu instructions (%.2f MIPS), %llu frames (%.0f fps), %u steals\n",
+		       batch.n_jobs, n_threads, seconds, (unsigned long long) instructions,
+		       (double) instructions / seconds / 1e6, (unsigned long long) frames,
+		       (double) frames / seconds, batch.steals);
+	}
+
+	if (!batch_write_results(&batch, results))
+	{
+		ret = 1;
+	}
+
+	for (uint32_t i = 0; i < batch.n_jobs; i++)
+	{
+		free(batch.jobs[i].output);
+	}
+	for (uint32_t t = 0; t < n_threads; t++)
+	{
+		pthread_mutex_destroy(&batch.queues[t].lock);
+		free(batch.queues[t].jobs);
+	}
+	for (uint32_t i = 0; i < n_roms; i++)
+	{
+		cpu_rom_close(roms[i].image);
+	}
+	free(batch.queues);
+	free(batch.jobs);
+	free(roms);
+
+	return ret;
+}
+
+/*---------------------------------------------------------------------*
+ *  eof                                                                *
+ *---------------------------------------------------------------------*/
@@ -0,0 +1,42 @@
+/*---------------------------------------------------------------------*
+ *                                                                     *
+ *                         Batch Runner                                *
+ *                                                                     *
+ *                                                                     *
+ *       project: Gameboy Color Emulator                               *
+ *   module name: batch.h                                              *
+ *        author: tstr92                                               *
+ *          date: 2024-04-09                                           *
+ *                                                                     *
+ *---------------------------------------------------------------------*/
+#ifndef BATCH_H
+#define BATCH_H
+
+/*---------------------------------------------------------------------*
+ *  include files                                                      *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  global definitions                                                 *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  type declarations                                                  *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  function prototypes                                                *
+ *---------------------------------------------------------------------*/
+/* Runs many ROM instances on a pool of worker threads, see batch_usage()
+ * for the arguments. argv[0] is the name of the batch command. */
+int batch_main(int argc, char *argv[]);
+
+/*---------------------------------------------------------------------*
+ *  global data                                                        *
+ *---------------------------------------------------------------------*/
+
+#endif /* BATCH_H */
+
+/*---------------------------------------------------------------------*
+ *  eof                                                                *
+ *---------------------------------------------------------------------*/
@@ -0,0 +1,75 @@
+#define SIEVE_SIZE  4096
+#define ITERATIONS  64
+
+static unsigned char sieve[SIEVE_SIZE];
+
+void putc(unsigned char c)
+{
+    *((unsigned char*)0xE000) = c;
+}
+
+void puts(unsigned char *s)
+{
+    while (*s)
+    {
+        putc(*s);
+        s++;
+    }
+}
+
+void putint(unsigned int num)
+{
+    unsigned char buf[6];
+    int i = 0;
+
+    do
+    {
+        buf[i++] = "0123456789"[num % 10];
+        num /= 10;
+    } while (0 != num);
+
+    while (0 < i)
+    {
+        putc(buf[--i]);
+    }
+}
+
+unsigned int count_primes(void)
+{
+    unsigned int count = 0;
+
+    for (unsigned int i = 0; i < SIEVE_SIZE; i++)
+    {
+        sieve[i] = 1;
+    }
+
+    for (unsigned int i = 2; i < SIEVE_SIZE; i++)
+    {
+        if (sieve[i])
+        {
+            count++;
+            for (unsigned int j = i + i; j < SIEVE_SIZE; j += i)
+            {
+                sieve[j] = 0;
+            }
+        }
+    }
+
+    return count;
+}
+
+void main(void)
+{
+    unsigned int primes = 0;
+
+    for(int i = 0; i < ITERATIONS; i++)
+    {
+        primes = count_primes();
+    }
+
+    puts("primes: ");
+    putint(primes);
+    putc('\n');
+    __asm__("stop");
+    return;
+}
@@ -1,4 +1,3 @@
-
 /*---------------------------------------------------------------------*
  *                                                                     *
  *                         SM83 Microcontroller                        *
@@ -15,10 +14,27 @@
  *  include files                                                      *
  *---------------------------------------------------------------------*/
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#if (0 < USE_PPU_SIMD)
+#include <immintrin.h>
+#endif
+#if defined(_WIN32)
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "cpu.h"
 
 /*---------------------------------------------------------------------*
  *  local definitions                                                  *
@@ -34,6 +50,192 @@
 #define LOW_BYTE(_uint16) ((_uint16 & 0x00ff) >> 0)
 #define IS_IN_RANGE(_val, _min, _max) ((_val >= _min) && (_val <= _max))
 
+#define REG_OFFSET(_reg) ((uint8_t) offsetof(sm83_t, _reg))
+#define REG8(_off) (*(((uint8_t *) cpu) + (_off)))
+#define REG16(_off) (*((uint16_t *) (((uint8_t *) cpu) + (_off))))
+#define REG_NONE (0xFF)	// no register operand
+#define REG_HLI (0xFF)	// operand is the memory pointed to by HL
+
+// the threaded interpreter inlines every handler into its dispatch label
+#if (0 < USE_THREADED_DISPATCH)
+#define OPC_INLINE inline __attribute__((always_inline))
+#else
+#define OPC_INLINE
+#endif
+
+// operation recorded for lazy flag evaluation
+#define LAZY_NONE (0)	// F is up to date
+#define LAZY_ADD (1)	// ADD, ADC
+#define LAZY_SUB (2)	// SUB, SBC, CP
+#define LAZY_AND (3)
+#define LAZY_OR (4)		// OR, XOR
+
+// CB shift/rotate operations, in opcode order
+#define SHIFT_RLC (0)
+#define SHIFT_RRC (1)
+#define SHIFT_RL (2)
+#define SHIFT_RR (3)
+#define SHIFT_SLA (4)
+#define SHIFT_SRA (5)
+#define SHIFT_SWAP (6)
+#define SHIFT_SRL (7)
+
+// memory bank controllers, see cpu_load_rom()
+#define MBC_NONE (0)
+#define MBC_1 (1)
+#define MBC_3 (3)
+#define MBC_5 (5)
+#define MBC_RTC_DAY (86400)
+#define MBC_RTC_WRAP (512 * MBC_RTC_DAY)	// 9 bit day counter
+#define MBC_RTC_CYCLES (4194304)			// T-cycles per second at normal speed
+
+#if (0 < USE_PPU_SIMD) && !defined(__x86_64__)
+#error "USE_PPU_SIMD requires an x86-64 host."
+#endif
+
+#if (0 < USE_DYNAREC)
+#if !defined(__x86_64__)
+#error "USE_DYNAREC requires an x86-64 host."
+#endif
+#if (0 < USE_THREADED_DISPATCH)
+#error "USE_DYNAREC and USE_THREADED_DISPATCH are mutually exclusive."
+#endif
+#if (0 < BUILD_TEST_DLL)
+// translate every instruction into its own block, so the sm83 tests check
+// the translated code of each opcode
+#define DYNAREC_HOT_THRESHOLD (0)
+#define DYNAREC_MAX_BLOCK_LEN (1)
+#else
+#define DYNAREC_HOT_THRESHOLD (16)	// interpreted executions before translation
+#define DYNAREC_MAX_BLOCK_LEN (64)	// guest instructions per block
+#endif
+#define DYNAREC_CODE_SIZE (4 * 1024 * 1024)
+#define DYNAREC_MAX_BLOCK_CODE (DYNAREC_MAX_BLOCK_LEN * 256 + 512)
+#define DYNAREC_MAX_BLOCKS (16384)
+#define DYNAREC_HASH_SIZE (4096)
+#define DYNAREC_INVALID (0xFFFFFFFF)
+#define DYNAREC_VERIFY_RAM (16 * 0x2000)	// largest external RAM, see cpu_cart_setup()
+#if defined(_WIN32)
+#define DYNAREC_ARG0_RBX (0xD9)	// mov rcx, rbx
+#define DYNAREC_ARG1_MOV (0xBA)	// mov rdx, imm64
+#define DYNAREC_R14_ARG0 (0xCE)	// mov r14d, ecx
+#define DYNAREC_FRAME (40)		// shadow space + stack alignment
+#else
+#define DYNAREC_ARG0_RBX (0xDF)	// mov rdi, rbx
+#define DYNAREC_ARG1_MOV (0xBE)	// mov rsi, imm64
+#define DYNAREC_R14_ARG0 (0xFE)	// mov r14d, edi
+#define DYNAREC_FRAME (8)		// stack alignment
+#endif
+// condition codes of jcc
+#define DYNAREC_JE (0x4)
+#define DYNAREC_JNE (0x5)
+#define DYNAREC_JBE (0x6)
+#define DYNAREC_JA (0x7)
+#endif
+
+#define CPU_PUTC_BUFFER (4096)	// bytes of putc output drained at once
+
+#define SCHED_IDLE (0xFF)		// event is not scheduled
+#define SCHED_NEVER (UINT64_MAX)
+
+// I/O registers, offsets in dev_map
+#define IO_SB (0x01)	// serial transfer data
+#define IO_SC (0x02)	// serial transfer control
+#define IO_DIV (0x04)	// divider
+#define IO_TIMA (0x05)	// timer counter
+#define IO_TMA (0x06)	// timer modulo
+#define IO_TAC (0x07)	// timer control
+#define IO_IF (0x0F)	// interrupt flags
+#define IO_NR10 (0x10)	// sound channel 1, sweep
+#define IO_NR11 (0x11)	// duty and length
+#define IO_NR12 (0x12)	// volume envelope
+#define IO_NR13 (0x13)	// period, low bits
+#define IO_NR14 (0x14)	// trigger, length enable and period, high bits
+#define IO_NR21 (0x16)	// sound channel 2, like channel 1 without sweep
+#define IO_NR22 (0x17)
+#define IO_NR23 (0x18)
+#define IO_NR24 (0x19)
+#define IO_NR30 (0x1A)	// sound channel 3, DAC enable
+#define IO_NR31 (0x1B)	// length
+#define IO_NR32 (0x1C)	// output level
+#define IO_NR33 (0x1D)
+#define IO_NR34 (0x1E)
+#define IO_NR41 (0x20)	// sound channel 4, length
+#define IO_NR42 (0x21)	// volume envelope
+#define IO_NR43 (0x22)	// LFSR clock and width
+#define IO_NR44 (0x23)	// trigger and length enable
+#define IO_NR50 (0x24)	// master volume
+#define IO_NR51 (0x25)	// panning
+#define IO_NR52 (0x26)	// sound on/off, channel status
+#define IO_WAVE (0x30)	// wave pattern RAM, 0x30 - 0x3F
+#define IO_LCDC (0x40)	// LCD control
+#define IO_STAT (0x41)	// LCD status
+#define IO_SCY (0x42)	// background scroll
+#define IO_SCX (0x43)
+#define IO_LY (0x44)	// current line
+#define IO_LYC (0x45)	// line compare
+#define IO_DMA (0x46)	// OAM DMA source page
+#define IO_BGP (0x47)	// DMG palettes
+#define IO_OBP0 (0x48)
+#define IO_OBP1 (0x49)
+#define IO_WY (0x4A)	// window position
+#define IO_WX (0x4B)
+#define IO_KEY1 (0x4D)	// CGB speed switch
+#define IO_VBK (0x4F)	// CGB VRAM bank
+#define IO_HDMA1 (0x51)	// CGB HDMA source
+#define IO_HDMA2 (0x52)
+#define IO_HDMA3 (0x53)	// CGB HDMA destination in VRAM
+#define IO_HDMA4 (0x54)
+#define IO_HDMA5 (0x55)	// CGB HDMA length and mode
+#define IO_BCPS (0x68)	// CGB palette index and data
+#define IO_BCPD (0x69)
+#define IO_OCPS (0x6A)
+#define IO_OCPD (0x6B)
+#define IO_SVBK (0x70)	// CGB WRAM bank
+
+// interrupt flags
+#define INT_VBLANK (0x01)
+#define INT_STAT (0x02)
+#define INT_TIMER (0x04)
+#define INT_SERIAL (0x08)
+#define INT_JOYPAD (0x10)
+
+#define SERIAL_TRANSFER_CYCLES (8 * 512)	// 8 bits at 8192 Hz
+#define TIMER_RELOAD_CYCLES (4)		// TIMA reads 0 after an overflow
+
+#define PPU_LINE_CYCLES (456)
+#define PPU_OAM_CYCLES (80)			// mode 2
+#define PPU_DRAW_CYCLES (172)		// mode 3, without the penalties of scrolling, window and sprites
+#define PPU_LINES (154)				// including the lines of VBlank
+#define PPU_LINE_SPRITES (10)
+#define PPU_FETCH_TILES (21)		// tiles covering a line at any fine scroll
+// T-cycles of the CPU for a time of the PPU, which keeps its clock in double speed
+#define PPU_TIME(_cpu, _cycles) ((uint64_t) (_cycles) << (_cpu)->cgb.speed)
+
+#define DMA_SETUP_CYCLES (4)		// the OAM DMA starts one M-cycle after the write
+#define DMA_OAM_CYCLES (160 * 4)	// one byte per M-cycle
+#define HDMA_BLOCK_CYCLES (32)		// CPU stall per 16 byte block, in PPU time
+#define SPEED_SWITCH_CYCLES (2050 * 4)	// CPU paused by STOP while the clock changes
+
+#define APU_CHANNELS (4)
+#define APU_SEQ_CYCLES (8192)		// frame sequencer step (512 Hz), falling edge of DIV bit 4
+#define APU_POS_PER_CLOCK (750)		// CPU_AUDIO_RATE / 4194304 Hz as 16.16 fixed point samples
+#define APU_BLOCK (1024)			// samples synthesized at most per block
+#define APU_KERNEL (16)				// samples covered by one band-limited step
+#define APU_PHASES (64)				// sub-sample positions of the steps
+#define APU_KERNEL_BITS (12)		// the taps of a step sum up to 1 << APU_KERNEL_BITS
+#define APU_GAIN (64)				// output of a channel at volume 15 and master volume 7: 15 * 8 * 64
+#define APU_WAV_FRAMES (4096)		// buffer of cpu_save_audio()
+
+// buses of the memory map, see cpu_dma_bus()
+#define DMA_BUS_NONE (0)
+#define DMA_BUS_CART (1)	// ROM and external RAM, on DMG also WRAM
+#define DMA_BUS_WRAM (2)
+#define DMA_BUS_VRAM (3)
+
+#define IDLE_MAX_LOOP (16)		// bytes of a loop considered by cpu_idle_loop()
+#define IDLE_CACHE (64)			// loops remembered as not idle
+
 #define DBG_ERROR() printf("Error: %s:%d\n", __FUNCTION__, __LINE__)
 
 #if (0 < DEBUG)
@@ -60,7 +262,34 @@
  * 0xFFFF            Interrupt Enable Register
  */
 
+#if (0 < USE_DYNAREC)
+typedef struct dynarec_s dynarec_t;
+#endif
+
+// device events, see cpu_sched_add()
+typedef enum
+{
+	EVT_SERIAL,		// serial transfer complete
+	EVT_TIMER,		// TIMA overflow or reload from TMA
+	EVT_PPU,		// next mode of the LCD
+	EVT_DMA,		// OAM DMA complete
+	EVT_APU,		// sample block complete, see cpu_apu_run()
+	EVT_COUNT,
+} cpu_event_t;
+
+// one of the four sound channels, see cpu_apu_channel_run()
 typedef struct
+{
+	bool on;			// NR52 status bit
+	uint8_t volume;		// envelope volume, channel 3: NR32 shift
+	uint8_t env_timer;	// envelope steps until the next volume change
+	uint16_t length;	// steps of the length counter until the channel is off
+	uint32_t timer;		// APU clocks until the next waveform step
+	uint8_t step;		// duty or wave position
+	uint8_t out;		// digital output 0 - 15
+} apu_channel_t;
+
+struct sm83_s
 {
 	union
 	{
@@ -116,14 +345,185 @@ typedef struct
 	uint8_t reserved1   [0x0060];
 	uint8_t dev_map     [0x0080];
 	uint8_t int_en      [0x0080];
+	// CGB banks that are not part of the map above, see cpu_page_host()
+	uint8_t video_ram1  [0x2000];
+	uint8_t int_ram2_7  [6][0x1000];
+#endif
+
+	// host address of every 256 byte page, NULL marks pages that are
+	// handled by cpu_read_slow() / cpu_write_slow(), see cpu_map_page()
+	const uint8_t *read_page[0x100];
+	uint8_t *write_page[0x100];
+	// last page instructions were fetched from, see cpu_fetch()
+	uint16_t fetch_page;
+	const uint8_t *fetch_host;
+
+#if (0 < USE_LAZY_FLAGS)
+	// operands of the last 8-bit ALU operation, see cpu_flags_sync()
+	struct
+	{
+		uint8_t op;
+		uint8_t a;
+		uint8_t b;
+		uint8_t c;
+		uint8_t result;
+	} lazy;
 #endif
 
 	uint64_t cycle_cnt;
-	uint64_t next_instruction;
+	uint64_t next_instruction;	// T-cycles since cpu_init()
+
+	// pending device events, binary min-heap ordered by time
+	struct
+	{
+		uint64_t next;				// time of the earliest event
+		uint64_t last_run;			// last call of cpu_sched_run()
+		uint8_t count;
+		uint8_t heap[EVT_COUNT];	// event ids
+		uint8_t pos[EVT_COUNT];		// heap index of every event, SCHED_IDLE: not pending
+		uint64_t time[EVT_COUNT];
+	} sched;
 
-	bool interrupts_enabled;
+	bool interrupts_enabled;	// IME
 	bool stopped;
-} sm83_t;
+	bool halted;				// in HALT, see cpu_halt()
+	uint8_t ei_delay;			// instructions until EI sets IME
+	uint8_t int_pending;		// IE & IF while IME is set, see cpu_int_update()
+
+	// timer, DIV and TIMA are derived from the T-cycle counter, see cpu_timer_sync()
+	struct
+	{
+		uint64_t div_base;	// time the 16 bit divider was 0
+		uint64_t tima_time;	// time tima was valid
+		uint8_t tima;
+		bool reload;		// TIMA overflowed, TMA is loaded after TIMER_RELOAD_CYCLES
+	} timer;
+
+	// LCD, LY is the line of the mode in ppu.mode, see cpu_ppu_event()
+	struct
+	{
+		uint8_t mode;			// STAT mode
+		bool stat_line;			// OR of the enabled STAT interrupt sources
+		uint8_t window_line;	// window lines drawn in this frame
+		uint8_t front;			// frame[front] is complete, the other one is drawn
+		bool draw;				// this frame is drawn, see cpu_set_frame_skip()
+		bool valid;				// frame[front] shows the last frame
+		bool lazy;				// mode 2 stands for the whole line, see cpu_ppu_line()
+		uint64_t line_start;	// time of mode 2 of the current line
+		uint64_t frames;
+		uint8_t bg_palette[64];	// CGB palette RAM, 8 palettes of 4 RGB555 colors
+		uint8_t obj_palette[64];
+		uint16_t frame[2][CPU_SCREEN_HEIGHT][CPU_SCREEN_WIDTH];
+	} ppu;
+
+	// loops found not to be idle, 0x10000 | address of the first instruction
+	uint32_t idle_reject[IDLE_CACHE];
+	cpu_stats_t stats;
+
+	// output of the putc device, see cpu_flush_putc()
+	uint32_t putc_len;
+	uint8_t putc_buf[CPU_PUTC_BUFFER];
+
+	// bank registers of the cartridge, see cpu_mbc_write()
+	struct
+	{
+		bool ram_enabled;
+		uint8_t mode;		// MBC1 banking mode
+		uint16_t rom_reg;
+		uint8_t ram_reg;	// MBC3: 0x08 - 0x0C select an RTC register
+		uint8_t latch_reg;
+		uint32_t rom_bank0;	// banks mapped to 0x0000 and 0x4000
+		uint32_t rom_bank;
+		uint32_t ram_bank;
+		bool ram_mapped;
+	} mbc;
+
+	// host side configuration, kept by cpu_init()
+	cpu_putc_t putc_cb;
+	void *putc_ctx;
+	int putc_fd;
+	uint32_t frame_skip;	// draw every nth frame, 0: only on request
+	// PCM output, see cpu_set_audio()
+	struct
+	{
+		int16_t *buffer;	// NULL: no audio
+		uint32_t frames;	// stereo frames of buffer
+		uint32_t used;
+		cpu_audio_t cb;
+		void *ctx;
+		FILE *wav;			// output of cpu_save_audio()
+		uint32_t wav_frames;
+	} audio;
+	struct
+	{
+		const uint8_t *rom;	// complete image, NULL: 32 KiB at 0x0000
+		cpu_rom_t *image;	// shared mapping of rom, NULL: rom is owned
+		uint32_t rom_banks;	// 16 KiB banks, power of two
+		uint8_t *ram;		// external RAM
+		uint32_t ram_banks;	// 8 KiB banks
+		uint8_t mbc;
+		bool rtc;
+		bool cgb;			// CGB features enabled, by header byte 0x143
+		// MBC3 clock, counts emulated seconds unless halted
+		uint64_t rtc_seconds;
+		uint64_t rtc_time;	// T-cycle of rtc_seconds
+		bool rtc_halt;
+		bool rtc_carry;
+		uint8_t rtc_latched[5];
+	} cart;
+
+	// OAM DMA and the HDMA of the CGB, copied in bulk, see cpu_dma_start()
+	struct
+	{
+		bool active;	// OAM DMA running, its bus is blocked
+		uint8_t bus;	// DMA_BUS_* read by the OAM DMA
+		uint64_t start;	// time of the first byte
+		bool hblank;	// HDMA copies a block in every HBlank
+		uint8_t blocks;	// 16 byte blocks left
+		uint8_t sink[0x100];	// write page of the blocked bus and OAM
+	} dma;
+
+	// CGB banks and CPU speed, see cpu_cgb_bank() and cpu_speed_switch()
+	struct
+	{
+		uint8_t vram_bank;	// VBK
+		uint8_t wram_bank;	// SVBK, 0 and 1 select bank 1
+		uint8_t speed;		// 1: double speed, the CPU clock runs at twice the PPU clock
+	} cgb;
+
+	// sound, synced to the CPU only when it is accessed or a block of
+	// samples is complete, see cpu_apu_run()
+	struct
+	{
+		apu_channel_t ch[APU_CHANNELS];
+		uint64_t time;			// CPU time the APU is synced to
+		uint64_t seq_next;		// time of the next frame sequencer step
+		uint8_t seq_step;
+		uint8_t sweep_timer;	// channel 1 frequency sweep
+		bool sweep_on;
+		uint16_t sweep_period;	// shadow period of the sweep
+		uint16_t lfsr;			// channel 4 noise
+		int32_t gain[APU_CHANNELS][2];	// left / right, by NR50 and NR51
+		int32_t level[APU_CHANNELS][2];	// output of every channel in acc
+		uint64_t pos;			// 16.16 fixed point sample of time in acc
+		int32_t sum[2];			// output at sample 0 of acc
+		int64_t dc[2];			// DC offset removed from the output, 16.16
+		int32_t acc[2][APU_BLOCK + APU_KERNEL];	// band-limited steps of the outputs
+	} apu;
+#if (0 < USE_DYNAREC)
+	dynarec_t *dynarec;
+#endif
+};
+
+// read-only mapping of a cartridge file, shared by all instances using it
+struct cpu_rom_s
+{
+	struct cpu_rom_s *next;
+	char *path;
+	const uint8_t *data;
+	uint32_t size;
+	uint32_t refs;
+};
 
 typedef enum
 {
@@ -148,6 +548,65 @@ typedef enum
 	OPC_BIT2, OPC_RES2, OPC_SET2,
 } opcode2_t;
 
+typedef struct opc_desc_s opc_desc_t;
+typedef void (*opc_handler_t)(sm83_t *cpu, const opc_desc_t *d);
+
+/* fully decoded instruction, built once by cpu_build_decode_table() */
+struct opc_desc_s
+{
+	opc_handler_t handler;	// executes the instruction
+	uint8_t opcode;			// opcode (second byte for CB-prefixed opcodes)
+	uint8_t length;			// instruction length in bytes
+	uint8_t cycles;			// base cycle cost (branch not taken)
+	uint8_t cycles_taken;	// cycle cost if branch is taken
+	uint8_t dst;			// offset of destination register in sm83_t
+	uint8_t src;			// offset of source register in sm83_t
+	uint8_t cond_mask;		// flags tested by a conditional branch
+	uint8_t cond_val;		// expected value of the tested flags
+	uint8_t arg;			// RST vector, BIT/RES/SET mask, pointer increment, ...
+};
+
+#if (0 < USE_DYNAREC)
+// translated block of one instance, returns the number of executed instructions (at most budget)
+typedef uint32_t (*dynarec_code_t)(uint32_t budget);
+
+typedef struct
+{
+	dynarec_code_t code;
+	uint32_t key;		// bank << 16 | pc, DYNAREC_INVALID once invalidated
+	uint16_t start;		// address of the first instruction
+	uint16_t end;		// address of the last byte of the last instruction
+	uint16_t length;	// number of instructions
+	int32_t next;		// next block in the same hash bucket
+} dynarec_block_t;
+
+#if (0 < DYNAREC_VERIFY)
+typedef struct
+{
+	uint16_t af, bc, de, hl, sp, pc;
+} dynarec_regs_t;
+#endif
+
+struct dynarec_s
+{
+	uint8_t *code;							// executable code cache
+	uint32_t code_used;
+	dynarec_block_t blocks[DYNAREC_MAX_BLOCKS];
+	uint32_t n_blocks;
+	int32_t hash[DYNAREC_HASH_SIZE];		// first block per bucket
+	uint8_t hits[0x10000];					// interpreted executions per pc
+	uint8_t code_pages[0x100];				// 256 byte pages containing translated code
+	bool exit_block;						// translated code was overwritten
+	bool verifying;							// running the reference interpreter
+#if (0 < DYNAREC_VERIFY)
+	sm83_t verify_start;
+	sm83_t verify_end;
+	uint8_t verify_ram[2][DYNAREC_VERIFY_RAM];	// cart.ram at start and end of the reference run
+	dynarec_regs_t verify_regs[DYNAREC_MAX_BLOCK_LEN];
+#endif
+};
+#endif
+
 /*---------------------------------------------------------------------*
  *  external declarations                                              *
  *---------------------------------------------------------------------*/
@@ -201,1608 +660,5843 @@ static const opcode2_t opcode_types2[256] =
 	/*Fx*/ OPC_SET  , OPC_SET  , OPC_SET  , OPC_SET  , OPC_SET  , OPC_SET  , OPC_SET2 , OPC_SET  , OPC_SET  , OPC_SET  , OPC_SET  , OPC_SET  , OPC_SET  , OPC_SET  , OPC_SET2 , OPC_SET  ,
 };
 
-static sm83_t cpu;
+// 0x000 - 0x0FF: opcodes, 0x100 - 0x1FF: CB-prefixed opcodes
+static opc_desc_t opc_decode[0x200];
+
+#if (0 < USE_ALU_TABLES) || (0 < BUILD_ALU_BENCHMARK)
+// (result << 8) | flags, see cpu_build_alu_tables()
+static uint16_t alu_add_table[2 * 0x100 * 0x100];
+static uint16_t alu_sub_table[2 * 0x100 * 0x100];
+static uint16_t alu_shift_table[8 * 2 * 0x100];
+#endif
+
+#if !(0 < BUILD_TEST_DLL)
+// band-limited steps at APU_PHASES positions within a sample, see cpu_build_apu_kernel()
+static int16_t apu_kernel[APU_PHASES][APU_KERNEL];
+#endif
+
+// mapped cartridge files, see cpu_rom_open()
+static cpu_rom_t *cpu_roms = NULL;
+static pthread_mutex_t cpu_roms_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*---------------------------------------------------------------------*
  *  private function declarations                                      *
  *---------------------------------------------------------------------*/
+static void cpu_cart_release(sm83_t *cpu);
+static void cpu_sched_events(sm83_t *cpu);
+#if (0 < USE_DYNAREC)
+static void dynarec_init(sm83_t *cpu);
+static void dynarec_destroy(sm83_t *cpu);
+static void dynarec_invalidate(sm83_t *cpu, uint8_t page);
+#endif
 
 /*---------------------------------------------------------------------*
  *  private functions                                                  *
  *---------------------------------------------------------------------*/
-
-/*---------------------------------------------------------------------*
- *  public functions                                                   *
- *---------------------------------------------------------------------*/
-uint8_t cpu_get_memory(uint16_t addr)
+#if !(0 < BUILD_TEST_DLL)
+// VRAM and WRAM 0xD000 - 0xDFFF by the CGB banks, kept out of cpu_page_host()
+static __attribute__((noinline)) uint8_t *cpu_page_bank(sm83_t *cpu, uint8_t page)
 {
-	uint8_t ret = 0;
-
-#if (0 < BUILD_TEST_DLL)
-	ret = ((uint8_t *) &cpu.rom[0])[addr];
-#else
-	if (((addr < 0xFEA0 ) || (addr > 0xFEFF)) &&
-	    ((addr < 0xE000 ) || (addr > 0xFDFF)))
+	if ((0x80 == (page & 0xE0)) && (0 != cpu->cgb.vram_bank))
 	{
-		ret = ((uint8_t *) &cpu.rom[0])[addr];
+		return &cpu->video_ram1[(page & 0x1F) << 8];
 	}
-	else
+	if ((0xD0 == (page & 0xF0)) && (1 < cpu->cgb.wram_bank))
 	{
-		debug_printf ("illegal memory access at 0x%04x.\n", addr);
+		return &cpu->int_ram2_7[cpu->cgb.wram_bank - 2][(page & 0x0F) << 8];
 	}
-#endif
-
-	return ret;
+	return &((uint8_t *) &cpu->rom[0])[page << 8];
 }
+#endif
 
-void cpu_set_memory(uint16_t addr, uint8_t val)
+/* Host address of one page without the write protection of translated
+ * code. NULL: the page is handled by the slow path. */
+static uint8_t *cpu_page_host(sm83_t *cpu, uint8_t page, bool write)
 {
-#if (0 < BUILD_TEST_DLL)
-	((uint8_t *) &cpu.rom[0])[addr] = val;
-#else
-	if (((addr < 0xFEA0 ) || (addr > 0xFEFF)) &&
-	    ((addr < 0xE000 ) || (addr > 0xFDFF)))
+	if ((NULL != cpu->cart.rom) && (page < 0x80))
 	{
-		((uint8_t *) &cpu.rom[0])[addr] = val;
+		uint32_t bank = (page < 0x40) ? cpu->mbc.rom_bank0 : cpu->mbc.rom_bank;
+		// writes go to the bank registers
+		return write ? NULL : (uint8_t *) &cpu->cart.rom[(bank << 14) | ((page & 0x3F) << 8)];
 	}
-#if (USE_0xE000_AS_PUTC_DEVICE)
-	else if (addr == 0xE000)
+	if ((NULL != cpu->cart.rom) && (0xA0 == (page & 0xE0)))
 	{
-		putc(val, stdout);
-		fflush(stdout);
+		return cpu->mbc.ram_mapped ? &cpu->cart.ram[(cpu->mbc.ram_bank << 13) | ((page & 0x1F) << 8)] : NULL;
 	}
-#endif
-	else
+#if (0 < BUILD_TEST_DLL)
+	return &((uint8_t *) &cpu->rom[0])[page << 8];
+#else
+	if ((0x80 == (page & 0xE0)) || (0xD0 == (page & 0xF0)))
 	{
-		debug_printf ("illegal memory access at 0x%04x.\n", addr);
+		return cpu_page_bank(cpu, page);
 	}
+	// ROM, VRAM, external RAM and WRAM, everything above is special
+	return (page < 0xE0) ? &((uint8_t *) &cpu->rom[0])[page << 8] : NULL;
 #endif
-
-	debug_printf("\nwrote %02x to %04x\n", val, addr);
 }
 
-void cpu_init(void)
+// bus a page is accessed through, the CGB has its WRAM on a bus of its own
+static uint8_t cpu_dma_bus(sm83_t *cpu, uint8_t page)
 {
-	memset(&cpu, 0, sizeof(cpu));
+	if (0x80 == (page & 0xE0))
+	{
+		return DMA_BUS_VRAM;
+	}
+	if ((page < 0x80) || (0xA0 == (page & 0xE0)))
+	{
+		return DMA_BUS_CART;
+	}
+	if (page < 0xFE)
+	{
+		return cpu->cart.cgb ? DMA_BUS_WRAM : DMA_BUS_CART;
+	}
+	return DMA_BUS_NONE;
 }
 
-void cpu_isr_handled(void)
+/* Sets the fast path of one page. Everything that needs more than a plain
+ * load or store - I/O registers, the putc device, bank registers, unusable
+ * areas and pages with translated code - is left to the slow path. */
+static void cpu_map_page(sm83_t *cpu, uint8_t page)
 {
-	#warning what to do here?
-}
+	cpu->fetch_page = 0x100;	// no page cached
 
-void eval_Z_flag(uint8_t reg)
-{
-	if (0 == reg)
-	{
-		cpu.af.f |= FLAG_Z;
-	}
-	else
+	cpu->read_page[page] = cpu_page_host(cpu, page, false);
+	cpu->write_page[page] = cpu_page_host(cpu, page, true);
+#if (0 < USE_DYNAREC)
+	if (0 != cpu->dynarec->code_pages[page])
 	{
-		cpu.af.f &= ~FLAG_Z;
+		cpu->write_page[page] = NULL;
 	}
+#endif
 }
 
-void set_Z_flag(bool zero)
+/* Opcode and operand fetches mostly stay within one page. Comparing against
+ * the cached page does not depend on a load of the page table, which keeps
+ * the table lookup out of the dispatch chain of the interpreter. */
+static inline uint8_t cpu_fetch(sm83_t *cpu, uint16_t addr)
 {
-	if (zero)
+	if ((addr >> 8) == cpu->fetch_page)
 	{
-		cpu.af.f |= FLAG_Z;
+		return cpu->fetch_host[addr & 0xFF];
 	}
-	else
+	if (NULL == cpu->read_page[addr >> 8])
 	{
-		cpu.af.f &= ~FLAG_Z;
+		return cpu_get_memory(cpu, addr);
 	}
+	cpu->fetch_page = addr >> 8;
+	cpu->fetch_host = cpu->read_page[addr >> 8];
+	return cpu->fetch_host[addr & 0xFF];
 }
 
-void set_N_flag(bool subtract)
+/* While an OAM DMA runs, reads of its bus and of OAM are left to the slow
+ * path and writes go to a sink. The MBC cannot be written on a blocked bus,
+ * so cpu_map_page() is not called for its pages meanwhile. */
+static void cpu_map_pages(sm83_t *cpu, uint32_t first, uint32_t last)
 {
-	if (subtract)
-	{
-		cpu.af.f |= FLAG_N;
-	}
-	else
+	for (uint32_t page = first; page <= last; page++)
 	{
-		cpu.af.f &= ~FLAG_N;
+		cpu_map_page(cpu, page);
+		if (cpu->dma.active && ((0xFE == page) || (cpu_dma_bus(cpu, page) == cpu->dma.bus)))
+		{
+			cpu->read_page[page] = NULL;
+			cpu->write_page[page] = cpu->dma.sink;
+		}
 	}
 }
 
-void eval_H_flag_c(uint8_t target, uint8_t operand, bool sub, uint8_t carry)
+static void cpu_map_memory(sm83_t *cpu)
 {
-	bool h;
-	uint8_t temp = target + operand;
-	if (!sub)
+	cpu_map_pages(cpu, 0x00, 0xFF);
+}
+
+/* The clock has a crystal of its own, like the LCD it keeps its rate in
+ * double speed mode. The fraction of a second is kept in rtc_time. */
+static uint64_t cpu_rtc_now(sm83_t *cpu)
+{
+	uint64_t now = cpu->next_instruction;
+	uint64_t seconds = ((now - cpu->cart.rtc_time) >> cpu->cgb.speed) / MBC_RTC_CYCLES;
+
+	if (cpu->cart.rtc_halt)
 	{
-		h = ((target & 0xF) + (operand & 0xF) + carry) > 0xF;
+		cpu->cart.rtc_time = now;
 	}
 	else
 	{
-		h = ((int)((target & 0xf) - (operand & 0xf) - carry) < 0);
-	}
-
-	if (h)
-	{
-		cpu.af.f |= FLAG_H;
+		cpu->cart.rtc_seconds += seconds;
+		cpu->cart.rtc_time += PPU_TIME(cpu, seconds * MBC_RTC_CYCLES);
 	}
-	else
+	if (MBC_RTC_WRAP <= cpu->cart.rtc_seconds)
 	{
-		cpu.af.f &= ~FLAG_H;
+		cpu->cart.rtc_seconds %= MBC_RTC_WRAP;
+		cpu->cart.rtc_carry = true;
 	}
 
-	return;
+	return cpu->cart.rtc_seconds;
 }
 
-void eval_H_flag(uint8_t target, uint8_t operand, bool sub)
+static void cpu_rtc_latch(sm83_t *cpu)
 {
-	eval_H_flag_c(target, operand, sub, 0);
+	uint64_t seconds = cpu_rtc_now(cpu);
+	uint32_t days = seconds / MBC_RTC_DAY;
+
+	cpu->cart.rtc_latched[0] = seconds % 60;
+	cpu->cart.rtc_latched[1] = (seconds / 60) % 60;
+	cpu->cart.rtc_latched[2] = (seconds / 3600) % 24;
+	cpu->cart.rtc_latched[3] = days & 0xFF;
+	cpu->cart.rtc_latched[4] = ((days >> 8) & 0x01) | (cpu->cart.rtc_halt ? 0x40 : 0) | (cpu->cart.rtc_carry ? 0x80 : 0);
 }
 
-void eval_H_flag_16(uint16_t target, uint16_t operand)
+static void cpu_rtc_write(sm83_t *cpu, uint8_t reg, uint8_t val)
 {
-	if (((target & 0xFFF) + (operand & 0xFFF)) > 0xFFF)
-	{
-		cpu.af.f |= FLAG_H;
-	}
-	else
+	uint64_t seconds = cpu_rtc_now(cpu);
+	uint32_t s = seconds % 60;
+	uint32_t m = (seconds / 60) % 60;
+	uint32_t h = (seconds / 3600) % 24;
+	uint32_t days = seconds / MBC_RTC_DAY;
+
+	switch (reg)
 	{
-		cpu.af.f &= ~FLAG_H;
+		case 0x08: s = val % 60; break;
+		case 0x09: m = val % 60; break;
+		case 0x0A: h = val % 24; break;
+		case 0x0B: days = (days & 0x100) | val; break;
+		case 0x0C:
+			days = (days & 0xFF) | ((val & 0x01) << 8);
+			cpu->cart.rtc_halt = (0 != (val & 0x40));
+			cpu->cart.rtc_carry = (0 != (val & 0x80));
+			break;
+		default: break;
 	}
-
-	return;
+	cpu->cart.rtc_seconds = (uint64_t) days * MBC_RTC_DAY + h * 3600 + m * 60 + s;
+	cpu->cart.rtc_latched[reg - 0x08] = val;
 }
 
-void set_H_flag(bool h)
+/* Recomputes the banks from the MBC registers and repoints only the pages
+ * of the windows that changed. The image is never copied. */
+static void cpu_mbc_update(sm83_t *cpu)
 {
-	if (h)
+	uint32_t rom_bank0 = 0;
+	uint32_t rom_bank = 1;
+	uint32_t ram_bank = 0;
+	bool ram_mapped = (NULL != cpu->cart.ram);
+
+	switch (cpu->cart.mbc)
 	{
-		cpu.af.f |= FLAG_H;
+		case MBC_1:
+			rom_bank = (cpu->mbc.ram_reg << 5) | cpu->mbc.rom_reg;
+			if (0 != cpu->mbc.mode)
+			{
+				rom_bank0 = cpu->mbc.ram_reg << 5;
+				ram_bank = cpu->mbc.ram_reg;
+			}
+			ram_mapped = ram_mapped && cpu->mbc.ram_enabled;
+			break;
+		case MBC_3:
+			rom_bank = cpu->mbc.rom_reg;
+			ram_bank = cpu->mbc.ram_reg;
+			ram_mapped = ram_mapped && cpu->mbc.ram_enabled && (cpu->mbc.ram_reg < 0x08);
+			break;
+		case MBC_5:
+			rom_bank = cpu->mbc.rom_reg;
+			ram_bank = cpu->mbc.ram_reg;
+			ram_mapped = ram_mapped && cpu->mbc.ram_enabled;
+			break;
+		default:
+			break;
 	}
-	else
+	rom_bank0 &= cpu->cart.rom_banks - 1;
+	rom_bank &= cpu->cart.rom_banks - 1;
+	ram_bank &= (0 < cpu->cart.ram_banks) ? (cpu->cart.ram_banks - 1) : 0;
+
+	if (rom_bank0 != cpu->mbc.rom_bank0)
+	{
+		cpu->mbc.rom_bank0 = rom_bank0;
+		for (uint32_t page = 0x00; page < 0x40; page++)
+		{
+			cpu_map_page(cpu, page);
+		}
+	}
+	if (rom_bank != cpu->mbc.rom_bank)
+	{
+		cpu->mbc.rom_bank = rom_bank;
+		for (uint32_t page = 0x40; page < 0x80; page++)
+		{
+			cpu_map_page(cpu, page);
+		}
+#if (0 < USE_DYNAREC)
+		// the running block may continue in the bank that was switched out
+		cpu->dynarec->exit_block = true;
+#endif
+	}
+	if ((ram_bank != cpu->mbc.ram_bank) || (ram_mapped != cpu->mbc.ram_mapped))
 	{
-		cpu.af.f &= ~FLAG_H;
+		cpu->mbc.ram_bank = ram_bank;
+		cpu->mbc.ram_mapped = ram_mapped;
+		for (uint32_t page = 0xA0; page < 0xC0; page++)
+		{
+			cpu_map_page(cpu, page);
+		}
 	}
 }
 
-void eval_C_flag_c(uint8_t target, uint8_t operand, bool sub, uint8_t carry)
+static void cpu_mbc_reset(sm83_t *cpu)
 {
-	bool c;
-	if (!sub)
+	memset(&cpu->mbc, 0, sizeof(cpu->mbc));
+	cpu->mbc.rom_reg = 1;
+	cpu_mbc_update(cpu);
+	cpu_map_memory(cpu);
+}
+
+// writes to 0x0000 - 0x7FFF, and to 0xA000 - 0xBFFF while no RAM is mapped
+static void cpu_mbc_write(sm83_t *cpu, uint16_t addr, uint8_t val)
+{
+	if (0xA000 <= addr)
 	{
-		c = ((uint16_t)(target + operand + carry)) > 0xFF;
+		if ((MBC_3 == cpu->cart.mbc) && cpu->cart.rtc && cpu->mbc.ram_enabled &&
+		    IS_IN_RANGE(cpu->mbc.ram_reg, 0x08, 0x0C))
+		{
+			cpu_rtc_write(cpu, cpu->mbc.ram_reg, val);
+		}
+		return;
 	}
-	else
+
+	switch (addr >> 13)
 	{
-		c = ((int) (target - operand - carry) < 0);
+		case 0:	// 0x0000 - 0x1FFF: RAM (and RTC) enable
+			cpu->mbc.ram_enabled = (0x0A == (val & 0x0F));
+			break;
+		case 1:	// 0x2000 - 0x3FFF: ROM bank
+			if (MBC_1 == cpu->cart.mbc)
+			{
+				cpu->mbc.rom_reg = (0 != (val & 0x1F)) ? (val & 0x1F) : 1;
+			}
+			else if (MBC_3 == cpu->cart.mbc)
+			{
+				cpu->mbc.rom_reg = (0 != (val & 0x7F)) ? (val & 0x7F) : 1;
+			}
+			else if ((MBC_5 == cpu->cart.mbc) && (addr < 0x3000))
+			{
+				cpu->mbc.rom_reg = (cpu->mbc.rom_reg & 0x100) | val;
+			}
+			else if (MBC_5 == cpu->cart.mbc)
+			{
+				cpu->mbc.rom_reg = (cpu->mbc.rom_reg & 0xFF) | ((val & 0x01) << 8);
+			}
+			break;
+		case 2:	// 0x4000 - 0x5FFF: RAM bank, upper ROM bank bits or RTC register
+			cpu->mbc.ram_reg = (MBC_1 == cpu->cart.mbc) ? (val & 0x03) : (val & 0x0F);
+			break;
+		default:	// 0x6000 - 0x7FFF: MBC1 banking mode, MBC3 clock latch
+			if (MBC_1 == cpu->cart.mbc)
+			{
+				cpu->mbc.mode = val & 0x01;
+			}
+			else if ((MBC_3 == cpu->cart.mbc) && cpu->cart.rtc && (0 == cpu->mbc.latch_reg) && (1 == val))
+			{
+				cpu_rtc_latch(cpu);
+			}
+			cpu->mbc.latch_reg = val;
+			break;
 	}
 
-	if (c)
+	if (MBC_NONE != cpu->cart.mbc)
 	{
-		cpu.af.f |= FLAG_C;
+		cpu_mbc_update(cpu);
 	}
-	else
+}
+
+// reads from 0xA000 - 0xBFFF while no RAM is mapped
+static uint8_t cpu_mbc_read(sm83_t *cpu)
+{
+	if ((MBC_3 == cpu->cart.mbc) && cpu->cart.rtc && cpu->mbc.ram_enabled &&
+	    IS_IN_RANGE(cpu->mbc.ram_reg, 0x08, 0x0C))
 	{
-		cpu.af.f &= ~FLAG_C;
+		return cpu->cart.rtc_latched[cpu->mbc.ram_reg - 0x08];
 	}
+	return 0xFF;
+}
 
-	return;
+// time of the earliest event, SCHED_NEVER: none
+static inline uint64_t cpu_sched_first(sm83_t *cpu)
+{
+	return (0 < cpu->sched.count) ? cpu->sched.time[cpu->sched.heap[0]] : SCHED_NEVER;
 }
 
-void eval_C_flag(uint8_t target, uint8_t operand, bool sub)
+/* sched.next is the deadline checked after every instruction: the earliest
+ * event, or now if an interrupt has to be dispatched or EI takes effect. */
+static void cpu_sched_update(sm83_t *cpu)
 {
-	eval_C_flag_c(target, operand, sub, 0);
+	cpu->sched.next = ((0 != cpu->int_pending) || (0 != cpu->ei_delay)) ? 0 : cpu_sched_first(cpu);
 }
 
-void eval_C_flag_16(uint16_t target, uint16_t operand)
+static void cpu_sched_swap(sm83_t *cpu, uint8_t i, uint8_t j)
 {
-	if ((((uint32_t) target) + ((uint32_t) operand)) > 0xFFFF)
-	{
-		cpu.af.f |= FLAG_C;
-	}
-	else
-	{
-		cpu.af.f &= ~FLAG_C;
-	}
+	uint8_t id = cpu->sched.heap[i];
 
-	return;
+	cpu->sched.heap[i] = cpu->sched.heap[j];
+	cpu->sched.heap[j] = id;
+	cpu->sched.pos[cpu->sched.heap[i]] = i;
+	cpu->sched.pos[cpu->sched.heap[j]] = j;
 }
 
-void set_C_flag(bool c)
+static void cpu_sched_fix(sm83_t *cpu, uint8_t i)
 {
-	if (c)
+	uint64_t *time = cpu->sched.time;
+	uint8_t *heap = cpu->sched.heap;
+
+	while ((0 < i) && (time[heap[i]] < time[heap[(i - 1) / 2]]))
 	{
-		cpu.af.f |= FLAG_C;
+		cpu_sched_swap(cpu, i, (i - 1) / 2);
+		i = (i - 1) / 2;
 	}
-	else
+	for (;;)
 	{
-		cpu.af.f &= ~FLAG_C;
+		uint8_t min = i;
+		uint8_t child = 2 * i + 1;
+
+		if ((child < cpu->sched.count) && (time[heap[child]] < time[heap[min]]))
+		{
+			min = child;
+		}
+		if ((child + 1 < cpu->sched.count) && (time[heap[child + 1]] < time[heap[min]]))
+		{
+			min = child + 1;
+		}
+		if (min == i)
+		{
+			break;
+		}
+		cpu_sched_swap(cpu, i, min);
+		i = min;
 	}
+
+	cpu_sched_update(cpu);
 }
 
-void cpu_handle_opcode(void)
+#if !(0 < BUILD_TEST_DLL)
+/* Lets event id happen at T-cycle when, replacing an earlier deadline of
+ * the same event. */
+static void cpu_sched_add(sm83_t *cpu, cpu_event_t id, uint64_t when)
 {
-	uint8_t opcode;
-	opcode_t opcode_type;
-
-	opcode = cpu_get_memory(cpu.pc);
-	opcode_type = opcode_types[opcode];
+	uint8_t i = cpu->sched.pos[id];
 
-	switch (opcode_type)
-	{
-	case OPC_NONE:
+	if (SCHED_IDLE == i)
 	{
-		DBG_ERROR();
+		i = cpu->sched.count++;
+		cpu->sched.heap[i] = id;
+		cpu->sched.pos[id] = i;
 	}
-	break;
+	cpu->sched.time[id] = when;
+	cpu_sched_fix(cpu, i);
+}
+#endif
 
-	case OPC_NOP:
-	{
-		cpu.next_instruction += 4;
-		cpu.pc++;
-	}
-	break;
-	
-	case OPC_STOP:
+static void cpu_sched_remove(sm83_t *cpu, cpu_event_t id)
+{
+	uint8_t i = cpu->sched.pos[id];
+
+	if (SCHED_IDLE == i)
 	{
-		cpu.stopped = true;
-		cpu.next_instruction += 4;
-		cpu.pc += 2;
+		return;
 	}
-	break;
-	
-	case OPC_HALT:
+	cpu->sched.count--;
+	if (i != cpu->sched.count)
 	{
-		cpu.next_instruction += 4;
-		cpu.pc++;
+		cpu_sched_swap(cpu, i, cpu->sched.count);
 	}
-	break;
-	
-	case OPC_EI:
+	cpu->sched.pos[id] = SCHED_IDLE;
+	if (i != cpu->sched.count)
 	{
-		cpu.interrupts_enabled = true;
-		cpu.next_instruction += 4;
-		cpu.pc++;
+		cpu_sched_fix(cpu, i);
 	}
-	break;
-	
-	case OPC_DI:
+	else
 	{
-		cpu.interrupts_enabled = false;
-		cpu.next_instruction += 4;
-		cpu.pc++;
+		cpu_sched_update(cpu);
 	}
-	break;
-	
-	case OPC_DAA:
-	{
-		uint8_t a_reg = cpu.af.a;
-		bool N = (0 != (cpu.af.f & FLAG_N));
-		bool C = (0 != (cpu.af.f & FLAG_C));
-		bool H = (0 != (cpu.af.f & FLAG_H));
-		bool new_C = C;
-		if (!N)
-		{  // after an addition, adjust if (half-)carry occurred or if result is out of bounds
-			if (C || (a_reg > 0x99))
-			{
-				a_reg += 0x60;
-				new_C = true;
-			}
-			if (H || ((a_reg & 0x0f) > 0x09))
-			{
-				a_reg += 0x6;
-			}
-		} 
-		else
-		{  // after a subtraction, only adjust if (half-)carry occurred
-			if (C)
-			{
-				a_reg -= 0x60;
-			}
-			if (H)
-			{
-				a_reg -= 0x6;
-			}
-		}
-		set_C_flag(new_C);
-		set_H_flag(false);
-		eval_Z_flag(a_reg);
-		cpu.af.a = a_reg;
-		cpu.next_instruction += 4;
-		cpu.pc++;
+}
+
+static void cpu_sched_reset(sm83_t *cpu)
+{
+	cpu->sched.next = SCHED_NEVER;
+	cpu->sched.count = 0;
+	memset(cpu->sched.pos, SCHED_IDLE, sizeof(cpu->sched.pos));
+}
+
+/* Caches the interrupts to dispatch, so the interpreter only needs the
+ * deadline check of the scheduler. Called whenever IME, IE or IF change. */
+static void cpu_int_update(sm83_t *cpu)
+{
+#if !(0 < BUILD_TEST_DLL)
+	cpu->int_pending = cpu->interrupts_enabled ? (cpu->int_en[0x7F] & cpu->dev_map[IO_IF] & 0x1F) : 0;
+#endif
+	cpu_sched_update(cpu);
+}
+
+#if !(0 < BUILD_TEST_DLL)
+static void cpu_int_request(sm83_t *cpu, uint8_t flag)
+{
+	cpu->dev_map[IO_IF] |= flag;
+	cpu_int_update(cpu);
+}
+
+// calls the handler of the requested interrupt with the highest priority
+static void cpu_int_dispatch(sm83_t *cpu)
+{
+	uint8_t bit = __builtin_ctz(cpu->int_pending);
+
+	cpu->dev_map[IO_IF] &= ~(1 << bit);
+	cpu->interrupts_enabled = false;
+	cpu_set_memory(cpu, --cpu->sp, HIGH_BYTE(cpu->pc));
+	cpu_set_memory(cpu, --cpu->sp, LOW_BYTE(cpu->pc));
+	cpu->pc = 0x40 + 8 * bit;
+	cpu->next_instruction += 20;
+	cpu_int_update(cpu);
+}
+#endif
+
+static void cpu_serial_event(sm83_t *cpu, uint64_t when)
+{
+	(void) when;
+#if !(0 < BUILD_TEST_DLL)
+	// no link partner, 1s are shifted in
+	cpu->dev_map[IO_SB] = 0xFF;
+	cpu->dev_map[IO_SC] &= 0x7F;
+	cpu_int_request(cpu, INT_SERIAL);
+#endif
+}
+
+#if !(0 < BUILD_TEST_DLL)
+/* TIMA counts the falling edges of one bit of the divider, which counts
+ * T-cycles. The edges of bit n are 2^(n+1) T-cycles apart. */
+static const uint16_t timer_periods[4] = { 1024, 16, 64, 256 };
+
+// TIMA input: the selected divider bit while the timer is enabled
+static bool cpu_timer_signal(sm83_t *cpu, uint8_t tac, uint64_t now)
+{
+	uint32_t period = timer_periods[tac & 0x03];
+
+	return (0 != (tac & 0x04)) && (0 != ((now - cpu->timer.div_base) & (period / 2)));
+}
+
+// falling edges of the TIMA input in (from, to]
+static uint64_t cpu_timer_edges(sm83_t *cpu, uint64_t from, uint64_t to)
+{
+	uint32_t period = timer_periods[cpu->dev_map[IO_TAC] & 0x03];
+
+	if ((0 == (cpu->dev_map[IO_TAC] & 0x04)) || cpu->timer.reload)
+	{
+		return 0;
 	}
-	break;
-	
-	case OPC_CPL:
+	return (to - cpu->timer.div_base) / period - (from - cpu->timer.div_base) / period;
+}
+
+/* Brings tima up to now. Overflows are events, so the due events have to
+ * run first. */
+static void cpu_timer_sync(sm83_t *cpu)
+{
+	uint64_t now = cpu->next_instruction;
+
+	cpu_sched_events(cpu);
+	cpu->timer.tima += cpu_timer_edges(cpu, cpu->timer.tima_time, now);
+	cpu->timer.tima_time = now;
+}
+
+// schedules the next overflow of TIMA
+static void cpu_timer_schedule(sm83_t *cpu)
+{
+	uint32_t period = timer_periods[cpu->dev_map[IO_TAC] & 0x03];
+	uint64_t edge;
+
+	if (cpu->timer.reload)
 	{
-		set_N_flag(true);
-		set_H_flag(true);
-		cpu.af.a = ~cpu.af.a;
-		cpu.next_instruction += 4;
-		cpu.pc++;
+		return;
 	}
-	break;
-	
-	case OPC_SCF:
+	if (0 == (cpu->dev_map[IO_TAC] & 0x04))
 	{
-		set_N_flag(false);
-		set_H_flag(false);
-		set_C_flag(true);
-		cpu.next_instruction += 4;
-		cpu.pc++;
+		cpu_sched_remove(cpu, EVT_TIMER);
+		return;
 	}
-	break;
-	
-	case OPC_CCF:
-	{
-		set_N_flag(false);
-		set_H_flag(false);
-		set_C_flag((0 == (cpu.af.f & FLAG_C)));
-		cpu.next_instruction += 4;
-		cpu.pc++;
-	}
-	break;
-
-	case OPC_RLCA:
-	{
-		bool bit7 = (0 != (cpu.af.a & (1<<7)));
-		cpu.af.a = (cpu.af.a << 1) | (bit7 ? 0x1 : 0);
-		set_Z_flag(false);
-		set_N_flag(false);
-		set_H_flag(false);
-		set_C_flag(bit7);
-		cpu.next_instruction += 4;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_RLA:
-	{
-		bool bit7 = (0 != (cpu.af.a & (1<<7)));
-		bool c = (0 != (cpu.af.f & FLAG_C));
-		cpu.af.a = (cpu.af.a << 1) | (c ? 0x1 : 0);
-		set_Z_flag(false);
-		set_N_flag(false);
-		set_H_flag(false);
-		set_C_flag(bit7);
-		cpu.next_instruction += 4;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_RRCA:
-	{
-		bool bit0 = (0 != (cpu.af.a & (1<<0)));
-		cpu.af.a = (cpu.af.a >> 1) | (bit0 ? 0x80 : 0);
-		set_Z_flag(false);
-		set_N_flag(false);
-		set_H_flag(false);
-		set_C_flag(bit0);
-		cpu.next_instruction += 4;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_RRA:
-	{
-		bool bit0 = (0 != (cpu.af.a & (1<<0)));
-		bool c = (0 != (cpu.af.f & FLAG_C));
-		cpu.af.a = (cpu.af.a >> 1) | (c ? 0x80 : 0);
-		set_Z_flag(false);
-		set_N_flag(false);
-		set_H_flag(false);
-		set_C_flag(bit0);
-		cpu.next_instruction += 4;
-		cpu.pc += 1;
-	}
-	break;
+	edge = (cpu->timer.tima_time - cpu->timer.div_base) / period + (0x100 - cpu->timer.tima);
+	cpu_sched_add(cpu, EVT_TIMER, cpu->timer.div_base + edge * period);
+}
 
-	case OPC_CB:
+// TIMA reads 0 until it is reloaded
+static void cpu_timer_overflow(sm83_t *cpu, uint64_t when)
+{
+	cpu->timer.tima = 0;
+	cpu->timer.tima_time = when;
+	cpu->timer.reload = true;
+	cpu_sched_add(cpu, EVT_TIMER, when + TIMER_RELOAD_CYCLES);
+}
+
+// a glitch increments TIMA outside of the regular edges
+static void cpu_timer_increment(sm83_t *cpu)
+{
+	if (0 == ++cpu->timer.tima)
 	{
-		uint8_t opcode2 = cpu_get_memory(cpu.pc + 1);;
-		opcode2_t opcode_type2 = opcode_types2[opcode2];
-		uint8_t *target_lut[8] = {
-			&cpu.bc.b, &cpu.bc.c, &cpu.de.d, &cpu.de.e,
-			&cpu.hl.h, &cpu.hl.l, NULL     , &cpu.af.a
-		};
-		uint8_t i = opcode2 & 0x07;
-		uint8_t *target_p = target_lut[i];
-		uint8_t duration = (i == 6) ? 16 : 8;
+		cpu_timer_overflow(cpu, cpu->next_instruction);
+	}
+}
+#endif
 
-		switch (opcode_type2)
-		{
-		case OPC_RLC:
-		{
-			bool bit7 = (0 != (*target_p & (1<<7)));
-			*target_p = (*target_p << 1) | (bit7 ? 1 : 0);
-			eval_Z_flag(*target_p);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit7);
-		}
-		break;
-		
-		case OPC_RRC:
-		{
-			bool bit0 = (0 != (*target_p & (1<<0)));
-			*target_p = (*target_p >> 1)| (bit0 ? 0x80 : 0);
-			eval_Z_flag(*target_p);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit0);
-		}
-		break;
-		
-		case OPC_RL:
-		{
-			bool bit7 = (0 != (*target_p & (1<<7)));
-			bool c = (0 != (cpu.af.f & FLAG_C));
-			*target_p = (*target_p << 1) | (c ? 0x1 : 0);
-			eval_Z_flag(*target_p);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit7);
-		}
-		break;
-		
-		case OPC_RR:
-		{
-			bool bit0 = (0 != (*target_p & (1<<0)));
-			bool c = (0 != (cpu.af.f & FLAG_C));
-			*target_p = (*target_p >> 1) | (c ? 0x80 : 0);
-			eval_Z_flag(*target_p);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit0);
-		}
-		break;
-		
-		case OPC_SLA:
+static void cpu_timer_event(sm83_t *cpu, uint64_t when)
+{
+#if !(0 < BUILD_TEST_DLL)
+	if (!cpu->timer.reload)
+	{
+		cpu_timer_overflow(cpu, when);
+	}
+	else
+	{
+		cpu->timer.reload = false;
+		cpu->timer.tima = cpu->dev_map[IO_TMA];
+		cpu->timer.tima_time = when;
+		cpu_int_request(cpu, INT_TIMER);
+		cpu_timer_schedule(cpu);
+	}
+#endif
+}
+
+#if !(0 < BUILD_TEST_DLL)
+// DMG shades, white to black
+static const uint16_t ppu_dmg_colors[4] = { 0x7FFF, 0x56B5, 0x294A, 0x0000 };
+
+/* The STAT interrupt is requested when the OR of its enabled sources
+ * rises, a source becoming true while another one is active is lost. */
+static void cpu_ppu_stat(sm83_t *cpu)
+{
+	uint8_t stat = cpu->dev_map[IO_STAT];
+	uint8_t mode = cpu->ppu.mode;
+	bool line = (0 != (cpu->dev_map[IO_LCDC] & 0x80)) &&
+	            (((0 != (stat & 0x40)) && (cpu->dev_map[IO_LY] == cpu->dev_map[IO_LYC])) ||
+	             ((0 != (stat & 0x08)) && (0 == mode)) ||
+	             ((0 != (stat & 0x10)) && (1 == mode)) ||
+	             ((0 != (stat & 0x20)) && (2 == mode)));
+
+	if (line && !cpu->ppu.stat_line)
+	{
+		cpu_int_request(cpu, INT_STAT);
+	}
+	cpu->ppu.stat_line = line;
+}
+
+// 2 bit color indices of n tile rows, given as pairs of bit planes (low, high)
+static void cpu_ppu_decode_scalar(const uint8_t *rows, uint8_t *pixels, uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++)
+	{
+		uint8_t lo = rows[2 * i];
+		uint8_t hi = rows[2 * i + 1];
+
+		for (uint32_t x = 0; x < 8; x++)
 		{
-			bool bit7 = (0 != (*target_p & (1<<7)));
-			*target_p = (*target_p << 1);
-			eval_Z_flag(*target_p);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit7);
+			pixels[8 * i + x] = (((hi >> (7 - x)) & 1) << 1) | ((lo >> (7 - x)) & 1);
 		}
-		break;
-		
-		case OPC_SRA:
+	}
+}
+
+// RGB555 colors of n color indices, colors has 32 entries (8 palettes of 4 colors)
+static void cpu_ppu_colors_scalar(const uint8_t *pixels, const uint16_t *colors, uint16_t *out, uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++)
+	{
+		out[i] = colors[pixels[i]];
+	}
+}
+
+#if (0 < USE_PPU_SIMD)
+/* Each byte of a vector holds one pixel: the plane bytes are repeated
+ * eight times by unpacking them with themselves, then every byte tests its
+ * own bit. Two tiles per vector. */
+static void cpu_ppu_decode_sse2(const uint8_t *rows, uint8_t *pixels, uint32_t n)
+{
+	const __m128i bits = _mm_setr_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i two = _mm_set1_epi8(2);
+	uint32_t i = 0;
+
+	for (; i + 2 <= n; i += 2)
+	{
+		int32_t planes;
+		memcpy(&planes, &rows[2 * i], sizeof(planes));
+		__m128i v = _mm_cvtsi32_si128(planes);		// lo0 hi0 lo1 hi1
+		v = _mm_unpacklo_epi8(v, v);
+		v = _mm_unpacklo_epi16(v, v);				// lo0 x4, hi0 x4, lo1 x4, hi1 x4
+		__m128i t0 = _mm_unpacklo_epi32(v, v);
+		__m128i t1 = _mm_unpackhi_epi32(v, v);
+		__m128i lo = _mm_unpacklo_epi64(t0, t1);	// lo0 x8, lo1 x8
+		__m128i hi = _mm_unpackhi_epi64(t0, t1);
+
+		lo = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(lo, bits), bits), one);
+		hi = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(hi, bits), bits), two);
+		_mm_storeu_si128((__m128i *) &pixels[8 * i], _mm_or_si128(lo, hi));
+	}
+	cpu_ppu_decode_scalar(&rows[2 * i], &pixels[8 * i], n - i);
+}
+
+// four tiles per vector, the plane bytes are spread with a byte shuffle
+__attribute__((target("avx2")))
+static void cpu_ppu_decode_avx2(const uint8_t *rows, uint8_t *pixels, uint32_t n)
+{
+	const __m256i bits = _mm256_set1_epi64x(0x0102040810204080LL);
+	const __m256i lo_sel = _mm256_setr_epi64x(0x0000000000000000LL, 0x0202020202020202LL,
+	                                          0x0404040404040404LL, 0x0606060606060606LL);
+	const __m256i hi_sel = _mm256_add_epi8(lo_sel, _mm256_set1_epi8(1));
+	const __m256i one = _mm256_set1_epi8(1);
+	const __m256i two = _mm256_set1_epi8(2);
+	uint32_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		int64_t planes;
+		memcpy(&planes, &rows[2 * i], sizeof(planes));
+		__m256i v = _mm256_set1_epi64x(planes);		// both lanes hold all 4 tiles
+		__m256i lo = _mm256_shuffle_epi8(v, lo_sel);
+		__m256i hi = _mm256_shuffle_epi8(v, hi_sel);
+
+		lo = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(lo, bits), bits), one);
+		hi = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(hi, bits), bits), two);
+		_mm256_storeu_si256((__m256i *) &pixels[8 * i], _mm256_or_si256(lo, hi));
+	}
+	cpu_ppu_decode_sse2(&rows[2 * i], &pixels[8 * i], n - i);
+}
+
+/* The low and high bytes of the 32 colors are looked up with byte shuffles
+ * of 16 entries each, bit 4 of the index selects between two of them. */
+__attribute__((target("avx2")))
+static void cpu_ppu_colors_avx2(const uint8_t *pixels, const uint16_t *colors, uint16_t *out, uint32_t n)
+{
+	uint8_t bytes[4][16];	// low bytes of colors 0 - 15, 16 - 31, high bytes
+	uint32_t i = 0;
+
+	for (uint32_t c = 0; c < 32; c++)
+	{
+		bytes[c / 16][c % 16] = (uint8_t) colors[c];
+		bytes[2 + c / 16][c % 16] = (uint8_t) (colors[c] >> 8);
+	}
+	const __m256i lo0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) bytes[0]));
+	const __m256i lo1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) bytes[1]));
+	const __m256i hi0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) bytes[2]));
+	const __m256i hi1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) bytes[3]));
+
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i idx = _mm256_loadu_si256((const __m256i *) &pixels[i]);
+		__m256i upper = _mm256_slli_epi16(idx, 3);	// bit 4 to bit 7, the blend mask
+		__m256i lo = _mm256_blendv_epi8(_mm256_shuffle_epi8(lo0, idx), _mm256_shuffle_epi8(lo1, idx), upper);
+		__m256i hi = _mm256_blendv_epi8(_mm256_shuffle_epi8(hi0, idx), _mm256_shuffle_epi8(hi1, idx), upper);
+		// unpacking works per lane: pixels 0 - 7 and 16 - 23, 8 - 15 and 24 - 31
+		__m256i a = _mm256_unpacklo_epi8(lo, hi);
+		__m256i b = _mm256_unpackhi_epi8(lo, hi);
+
+		_mm256_storeu_si256((__m256i *) &out[i], _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i *) &out[i + 16], _mm256_permute2x128_si256(a, b, 0x31));
+	}
+	cpu_ppu_colors_scalar(&pixels[i], colors, &out[i], n - i);
+}
+
+#endif
+
+// the fastest variant of the host, all of them give the same result
+static void cpu_ppu_decode(const uint8_t *rows, uint8_t *pixels, uint32_t n)
+{
+#if (0 < USE_PPU_SIMD)
+	if (__builtin_cpu_supports("avx2"))
+	{
+		cpu_ppu_decode_avx2(rows, pixels, n);
+		return;
+	}
+	cpu_ppu_decode_sse2(rows, pixels, n);
+#else
+	cpu_ppu_decode_scalar(rows, pixels, n);
+#endif
+}
+
+static void cpu_ppu_colors(const uint8_t *pixels, const uint16_t *colors, uint16_t *out, uint32_t n)
+{
+#if (0 < USE_PPU_SIMD)
+	if (__builtin_cpu_supports("avx2"))
+	{
+		cpu_ppu_colors_avx2(pixels, colors, out, n);
+		return;
+	}
+#endif
+	cpu_ppu_colors_scalar(pixels, colors, out, n);
+}
+
+// mirrors a row of a tile horizontally
+static uint8_t cpu_ppu_flip(uint8_t b)
+{
+	b = (b >> 4) | (b << 4);
+	b = ((b & 0xCC) >> 2) | ((b & 0x33) << 2);
+	return ((b & 0xAA) >> 1) | ((b & 0x55) << 1);
+}
+
+/* Decodes PPU_FETCH_TILES tiles of the background map at map, starting at
+ * tile column x of pixel row y. On the CGB the attribute map in VRAM bank 1
+ * selects tile bank and flips, its palette is added to the pixels as
+ * 4 * palette + color and its priority bit is stored in prio. */
+static void cpu_ppu_fetch(sm83_t *cpu, uint16_t map, uint8_t x, uint8_t y, uint8_t *pixels, uint8_t *prio)
+{
+	const uint8_t *tiles = &cpu->video_ram[map + (y / 8) * 32];
+	const uint8_t *attrs = &cpu->video_ram1[map + (y / 8) * 32];
+	bool unsigned_tiles = (0 != (cpu->dev_map[IO_LCDC] & 0x10));
+	uint8_t rows[2 * PPU_FETCH_TILES];
+	uint8_t attr[PPU_FETCH_TILES];
+
+	for (uint32_t i = 0; i < PPU_FETCH_TILES; i++)
+	{
+		uint8_t tile = tiles[(x + i) & 0x1F];
+		uint8_t a = cpu->cart.cgb ? attrs[(x + i) & 0x1F] : 0x00;
+		const uint8_t *data = (0 != (a & 0x08)) ? cpu->video_ram1 : cpu->video_ram;
+		uint8_t row = (0 != (a & 0x40)) ? (7 - (y & 7)) : (y & 7);
+		// tiles 0x8000 - 0x8FFF, or signed relative to 0x9000
+		uint16_t addr = (unsigned_tiles ? (tile << 4) : (0x1000 + ((int8_t) tile << 4))) + 2 * row;
+
+		rows[2 * i] = data[addr];
+		rows[2 * i + 1] = data[addr + 1];
+		if (0 != (a & 0x20))
 		{
-			bool bit0 = (0 != (*target_p & (1<<0)));
-			bool bit7 = (0 != (*target_p & (1<<7)));
-			*target_p = (*target_p >> 1) | (bit7 ? 0x80 : 0);
-			eval_Z_flag(*target_p);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit0);
+			rows[2 * i] = cpu_ppu_flip(rows[2 * i]);
+			rows[2 * i + 1] = cpu_ppu_flip(rows[2 * i + 1]);
 		}
-		break;
-		
-		case OPC_SWAP:
+		attr[i] = a;
+	}
+	cpu_ppu_decode(rows, pixels, PPU_FETCH_TILES);
+
+	if (!cpu->cart.cgb)
+	{
+		memset(prio, 0, 8 * PPU_FETCH_TILES);
+		return;
+	}
+	for (uint32_t i = 0; i < 8 * PPU_FETCH_TILES; i++)
+	{
+		pixels[i] += (attr[i / 8] & 0x07) << 2;
+		prio[i] = attr[i / 8] & 0x80;
+	}
+}
+
+// RGB555 colors of the palettes of this line, DMG palettes are shades
+static void cpu_ppu_palettes(sm83_t *cpu, uint16_t bg[8][4], uint16_t obj[8][4])
+{
+	if (cpu->cart.cgb)
+	{
+		for (uint32_t i = 0; i < 32; i++)
 		{
-			*target_p = (LOW_NIBBLE(*target_p) << 4) | HIGH_NIBBLE(*target_p);
-			eval_Z_flag(*target_p);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(false);
+			bg[i / 4][i % 4] = (cpu->ppu.bg_palette[2 * i] | (cpu->ppu.bg_palette[2 * i + 1] << 8)) & 0x7FFF;
+			obj[i / 4][i % 4] = (cpu->ppu.obj_palette[2 * i] | (cpu->ppu.obj_palette[2 * i + 1] << 8)) & 0x7FFF;
 		}
-		break;
-		
-		case OPC_SRL:
+		return;
+	}
+	for (uint32_t c = 0; c < 4; c++)
+	{
+		bg[0][c] = ppu_dmg_colors[(cpu->dev_map[IO_BGP] >> (2 * c)) & 3];
+		obj[0][c] = ppu_dmg_colors[(cpu->dev_map[IO_OBP0] >> (2 * c)) & 3];
+		obj[1][c] = ppu_dmg_colors[(cpu->dev_map[IO_OBP1] >> (2 * c)) & 3];
+	}
+}
+
+/* Finds the sprites of line ly in the order they cover each other: OAM
+ * order on the CGB, smaller X first on the DMG. */
+static uint32_t cpu_ppu_sprites(sm83_t *cpu, uint8_t ly, uint8_t height, uint8_t *found)
+{
+	const uint8_t *oam = cpu->sprite_attr;
+	uint32_t n = 0;
+
+	for (uint32_t i = 0; (i < 40) && (n < PPU_LINE_SPRITES); i++)
+	{
+		if ((uint8_t) (ly + 16 - oam[4 * i]) < height)
 		{
-			bool bit0 = (0 != (*target_p & (1<<0)));
-			*target_p = (*target_p >> 1);
-			eval_Z_flag(*target_p);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit0);
+			found[n++] = i;
 		}
-		break;
-		
-		case OPC_BIT:
+	}
+	if (!cpu->cart.cgb)
+	{
+		// insertion sort, stable for equal X
+		for (uint32_t i = 1; i < n; i++)
 		{
-			uint8_t bit = (opcode2 & 0x38) >> 3;
-			eval_Z_flag((*target_p & (1 << bit)));
-			set_N_flag(false);
-			set_H_flag(true);
+			uint8_t id = found[i];
+			uint32_t j = i;
+
+			for (; (0 < j) && (oam[4 * id + 1] < oam[4 * found[j - 1] + 1]); j--)
+			{
+				found[j] = found[j - 1];
+			}
+			found[j] = id;
 		}
-		break;
-		
-		case OPC_RES:
+	}
+
+	return n;
+}
+
+/* Draws line ly into out with the registers as they are at the end of
+ * mode 3. Scroll, window and palette changes take effect per line, which
+ * is all that games do between lines. */
+static void cpu_ppu_render(sm83_t *cpu, uint8_t ly, uint16_t *out)
+{
+	uint8_t lcdc = cpu->dev_map[IO_LCDC];
+	uint8_t scx = cpu->dev_map[IO_SCX];
+	uint8_t wx = cpu->dev_map[IO_WX];
+	uint8_t bg[PPU_FETCH_TILES * 8];
+	uint8_t bg_prio[PPU_FETCH_TILES * 8];	// CGB attribute bit 7
+	uint8_t obj[CPU_SCREEN_WIDTH];
+	uint8_t obj_attr[CPU_SCREEN_WIDTH];
+	uint16_t bg_colors[8][4];
+	uint16_t obj_colors[8][4];
+	uint8_t *color = &bg[scx & 7];
+	uint8_t *prio = &bg_prio[scx & 7];
+	bool bg_priority = !cpu->cart.cgb || (0 != (lcdc & 0x01));
+
+	cpu_ppu_palettes(cpu, bg_colors, obj_colors);
+
+	// on the DMG bit 0 turns background and window off, on the CGB it only
+	// drops their priority over the sprites
+	if (cpu->cart.cgb || (0 != (lcdc & 0x01)))
+	{
+		cpu_ppu_fetch(cpu, (0 != (lcdc & 0x08)) ? 0x1C00 : 0x1800, scx / 8,
+		              ly + cpu->dev_map[IO_SCY], bg, bg_prio);
+		if ((0 != (lcdc & 0x20)) && (cpu->dev_map[IO_WY] <= ly) && (wx < CPU_SCREEN_WIDTH + 7))
 		{
-			uint8_t bit = (opcode2 & 0x38) >> 3;
-			*target_p &= ~(1 << bit);
-			// no flags affected
+			uint8_t win[PPU_FETCH_TILES * 8];
+			uint8_t win_prio[PPU_FETCH_TILES * 8];
+			uint32_t x = (7 <= wx) ? (wx - 7) : 0;
+
+			cpu_ppu_fetch(cpu, (0 != (lcdc & 0x40)) ? 0x1C00 : 0x1800, 0, cpu->ppu.window_line++, win, win_prio);
+			memcpy(&color[x], &win[x + 7 - wx], CPU_SCREEN_WIDTH - x);
+			memcpy(&prio[x], &win_prio[x + 7 - wx], CPU_SCREEN_WIDTH - x);
 		}
-		break;
-		
-		case OPC_SET:
+	}
+	else
+	{
+		memset(bg, 0, sizeof(bg));
+		memset(bg_prio, 0, sizeof(bg_prio));
+		bg_colors[0][0] = ppu_dmg_colors[0];
+	}
+
+	cpu_ppu_colors(color, &bg_colors[0][0], out, CPU_SCREEN_WIDTH);
+
+	if (0 != (lcdc & 0x02))
+	{
+		uint8_t height = (0 != (lcdc & 0x04)) ? 16 : 8;
+		uint8_t found[PPU_LINE_SPRITES];
+		uint32_t n = cpu_ppu_sprites(cpu, ly, height, found);
+		uint8_t rows[2 * PPU_LINE_SPRITES];
+		uint8_t pixels[8 * PPU_LINE_SPRITES];
+
+		if (0 == n)
 		{
-			uint8_t bit = (opcode2 & 0x38) >> 3;
-			*target_p |= (1 << bit);
-			// no flags affected
+			return;
 		}
-		break;
-		
-		case OPC_RLC2:
-		{
-			uint8_t operand = cpu_get_memory(cpu.hl.hl);
-			bool bit7 = (0 != (operand & (1<<7)));
-			uint8_t result = (operand << 1) | (bit7 ? 1 : 0);
-			cpu_set_memory(cpu.hl.hl, result);
-			eval_Z_flag(result);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit7);
-		}
-		break;
-		
-		case OPC_RRC2:
-		{
-			uint8_t operand = cpu_get_memory(cpu.hl.hl);
-			bool bit0 = (0 != (operand & (1<<0)));
-			uint8_t result = (operand >> 1)| (bit0 ? 0x80 : 0);
-			cpu_set_memory(cpu.hl.hl, result);
-			eval_Z_flag(result);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit0);
-		}
-		break;
-		
-		case OPC_RL2:
-		{
-			uint8_t operand = cpu_get_memory(cpu.hl.hl);
-			bool bit7 = (0 != (operand & (1<<7)));
-			bool c = (0 != (cpu.af.f & FLAG_C));
-			uint8_t result = (operand << 1) | (c ? 0x1 : 0);
-			cpu_set_memory(cpu.hl.hl, result);
-			eval_Z_flag(result);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit7);
-		}
-		break;
-		
-		case OPC_RR2:
-		{
-			uint8_t operand = cpu_get_memory(cpu.hl.hl);
-			bool bit0 = (0 != (operand & (1<<0)));
-			bool c = (0 != (cpu.af.f & FLAG_C));
-			uint8_t result = (operand >> 1) | (c ? 0x80 : 0);
-			cpu_set_memory(cpu.hl.hl, result);
-			eval_Z_flag(result);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit0);
-		}
-		break;
-		
-		case OPC_SLA2:
-		{
-			uint8_t operand = cpu_get_memory(cpu.hl.hl);
-			bool bit7 = (0 != (operand & (1<<7)));
-			uint8_t result = (operand << 1);
-			cpu_set_memory(cpu.hl.hl, result);
-			eval_Z_flag(result);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit7);
-		}
-		break;
-		
-		case OPC_SRA2:
-		{
-			uint8_t operand = cpu_get_memory(cpu.hl.hl);
-			bool bit0 = (0 != (operand & (1<<0)));
-			bool bit7 = (0 != (operand & (1<<7)));
-			uint8_t result = (operand >> 1) | (bit7 ? 0x80 : 0);
-			cpu_set_memory(cpu.hl.hl, result);
-			eval_Z_flag(result);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit0);
-		}
-		break;
-		
-		case OPC_SWAP2:
+		for (uint32_t i = 0; i < n; i++)
 		{
-			uint8_t operand = cpu_get_memory(cpu.hl.hl);
-			uint8_t result = (LOW_NIBBLE(operand) << 4) | HIGH_NIBBLE(operand);
-			cpu_set_memory(cpu.hl.hl, result);
-			eval_Z_flag(result);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(false);
-		}
-		break;
-		
-		case OPC_SRL2:
-		{
-			uint8_t operand = cpu_get_memory(cpu.hl.hl);
-			bool bit0 = (0 != (operand & (1<<0)));
-			uint8_t result = (operand >> 1);
-			cpu_set_memory(cpu.hl.hl, result);
-			eval_Z_flag(result);
-			set_N_flag(false);
-			set_H_flag(false);
-			set_C_flag(bit0);
+			const uint8_t *sprite = &cpu->sprite_attr[4 * found[i]];
+			uint8_t y = ly + 16 - sprite[0];
+			uint8_t tile = (16 == height) ? (sprite[2] & 0xFE) : sprite[2];
+			uint16_t addr = (tile << 4) + 2 * ((0 != (sprite[3] & 0x40)) ? (height - 1 - y) : y);
+			// CGB attribute bit 3: tile in VRAM bank 1
+			const uint8_t *data = (cpu->cart.cgb && (0 != (sprite[3] & 0x08))) ? cpu->video_ram1 : cpu->video_ram;
+
+			rows[2 * i] = data[addr];
+			rows[2 * i + 1] = data[addr + 1];
 		}
-		break;
-		
-		case OPC_BIT2:
+		cpu_ppu_decode(rows, pixels, n);
+
+		// the first sprite covering a pixel wins, even if the background hides it
+		memset(obj, 0, sizeof(obj));
+		for (uint32_t i = 0; i < n; i++)
 		{
-			uint8_t operand = cpu_get_memory(cpu.hl.hl);
-			uint8_t bit = (opcode2 & 0x38) >> 3;
-			eval_Z_flag((operand & (1 << bit)));
-			set_N_flag(false);
-			set_H_flag(true);
+			const uint8_t *sprite = &cpu->sprite_attr[4 * found[i]];
+			uint8_t attr = sprite[3];
+
+			for (uint32_t p = 0; p < 8; p++)
+			{
+				uint32_t x = sprite[1] + p - 8;
+				uint8_t c = pixels[8 * i + ((0 != (attr & 0x20)) ? (7 - p) : p)];
+
+				if ((x < CPU_SCREEN_WIDTH) && (0 != c) && (0 == obj[x]))
+				{
+					obj[x] = c;
+					obj_attr[x] = attr;
+				}
+			}
 		}
-		break;
-		
-		case OPC_RES2:
+
+		for (uint32_t x = 0; x < CPU_SCREEN_WIDTH; x++)
 		{
-			uint8_t operand = cpu_get_memory(cpu.hl.hl);
-			uint8_t bit = (opcode2 & 0x38) >> 3;
-			uint8_t result = (operand & ~(1 << bit));
-			cpu_set_memory(cpu.hl.hl, result);
-			// no flags affected
+			// attribute bit 7 of the sprite or the CGB tile: background colors 1 - 3 cover the sprite
+			if ((0 != obj[x]) && !(bg_priority && (0 != ((obj_attr[x] | prio[x]) & 0x80)) && (0 != (color[x] & 0x03))))
+			{
+				uint8_t palette = cpu->cart.cgb ? (obj_attr[x] & 0x07) : ((obj_attr[x] >> 4) & 1);
+				out[x] = obj_colors[palette][obj[x]];
+			}
 		}
-		break;
-		
-		case OPC_SET2:
+	}
+}
+
+/* A visible line that is not drawn, whose mode is neither read nor raises
+ * interrupts, needs no event until it ends. */
+static void cpu_ppu_line(sm83_t *cpu, uint64_t when)
+{
+	cpu->ppu.line_start = when;
+	cpu->ppu.lazy = (2 == cpu->ppu.mode) && !cpu->ppu.draw && (0 == (cpu->dev_map[IO_STAT] & 0x28)) &&
+	                !cpu->dma.hblank;
+	cpu_sched_add(cpu, EVT_PPU, when + PPU_TIME(cpu, ((1 == cpu->ppu.mode) || cpu->ppu.lazy) ? PPU_LINE_CYCLES : PPU_OAM_CYCLES));
+}
+
+// back to one event per mode for the rest of a lazy line
+static void cpu_ppu_exact(sm83_t *cpu)
+{
+	uint64_t t = cpu->next_instruction - cpu->ppu.line_start;
+
+	cpu->ppu.lazy = false;
+	if (t < PPU_TIME(cpu, PPU_OAM_CYCLES))
+	{
+		cpu_sched_add(cpu, EVT_PPU, cpu->ppu.line_start + PPU_TIME(cpu, PPU_OAM_CYCLES));
+	}
+	else if (t < PPU_TIME(cpu, PPU_OAM_CYCLES + PPU_DRAW_CYCLES))
+	{
+		cpu->ppu.mode = 3;
+		cpu_sched_add(cpu, EVT_PPU, cpu->ppu.line_start + PPU_TIME(cpu, PPU_OAM_CYCLES + PPU_DRAW_CYCLES));
+	}
+	else
+	{
+		cpu->ppu.mode = 0;
+		cpu_sched_add(cpu, EVT_PPU, cpu->ppu.line_start + PPU_TIME(cpu, PPU_LINE_CYCLES));
+	}
+}
+
+// line 0 starts, the frame is drawn if it is not skipped
+static void cpu_ppu_frame(sm83_t *cpu)
+{
+	cpu->ppu.mode = 2;
+	cpu->ppu.window_line = 0;
+	cpu->ppu.draw = (0 != cpu->frame_skip) && (0 == cpu->ppu.frames % cpu->frame_skip);
+}
+
+// LCD switched on, line 0 starts with mode 2
+static void cpu_ppu_start(sm83_t *cpu)
+{
+	cpu->dev_map[IO_LY] = 0;
+	cpu_ppu_frame(cpu);
+	cpu_ppu_line(cpu, cpu->next_instruction);
+}
+
+static void cpu_ppu_stop(sm83_t *cpu)
+{
+	cpu->dev_map[IO_LY] = 0;
+	cpu->ppu.mode = 0;
+	cpu->ppu.lazy = false;
+	cpu_sched_remove(cpu, EVT_PPU);
+}
+
+/* OAM DMA: the 160 bytes are copied at once. Until EVT_DMA the bus the DMA
+ * reads from and OAM are taken out of the page table, see cpu_map_memory()
+ * and cpu_dma_conflict(). */
+static __attribute__((noinline)) void cpu_dma_start(sm83_t *cpu, uint8_t val)
+{
+	// 0xE000 - 0xFFFF reads the WRAM below
+	uint8_t page = (0xE0 <= val) ? (val - 0x20) : val;
+	const uint8_t *src;
+
+	// lines that are due are drawn with the old sprites
+	cpu_sched_events(cpu);
+	if (cpu->dma.active)
+	{
+		// restarted, the source is read without conflicts
+		cpu->dma.active = false;
+		cpu_map_memory(cpu);
+	}
+	src = cpu->read_page[page];
+	if (NULL != src)
+	{
+		memcpy(cpu->sprite_attr, src, sizeof(cpu->sprite_attr));
+	}
+	else
+	{
+		for (uint32_t i = 0; i < sizeof(cpu->sprite_attr); i++)
 		{
-			uint8_t operand = cpu_get_memory(cpu.hl.hl);
-			uint8_t bit = (opcode2 & 0x38) >> 3;
-			uint8_t result = (operand | (1 << bit));
-			cpu_set_memory(cpu.hl.hl, result);
-			// no flags affected
-		}
-		break;
-		default: DBG_ERROR(); break;
+			cpu->sprite_attr[i] = cpu_get_memory(cpu, (page << 8) | i);
 		}
+	}
 
-		cpu.next_instruction += duration;
-		cpu.pc += 2;
+	cpu->dma.active = true;
+	cpu->dma.bus = cpu_dma_bus(cpu, page);
+	cpu->dma.start = cpu->next_instruction + DMA_SETUP_CYCLES;
+	cpu_map_memory(cpu);
+	cpu_sched_add(cpu, EVT_DMA, cpu->dma.start + DMA_OAM_CYCLES);
+#if (0 < USE_DYNAREC)
+	// code on the blocked bus only sees the bytes in transfer
+	cpu->dynarec->exit_block = true;
+#endif
+}
+
+// only valid while cpu->dma.active
+static bool cpu_dma_blocked(sm83_t *cpu, uint16_t addr)
+{
+	return (0xFE == (addr >> 8)) || (cpu_dma_bus(cpu, addr >> 8) == cpu->dma.bus);
+}
+
+// OAM reads 0xFF during the DMA, its bus returns the byte in transfer
+static __attribute__((noinline)) uint8_t cpu_dma_conflict(sm83_t *cpu, uint16_t addr)
+{
+	uint64_t i = 0;
+
+	if (0xFE == (addr >> 8))
+	{
+		return 0xFF;
+	}
+	if (cpu->dma.start < cpu->next_instruction)
+	{
+		i = (cpu->next_instruction - cpu->dma.start) / 4;
+	}
+	return cpu->sprite_attr[(i < sizeof(cpu->sprite_attr)) ? i : (sizeof(cpu->sprite_attr) - 1)];
+}
+
+/* Copies the next 16 byte block of the HDMA through the page table. The
+ * CPU is stalled meanwhile, HDMA1 - HDMA4 advance like on the hardware. */
+static void cpu_hdma_block(sm83_t *cpu)
+{
+	uint16_t src = ((cpu->dev_map[IO_HDMA1] << 8) | cpu->dev_map[IO_HDMA2]) & 0xFFF0;
+	uint16_t dst = 0x8000 | (((cpu->dev_map[IO_HDMA3] << 8) | cpu->dev_map[IO_HDMA4]) & 0x1FF0);
+	const uint8_t *from = cpu->read_page[src >> 8];
+	uint8_t *to = cpu->write_page[dst >> 8];
+
+	if ((NULL != from) && (NULL != to))
+	{
+		memcpy(&to[dst & 0xFF], &from[src & 0xFF], 16);
+	}
+	else
+	{
+		for (uint32_t i = 0; i < 16; i++)
+		{
+			cpu_set_memory(cpu, dst + i, cpu_get_memory(cpu, src + i));
+		}
+	}
+	src += 16;
+	dst += 16;
+	cpu->dev_map[IO_HDMA1] = src >> 8;
+	cpu->dev_map[IO_HDMA2] = src & 0xFF;
+	cpu->dev_map[IO_HDMA3] = (dst >> 8) & 0x1F;
+	cpu->dev_map[IO_HDMA4] = dst & 0xFF;
+
+	cpu->dma.blocks--;
+	cpu->dma.hblank = cpu->dma.hblank && (0 < cpu->dma.blocks);
+	cpu->next_instruction += PPU_TIME(cpu, HDMA_BLOCK_CYCLES);
+}
+
+/* HDMA5 written: bit 7 clear copies all blocks at once (general purpose
+ * DMA), set copies one block at the start of every HBlank. Clearing bit 7
+ * stops a running HBlank DMA. */
+static __attribute__((noinline)) void cpu_hdma_start(sm83_t *cpu, uint8_t val)
+{
+	// lines that are due are drawn with the old VRAM
+	cpu_sched_events(cpu);
+	if (cpu->dma.hblank && (0 == (val & 0x80)))
+	{
+		cpu->dma.hblank = false;
+		return;
+	}
+
+	cpu->dma.blocks = (val & 0x7F) + 1;
+	if (0 == (val & 0x80))
+	{
+		while (0 < cpu->dma.blocks)
+		{
+			cpu_hdma_block(cpu);
+		}
+		return;
+	}
+
+	if (cpu->ppu.lazy)
+	{
+		cpu_ppu_exact(cpu);
+	}
+	cpu->dma.hblank = true;
+	// started in HBlank or with the LCD off, the first block is copied at once
+	if (0 == cpu->ppu.mode)
+	{
+		cpu_hdma_block(cpu);
+	}
+}
+
+// registers NRx0 of the channels, NRx1 - NRx4 follow
+static const uint8_t apu_regs[APU_CHANNELS] = { IO_NR10, IO_NR21 - 1, IO_NR30, IO_NR41 - 1 };
+/* APU: two squares (the first with sweep), wave and noise, clocked by the
+ * frame sequencer on DIV. It is not stepped per cycle but catches up on
+ * register accesses and at the end of every sample block, visiting only
+ * the steps of the waveforms. Every change of a channel's output is added
+ * as a band-limited step at its exact position between two samples. */
+
+// waveforms of the duty cycles in NR11 and NR21, one bit per step
+static const uint8_t apu_duty[4] = { 0x01, 0x81, 0x87, 0x7E };
+// output level of NR32 as right shift of the wave samples
+static const uint8_t apu_wave_shift[4] = { 4, 0, 1, 2 };
+// bits of NR10 - NR52 and the unused registers up to the wave RAM that read as 1
+static const uint8_t apu_read_mask[IO_WAVE - IO_NR10] =
+{
+	0x80, 0x3F, 0x00, 0xFF, 0xBF, 0xFF, 0x3F, 0x00, 0xFF, 0xBF, 0x7F, 0xFF, 0x9F, 0xFF, 0xBF, 0xFF,
+	0xFF, 0x00, 0x00, 0xBF, 0x00, 0x00, 0x70, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+/* Windowed sinc impulses (cutoff at 0.45 of the sample rate, Blackman
+ * window), the integrated output of a change of level is a band-limited
+ * step. The taps of every phase add up to exactly 1 << APU_KERNEL_BITS,
+ * so the output does not drift. */
+static void cpu_build_apu_kernel(void)
+{
+	for (uint32_t phase = 0; phase < APU_PHASES; phase++)
+	{
+		double taps[APU_KERNEL];
+		double sum = 0.0;
+		int32_t total = 0;
+
+		for (uint32_t i = 0; i < APU_KERNEL; i++)
+		{
+			double x = (double) i - (APU_KERNEL / 2 - 1) - (double) phase / APU_PHASES;
+			double sinc = (fabs(x) < 1e-9) ? 1.0 : sin(M_PI * 0.9 * x) / (M_PI * 0.9 * x);
+
+			taps[i] = sinc * (0.42 + 0.5 * cos(2.0 * M_PI * x / APU_KERNEL) + 0.08 * cos(4.0 * M_PI * x / APU_KERNEL));
+			sum += taps[i];
+		}
+		for (uint32_t i = 0; i < APU_KERNEL; i++)
+		{
+			apu_kernel[phase][i] = (int16_t) lround(taps[i] / sum * (1 << APU_KERNEL_BITS));
+			total += apu_kernel[phase][i];
+		}
+		apu_kernel[phase][APU_KERNEL / 2] += (1 << APU_KERNEL_BITS) - total;
+	}
+}
+
+static uint32_t cpu_apu_channel(uint8_t reg)
+{
+	return (reg < IO_NR21) ? 0 : (reg < IO_NR30) ? 1 : (reg < IO_NR41) ? 2 : 3;
+}
+
+static bool cpu_apu_dac(sm83_t *cpu, uint32_t ch)
+{
+	const uint8_t *nr = &cpu->dev_map[apu_regs[ch]];
+
+	return (2 == ch) ? (0 != (nr[0] & 0x80)) : (0 != (nr[2] & 0xF8));
+}
+
+// APU clocks per waveform step, 0: the LFSR is not clocked
+static uint32_t cpu_apu_period(sm83_t *cpu, uint32_t ch)
+{
+	const uint8_t *nr = &cpu->dev_map[apu_regs[ch]];
+	uint32_t freq = nr[3] | ((nr[4] & 0x07) << 8);
+	uint8_t shift = nr[3] >> 4;
+
+	switch (ch)
+	{
+	case 0: case 1:
+		return (2048 - freq) * 4;
+	case 2:
+		return (2048 - freq) * 2;
+	default:
+		// NR43: divider 8, 16, 32, ... shifted left, shifts 14 and 15 stop the LFSR
+		return (14 <= shift) ? 0 : (((0 != (nr[3] & 0x07)) ? (nr[3] & 0x07) * 16 : 8) << shift);
+	}
+}
+
+static uint8_t cpu_apu_sample(sm83_t *cpu, uint32_t ch)
+{
+	apu_channel_t *c = &cpu->apu.ch[ch];
+	uint8_t wave;
+
+	if (!c->on)
+	{
+		return 0;
+	}
+	switch (ch)
+	{
+	case 0: case 1:
+		return (0 != ((apu_duty[cpu->dev_map[apu_regs[ch] + 1] >> 6] >> c->step) & 1)) ? c->volume : 0;
+	case 2:
+		// two samples per byte, the high nibble first
+		wave = cpu->dev_map[IO_WAVE + c->step / 2];
+		return ((0 != (c->step & 1)) ? (wave & 0x0F) : (wave >> 4)) >> c->volume;
+	default:
+		return (0 == (cpu->apu.lfsr & 1)) ? c->volume : 0;
+	}
+}
+
+// adds a band-limited step to acc, its taps are spread over the next APU_KERNEL samples
+static void cpu_apu_delta(int32_t *acc, uint64_t pos, int32_t delta)
+{
+	const int16_t *kernel = apu_kernel[((pos * APU_PHASES) >> 16) & (APU_PHASES - 1)];
+	int32_t *out = &acc[pos >> 16];
+
+	for (uint32_t i = 0; i < APU_KERNEL; i++)
+	{
+		out[i] += delta * kernel[i];
+	}
+}
+
+/* Takes the current sample of a channel as its output from pos (16.16
+ * fixed point samples in apu.acc) on. Only changes of the mixed left and
+ * right levels are synthesized. */
+static void cpu_apu_output(sm83_t *cpu, uint32_t ch, uint64_t pos)
+{
+	uint8_t out = cpu_apu_sample(cpu, ch);
+
+	cpu->apu.ch[ch].out = out;
+	if (NULL == cpu->audio.buffer)
+	{
+		return;
+	}
+	for (uint32_t side = 0; side < 2; side++)
+	{
+		int32_t level = out * cpu->apu.gain[ch][side];
+
+		if (level != cpu->apu.level[ch][side])
+		{
+			cpu_apu_delta(cpu->apu.acc[side], pos, level - cpu->apu.level[ch][side]);
+			cpu->apu.level[ch][side] = level;
+		}
+	}
+}
+
+static void cpu_apu_outputs(sm83_t *cpu)
+{
+	for (uint32_t ch = 0; ch < APU_CHANNELS; ch++)
+	{
+		cpu_apu_output(cpu, ch, cpu->apu.pos);
+	}
+}
+
+// NR50 and NR51, a channel goes to the left and right output with its master volume
+static void cpu_apu_gains(sm83_t *cpu)
+{
+	uint8_t nr50 = cpu->dev_map[IO_NR50];
+	uint8_t nr51 = cpu->dev_map[IO_NR51];
+
+	for (uint32_t ch = 0; ch < APU_CHANNELS; ch++)
+	{
+		cpu->apu.gain[ch][0] = (0 != (nr51 & (0x10 << ch))) ? (((nr50 >> 4) & 0x07) + 1) * APU_GAIN : 0;
+		cpu->apu.gain[ch][1] = (0 != (nr51 & (0x01 << ch))) ? ((nr50 & 0x07) + 1) * APU_GAIN : 0;
+	}
+}
+
+/* Steps the waveform of a channel through n APU clocks, starting at
+ * sample pos. Only the steps are visited, not every clock. */
+static void cpu_apu_channel_run(sm83_t *cpu, uint32_t ch, uint64_t pos, uint32_t n)
+{
+	apu_channel_t *c = &cpu->apu.ch[ch];
+	uint32_t period = cpu_apu_period(cpu, ch);
+	uint32_t t = c->timer;
+
+	if (!c->on || (0 == period))
+	{
+		return;
+	}
+	for (; t <= n; t += period)
+	{
+		if (2 > ch)
+		{
+			c->step = (c->step + 1) & 0x07;
+		}
+		else if (2 == ch)
+		{
+			c->step = (c->step + 1) & 0x1F;
+		}
+		else
+		{
+			uint16_t bit = (cpu->apu.lfsr ^ (cpu->apu.lfsr >> 1)) & 1;
+
+			cpu->apu.lfsr = (cpu->apu.lfsr >> 1) | (bit << 14);
+			if (0 != (cpu->dev_map[IO_NR43] & 0x08))
+			{
+				// 7 bit mode
+				cpu->apu.lfsr = (cpu->apu.lfsr & ~0x40) | (bit << 6);
+			}
+		}
+		cpu_apu_output(cpu, ch, pos + (uint64_t) t * APU_POS_PER_CLOCK);
+	}
+	c->timer = t - n;
+}
+
+// next period of the channel 1 sweep, a period above 2047 turns the channel off
+static uint16_t cpu_apu_sweep_next(sm83_t *cpu)
+{
+	uint8_t nr10 = cpu->dev_map[IO_NR10];
+	uint16_t delta = cpu->apu.sweep_period >> (nr10 & 0x07);
+	uint16_t next = (0 != (nr10 & 0x08)) ? (cpu->apu.sweep_period - delta) : (cpu->apu.sweep_period + delta);
+
+	if (2047 < next)
+	{
+		cpu->apu.ch[0].on = false;
+	}
+	return next;
+}
+
+static void cpu_apu_sweep(sm83_t *cpu)
+{
+	uint8_t nr10 = cpu->dev_map[IO_NR10];
+	uint8_t pace = (nr10 >> 4) & 0x07;
+
+	if ((0 != cpu->apu.sweep_timer) && (0 != --cpu->apu.sweep_timer))
+	{
+		return;
+	}
+	cpu->apu.sweep_timer = (0 != pace) ? pace : 8;
+	if (cpu->apu.sweep_on && (0 != pace))
+	{
+		uint16_t next = cpu_apu_sweep_next(cpu);
+
+		if ((next <= 2047) && (0 != (nr10 & 0x07)))
+		{
+			cpu->apu.sweep_period = next;
+			cpu->dev_map[IO_NR13] = next & 0xFF;
+			cpu->dev_map[IO_NR14] = (cpu->dev_map[IO_NR14] & 0xF8) | (next >> 8);
+			cpu_apu_sweep_next(cpu);
+		}
+	}
+}
+
+static void cpu_apu_envelope(sm83_t *cpu, uint32_t ch)
+{
+	apu_channel_t *c = &cpu->apu.ch[ch];
+	uint8_t nr2 = cpu->dev_map[apu_regs[ch] + 2];
+
+	if (!c->on || (0 == (nr2 & 0x07)))
+	{
+		return;
+	}
+	if ((0 == c->env_timer) || (0 == --c->env_timer))
+	{
+		c->env_timer = nr2 & 0x07;
+		if ((0 != (nr2 & 0x08)) && (c->volume < 15))
+		{
+			c->volume++;
+		}
+		else if ((0 == (nr2 & 0x08)) && (0 < c->volume))
+		{
+			c->volume--;
+		}
+	}
+}
+
+/* 512 Hz: the length counters on every second step, the sweep on steps
+ * 2 and 6 and the envelopes on step 7. */
+static void cpu_apu_sequencer(sm83_t *cpu)
+{
+	uint8_t step = cpu->apu.seq_step++ & 0x07;
+
+	for (uint32_t ch = 0; ch < APU_CHANNELS; ch++)
+	{
+		apu_channel_t *c = &cpu->apu.ch[ch];
+
+		if ((0 == (step & 1)) && (0 != (cpu->dev_map[apu_regs[ch] + 4] & 0x40)) &&
+		    (0 < c->length) && (0 == --c->length))
+		{
+			c->on = false;
+		}
+		if ((7 == step) && (2 != ch))
+		{
+			cpu_apu_envelope(cpu, ch);
+		}
+	}
+	if ((2 == step) || (6 == step))
+	{
+		cpu_apu_sweep(cpu);
+	}
+	cpu_apu_outputs(cpu);
+}
+
+// samples of the block in synthesis, the rest of the output buffer at most
+static uint32_t cpu_apu_block(sm83_t *cpu)
+{
+	uint32_t left = cpu->audio.frames - cpu->audio.used;
+
+	return (left < APU_BLOCK) ? left : APU_BLOCK;
+}
+
+// APU clocks until the block is complete
+static uint64_t cpu_apu_block_clocks(sm83_t *cpu)
+{
+	uint64_t end = (uint64_t) cpu_apu_block(cpu) << 16;
+
+	return (end - cpu->apu.pos + APU_POS_PER_CLOCK - 1) / APU_POS_PER_CLOCK;
+}
+
+// hands the output buffer to the callback of cpu_set_audio()
+static void cpu_audio_output(sm83_t *cpu)
+{
+#if (0 < DYNAREC_VERIFY)
+	// the block run after the reference run produces the same samples again
+	if (!cpu->dynarec->verifying)
+#endif
+	{
+		cpu->audio.cb(cpu->audio.ctx, cpu->audio.buffer, cpu->audio.used);
+	}
+	cpu->audio.used = 0;
+}
+
+/* Integrates the steps of all complete samples into the output buffer,
+ * which goes to the callback when it is full. Steps at later times only
+ * reach samples from pos on. */
+static void cpu_apu_emit(sm83_t *cpu)
+{
+	uint32_t n = cpu->apu.pos >> 16;
+	int16_t *out = &cpu->audio.buffer[2 * cpu->audio.used];
+
+	for (uint32_t side = 0; side < 2; side++)
+	{
+		int32_t *acc = cpu->apu.acc[side];
+
+		for (uint32_t i = 0; i < n; i++)
+		{
+			int32_t v;
+
+			cpu->apu.sum[side] += acc[i];
+			v = cpu->apu.sum[side] >> APU_KERNEL_BITS;
+			// the channels only output positive levels, a slow average of
+			// the output is removed like by the capacitor of the hardware
+			cpu->apu.dc[side] += (((int64_t) v << 16) - cpu->apu.dc[side]) >> 10;
+			v -= (int32_t) (cpu->apu.dc[side] >> 16);
+			out[2 * i + side] = (v < INT16_MIN) ? INT16_MIN : (INT16_MAX < v) ? INT16_MAX : v;
+		}
+		memmove(acc, &acc[n], (APU_BLOCK + APU_KERNEL - n) * sizeof(acc[0]));
+		memset(&acc[APU_BLOCK + APU_KERNEL - n], 0, n * sizeof(acc[0]));
+	}
+	cpu->apu.pos -= (uint64_t) n << 16;
+	cpu->audio.used += n;
+
+	if (cpu->audio.used == cpu->audio.frames)
+	{
+		cpu_audio_output(cpu);
+	}
+}
+
+/* Brings the APU from apu.time up to the CPU time to, in segments between
+ * the frame sequencer steps and the ends of the sample blocks. The
+ * channels are only stepped while there is audio output, otherwise just
+ * the frame sequencer runs for the length counters of NR52. The APU keeps
+ * its clock in double speed. */
+static void cpu_apu_run(sm83_t *cpu, uint64_t to)
+{
+	bool synth = (NULL != cpu->audio.buffer);
+
+	while (cpu->apu.time < to)
+	{
+		uint64_t end = (cpu->apu.seq_next < to) ? cpu->apu.seq_next : to;
+		uint32_t n;
+
+		if (synth)
+		{
+			uint64_t full = cpu->apu.time + (cpu_apu_block_clocks(cpu) << cpu->cgb.speed);
+			end = (full < end) ? full : end;
+		}
+		n = (end - cpu->apu.time) >> cpu->cgb.speed;
+		cpu->apu.time = end;
+
+		if (synth)
+		{
+			for (uint32_t ch = 0; ch < APU_CHANNELS; ch++)
+			{
+				cpu_apu_channel_run(cpu, ch, cpu->apu.pos, n);
+			}
+			cpu->apu.pos += (uint64_t) n * APU_POS_PER_CLOCK;
+			if (cpu_apu_block(cpu) <= (cpu->apu.pos >> 16))
+			{
+				cpu_apu_emit(cpu);
+			}
+		}
+		if (end == cpu->apu.seq_next)
+		{
+			cpu_apu_sequencer(cpu);
+			cpu->apu.seq_next += APU_SEQ_CYCLES << cpu->cgb.speed;
+		}
+	}
+}
+
+// the next sample block is due, no event without audio output
+static void cpu_apu_schedule(sm83_t *cpu)
+{
+	if (NULL == cpu->audio.buffer)
+	{
+		cpu_sched_remove(cpu, EVT_APU);
+		return;
+	}
+	cpu_sched_add(cpu, EVT_APU, cpu->apu.time + (cpu_apu_block_clocks(cpu) << cpu->cgb.speed));
+}
+
+// catch-up before the CPU accesses the APU
+static void cpu_apu_sync(sm83_t *cpu)
+{
+	cpu_sched_events(cpu);
+	cpu_apu_run(cpu, cpu->next_instruction);
+}
+
+/* DIV written: the frame sequencer counts the falling edges of DIV bit 4
+ * (bit 5 in double speed), resetting DIV can produce one. */
+static void cpu_apu_div_reset(sm83_t *cpu)
+{
+	uint64_t now = cpu->next_instruction;
+
+	cpu_apu_sync(cpu);
+	if (0 != ((now - cpu->timer.div_base) & ((APU_SEQ_CYCLES / 2) << cpu->cgb.speed)))
+	{
+		cpu_apu_sequencer(cpu);
+	}
+	cpu->apu.seq_next = now + (APU_SEQ_CYCLES << cpu->cgb.speed);
+}
+
+static void cpu_apu_trigger(sm83_t *cpu, uint32_t ch)
+{
+	apu_channel_t *c = &cpu->apu.ch[ch];
+	const uint8_t *nr = &cpu->dev_map[apu_regs[ch]];
+
+	c->on = cpu_apu_dac(cpu, ch);
+	if (0 == c->length)
+	{
+		c->length = (2 == ch) ? 256 : 64;
+	}
+	c->timer = cpu_apu_period(cpu, ch);
+	if (2 == ch)
+	{
+		c->step = 0;
+		c->volume = apu_wave_shift[(nr[2] >> 5) & 0x03];
+		return;
+	}
+	c->volume = nr[2] >> 4;
+	c->env_timer = nr[2] & 0x07;
+	if (3 == ch)
+	{
+		cpu->apu.lfsr = 0x7FFF;
+	}
+	else if (0 == ch)
+	{
+		cpu->apu.sweep_period = nr[3] | ((nr[4] & 0x07) << 8);
+		cpu->apu.sweep_timer = (0 != (nr[0] & 0x70)) ? ((nr[0] >> 4) & 0x07) : 8;
+		cpu->apu.sweep_on = (0 != (nr[0] & 0x77));
+		if (0 != (nr[0] & 0x07))
+		{
+			cpu_apu_sweep_next(cpu);
+		}
+	}
+}
+
+static uint8_t cpu_apu_read(sm83_t *cpu, uint8_t reg)
+{
+	uint8_t status = 0;
+
+	if (IO_WAVE <= reg)
+	{
+		return cpu->dev_map[reg];
+	}
+	if (IO_NR52 == reg)
+	{
+		// the length counters may have turned channels off
+		cpu_apu_sync(cpu);
+		for (uint32_t ch = 0; ch < APU_CHANNELS; ch++)
+		{
+			status |= cpu->apu.ch[ch].on ? (1 << ch) : 0;
+		}
+	}
+	return cpu->dev_map[reg] | apu_read_mask[reg - IO_NR10] | status;
+}
+
+/* Every write synthesizes the sound up to now with the old register
+ * values first. While the APU is off only NR52 and the wave RAM can be
+ * written. */
+static __attribute__((noinline)) void cpu_apu_write(sm83_t *cpu, uint8_t reg, uint8_t val)
+{
+	uint32_t ch = cpu_apu_channel(reg);
+	apu_channel_t *c = &cpu->apu.ch[ch];
+
+	cpu_apu_sync(cpu);
+	if (IO_NR52 == reg)
+	{
+		if (0 == (val & 0x80))
+		{
+			memset(&cpu->dev_map[IO_NR10], 0, IO_NR52 - IO_NR10);
+			memset(cpu->apu.ch, 0, sizeof(cpu->apu.ch));
+			cpu_apu_gains(cpu);
+		}
+		else if (0 == (cpu->dev_map[reg] & 0x80))
+		{
+			cpu->apu.seq_step = 0;
+		}
+		cpu->dev_map[reg] = val & 0x80;
+		cpu_apu_outputs(cpu);
+		return;
+	}
+	if ((IO_WAVE > reg) && (0 == (cpu->dev_map[IO_NR52] & 0x80)))
+	{
+		return;
+	}
+
+	cpu->dev_map[reg] = val;
+	switch (reg)
+	{
+	case IO_NR11: case IO_NR21: case IO_NR41:
+		c->length = 64 - (val & 0x3F);
+		break;
+	case IO_NR31:
+		c->length = 256 - val;
+		break;
+	case IO_NR12: case IO_NR22: case IO_NR42: case IO_NR30:
+		// the DAC turned off, so is the channel
+		c->on = c->on && cpu_apu_dac(cpu, ch);
+		break;
+	case IO_NR32:
+		c->volume = apu_wave_shift[(val >> 5) & 0x03];
+		break;
+	case IO_NR14: case IO_NR24: case IO_NR34: case IO_NR44:
+		if (0 != (val & 0x80))
+		{
+			cpu_apu_trigger(cpu, ch);
+		}
+		break;
+	case IO_NR50: case IO_NR51:
+		cpu_apu_gains(cpu);
+		break;
+	default:
+		break;
+	}
+	cpu_apu_outputs(cpu);
+}
+#endif
+
+/* Every visible line goes through mode 2 (OAM scan), mode 3 (drawing) and
+ * mode 0 (HBlank), followed by ten lines of mode 1 (VBlank). The line is
+ * drawn at the end of mode 3, so register changes within a line do not
+ * show. The frames are swapped at VBlank. The LCD is off after cpu_init(),
+ * there is no boot ROM that turns it on. */
+static void cpu_ppu_event(sm83_t *cpu, uint64_t when)
+{
+#if !(0 < BUILD_TEST_DLL)
+	uint8_t *ly = &cpu->dev_map[IO_LY];
+
+	// the event of a lazy line is its end
+	switch (cpu->ppu.lazy ? 0 : cpu->ppu.mode)
+	{
+	case 2:
+		cpu->ppu.mode = 3;
+		cpu_sched_add(cpu, EVT_PPU, when + PPU_TIME(cpu, PPU_DRAW_CYCLES));
+		break;
+	case 3:
+		if (cpu->ppu.draw)
+		{
+			cpu_ppu_render(cpu, *ly, cpu->ppu.frame[cpu->ppu.front ^ 1][*ly]);
+		}
+		cpu->ppu.mode = 0;
+		cpu_sched_add(cpu, EVT_PPU, when + PPU_TIME(cpu, PPU_LINE_CYCLES - PPU_OAM_CYCLES - PPU_DRAW_CYCLES));
+		if (cpu->dma.hblank)
+		{
+			cpu_hdma_block(cpu);
+		}
+		break;
+	default:
+		*ly = (*ly + 1) % PPU_LINES;
+		if (CPU_SCREEN_HEIGHT == *ly)
+		{
+			cpu->ppu.mode = 1;
+			cpu->ppu.front ^= cpu->ppu.draw ? 1 : 0;
+			cpu->ppu.valid = cpu->ppu.draw;
+			cpu->ppu.frames++;
+			cpu->stats.frames_skipped += cpu->ppu.draw ? 0 : 1;
+			cpu_int_request(cpu, INT_VBLANK);
+		}
+		else if (0 == *ly)
+		{
+			cpu_ppu_frame(cpu);
+		}
+		else if (*ly < CPU_SCREEN_HEIGHT)
+		{
+			cpu->ppu.mode = 2;
+		}
+		cpu_ppu_line(cpu, when);
+		break;
+	}
+	cpu_ppu_stat(cpu);
+#endif
+}
+
+// the OAM DMA is done, its bus is mapped again
+static void cpu_dma_event(sm83_t *cpu, uint64_t when)
+{
+	(void) when;
+#if !(0 < BUILD_TEST_DLL)
+	cpu->dma.active = false;
+	cpu_map_memory(cpu);
+#endif
+}
+
+// a block of samples is complete
+static void cpu_apu_event(sm83_t *cpu, uint64_t when)
+{
+#if !(0 < BUILD_TEST_DLL)
+	cpu_apu_run(cpu, when);
+	cpu_apu_schedule(cpu);
+#endif
+}
+
+#if !(0 < BUILD_TEST_DLL)
+// events of devices that keep their clock in double speed, see cpu_speed_switch()
+static const bool cpu_event_realtime[EVT_COUNT] =
+{
+	[EVT_PPU] = true,
+	[EVT_APU] = true,
+};
+#endif
+
+// called with the time the event was scheduled for, which may have passed
+static void (* const cpu_event_handlers[EVT_COUNT])(sm83_t *cpu, uint64_t when) =
+{
+	[EVT_SERIAL] = cpu_serial_event,
+	[EVT_TIMER]  = cpu_timer_event,
+	[EVT_PPU]    = cpu_ppu_event,
+	[EVT_DMA]    = cpu_dma_event,
+	[EVT_APU]    = cpu_apu_event,
+};
+
+/* Runs all events that are due. Handlers of periodic events schedule their
+ * next occurrence relative to when, so late dispatch does not drift. */
+static void cpu_sched_events(sm83_t *cpu)
+{
+	while (cpu_sched_first(cpu) <= cpu->next_instruction)
+	{
+		cpu_event_t id = cpu->sched.heap[0];
+		uint64_t when = cpu_sched_first(cpu);
+
+		cpu_sched_remove(cpu, id);
+		cpu_event_handlers[id](cpu, when);
+	}
+}
+
+/* Everything that happens between two instructions: due events, EI taking
+ * effect and the dispatch of an interrupt. Kept out of line, so the
+ * interpreter loops stay small. */
+static __attribute__((noinline)) void cpu_sched_run(sm83_t *cpu)
+{
+	cpu->sched.last_run = cpu->next_instruction;
+	cpu_sched_events(cpu);
+	// IME is set after the instruction following EI
+	if ((0 != cpu->ei_delay) && (0 == --cpu->ei_delay))
+	{
+		cpu->interrupts_enabled = true;
+		cpu_int_update(cpu);
+	}
+#if !(0 < BUILD_TEST_DLL)
+	if (0 != cpu->int_pending)
+	{
+		cpu_int_dispatch(cpu);
+	}
+#endif
+}
+
+/* The only per instruction cost of the devices: instructions run without
+ * any device polling until the earliest event is due. */
+static inline void cpu_sched_check(sm83_t *cpu)
+{
+	if (__builtin_expect(cpu->sched.next <= cpu->next_instruction, 0))
+	{
+		cpu_sched_run(cpu);
+	}
+}
+
+#if !(0 < BUILD_TEST_DLL)
+/* HALT: nothing but the devices changes the state until an interrupt is
+ * requested, so time jumps straight to the next event. Returns after every
+ * event, HALT is executed again until the CPU wakes up, so the instruction
+ * limit of cpu_run() also ends a run in HALT. The CPU wakes up even with
+ * IME cleared, the interrupt is dispatched (if enabled) after HALT like
+ * after any other instruction. */
+static bool cpu_halt(sm83_t *cpu)
+{
+	uint64_t when = cpu_sched_first(cpu);
+
+	if (0 != (cpu->int_en[0x7F] & cpu->dev_map[IO_IF] & 0x1F))
+	{
+		return true;
+	}
+
+	// the sample blocks of the APU do not request interrupts
+	if ((0 == (cpu->int_en[0x7F] & 0x1F)) || (SCHED_NEVER == when) ||
+	    ((1 == cpu->sched.count) && (EVT_APU == cpu->sched.heap[0])))
+	{
+		// no interrupt enabled or no event left that could wake the CPU
+		debug_printf("HALT without wake-up source at 0x%04x.\n", cpu->pc);
+		cpu->stopped = true;
+		cpu_flush_putc(cpu);
+		cpu_flush_audio(cpu);
+		return false;
+	}
+	if (cpu->next_instruction < when)
+	{
+		cpu->stats.halt_cycles += when - cpu->next_instruction;
+		cpu->next_instruction = when;
+	}
+	cpu_sched_events(cpu);
+
+	return (0 != (cpu->int_en[0x7F] & cpu->dev_map[IO_IF] & 0x1F));
+}
+
+/* Memory that only changes through events or writes of the CPU, i.e. stays
+ * constant while a loop polls it. */
+static bool cpu_idle_source(uint16_t addr)
+{
+	// DIV and TIMA count without events, the channel bits of NR52 are only
+	// updated by cpu_apu_sync() and no event ends a length counter
+	return (0xFF00 | IO_DIV) != addr && (0xFF00 | IO_TIMA) != addr && (0xFF00 | IO_NR52) != addr;
+}
+
+/* Checks the body of a loop from cpu->pc up to the conditional JR at
+ * branch: the first instruction loads A from memory (or tests a bit of
+ * (HL)), the others only compute F from A and constant registers. Every
+ * iteration then ends in the same state until the polled memory changes. */
+static bool cpu_idle_body(sm83_t *cpu, uint16_t branch, uint32_t *cycles)
+{
+	uint16_t start = cpu->pc;
+	uint16_t addr = start;
+	uint8_t opcode = cpu_get_memory(cpu, addr);
+	const opc_desc_t *d = &opc_decode[opcode];
+	// XOR only gives the same A every iteration if A is loaded first
+	bool xor_ok = (0xCB != opcode);
+	uint16_t src;
+
+	switch (opcode)
+	{
+	case 0xF0:	// LDH A,(a8)
+		src = 0xFF00 | cpu_get_memory(cpu, addr + 1);
+		break;
+	case 0xF2:	// LD A,(C)
+		src = 0xFF00 | cpu->bc.c;
+		break;
+	case 0xFA:	// LD A,(a16)
+		src = cpu_get_memory(cpu, addr + 1) | (cpu_get_memory(cpu, addr + 2) << 8);
+		break;
+	case 0x0A:	// LD A,(BC)
+		src = cpu->bc.bc;
+		break;
+	case 0x1A:	// LD A,(DE)
+		src = cpu->de.de;
+		break;
+	case 0x7E:	// LD A,(HL)
+		src = cpu->hl.hl;
+		break;
+	case 0xCB:	// BIT n,(HL)
+		d = &opc_decode[0x100 + cpu_get_memory(cpu, addr + 1)];
+		if (0x46 != (d->opcode & 0xC7))
+		{
+			return false;
+		}
+		src = cpu->hl.hl;
+		break;
+	default:
+		return false;
+	}
+	if (!cpu_idle_source(src))
+	{
+		return false;
+	}
+
+	*cycles += d->cycles;
+	addr += d->length;
+	while ((uint16_t) (addr - start) < (uint16_t) (branch - start))
+	{
+		opcode = cpu_get_memory(cpu, addr);
+		d = &opc_decode[opcode];
+		if (0xCB == opcode)
+		{
+			// BIT n,A
+			d = &opc_decode[0x100 + cpu_get_memory(cpu, addr + 1)];
+			if (0x47 != (d->opcode & 0xC7))
+			{
+				return false;
+			}
+		}
+		// AND/XOR/OR/CP with d8 or a register
+		else if ((0xE6 != opcode) && (0xEE != opcode) && (0xF6 != opcode) && (0xFE != opcode) &&
+		         (!IS_IN_RANGE(opcode, 0xA0, 0xBF) || (6 == (opcode & 0x07))))
+		{
+			return false;
+		}
+		else if (!xor_ok && ((0xEE == opcode) || IS_IN_RANGE(opcode, 0xA8, 0xAF)))
+		{
+			return false;
+		}
+		*cycles += d->cycles;
+		addr += d->length;
+	}
+
+	return (addr == branch);
+}
+
+/* Called after a conditional JR jumped back to cpu->pc. Skips whole
+ * iterations of a polling loop up to the next event, the first point in
+ * time at which the polled value can change. */
+static __attribute__((noinline)) void cpu_idle_loop(sm83_t *cpu, uint16_t branch)
+{
+	uint32_t cycles = opc_decode[cpu_get_memory(cpu, branch)].cycles_taken;
+	uint64_t iterations;
+
+	if (!cpu_idle_body(cpu, branch, &cycles))
+	{
+		cpu->idle_reject[cpu->pc % IDLE_CACHE] = 0x10000 | cpu->pc;
+		return;
+	}
+	// an event or interrupt after the load may have changed the polled value
+	if ((SCHED_NEVER == cpu->sched.next) || (cpu->sched.next <= cpu->next_instruction) ||
+	    (cpu->next_instruction - cycles < cpu->sched.last_run))
+	{
+		return;
+	}
+
+	iterations = (cpu->sched.next - cpu->next_instruction) / cycles;
+	if (0 < iterations)
+	{
+		cpu->next_instruction += iterations * cycles;
+		cpu->stats.idle_loops++;
+		cpu->stats.idle_cycles += iterations * cycles;
+	}
+}
+
+static uint8_t cpu_io_read(sm83_t *cpu, uint16_t addr)
+{
+	uint8_t reg = addr & 0x7F;
+
+	switch (reg)
+	{
+	case IO_DIV:
+		return (uint8_t) ((cpu->next_instruction - cpu->timer.div_base) >> 8);
+	case IO_TIMA:
+		cpu_timer_sync(cpu);
+		return cpu->timer.tima;
+	case IO_TAC:
+		return cpu->dev_map[reg] | 0xF8;
+	case IO_IF:
+		return cpu->dev_map[reg] | 0xE0;
+	case IO_STAT:
+		cpu_sched_events(cpu);
+		if (cpu->ppu.lazy)
+		{
+			// the mode is polled, e.g. by an idle loop that needs its events
+			cpu_ppu_exact(cpu);
+		}
+		return 0x80 | cpu->dev_map[reg] | cpu->ppu.mode |
+		       ((cpu->dev_map[IO_LY] == cpu->dev_map[IO_LYC]) ? 0x04 : 0x00);
+	case IO_LY:
+		cpu_sched_events(cpu);
+		return cpu->dev_map[reg];
+	case IO_HDMA1: case IO_HDMA2: case IO_HDMA3: case IO_HDMA4:
+		return cpu->cart.cgb ? 0xFF : cpu->dev_map[reg];
+	case IO_HDMA5:
+		if (!cpu->cart.cgb)
+		{
+			return cpu->dev_map[reg];
+		}
+		// blocks left - 1, bit 7: no HBlank DMA running
+		return (cpu->dma.hblank ? 0x00 : 0x80) | ((cpu->dma.blocks - 1) & 0x7F);
+	case IO_KEY1:
+		// bit 7: current speed, bit 0: switch armed for the next STOP
+		return cpu->cart.cgb ? (0x7E | (cpu->cgb.speed << 7) | cpu->dev_map[reg]) : cpu->dev_map[reg];
+	case IO_VBK:
+		return cpu->cart.cgb ? (0xFE | cpu->cgb.vram_bank) : cpu->dev_map[reg];
+	case IO_SVBK:
+		return cpu->cart.cgb ? (0xF8 | cpu->dev_map[reg]) : cpu->dev_map[reg];
+	case IO_NR10 ... IO_WAVE + 0x0F:
+		return cpu_apu_read(cpu, reg);
+	case IO_BCPD:
+		return cpu->ppu.bg_palette[cpu->dev_map[IO_BCPS] & 0x3F];
+	case IO_OCPD:
+		return cpu->ppu.obj_palette[cpu->dev_map[IO_OCPS] & 0x3F];
+	default:
+		return cpu->dev_map[reg];
+	}
+}
+
+// writes palette RAM at the index register before data, bit 7: auto increment
+static void cpu_palette_write(uint8_t *palette, uint8_t *index, uint8_t val)
+{
+	palette[*index & 0x3F] = val;
+	if (0 != (*index & 0x80))
+	{
+		*index = 0x80 | ((*index + 1) & 0x3F);
+	}
+}
+
+/* VBK or SVBK written: the bank window gets other pages, see
+ * cpu_page_host(). The DMA override of cpu_map_pages() still applies. */
+static __attribute__((noinline)) void cpu_cgb_bank(sm83_t *cpu, uint8_t reg, uint8_t val)
+{
+	if (IO_VBK == reg)
+	{
+		// lines that are due are drawn from the old bank
+		cpu_sched_events(cpu);
+		cpu->dev_map[reg] = val & 0x01;
+		cpu->cgb.vram_bank = val & 0x01;
+		cpu_map_pages(cpu, 0x80, 0x9F);
+	}
+	else
+	{
+		cpu->dev_map[reg] = val & 0x07;
+		cpu->cgb.wram_bank = val & 0x07;
+		cpu_map_pages(cpu, 0xD0, 0xDF);
+	}
+#if (0 < USE_DYNAREC)
+	// the running block may continue in the bank that was switched out
+	cpu->dynarec->exit_block = true;
+#endif
+}
+
+static void cpu_io_write(sm83_t *cpu, uint16_t addr, uint8_t val)
+{
+	uint8_t reg = addr & 0x7F;
+
+	switch (reg)
+	{
+	case IO_SC:
+		cpu->dev_map[reg] = val;
+		if (0x81 == (val & 0x81))
+		{
+			// internal clock, the transfer completes after 8 bits
+			cpu_sched_add(cpu, EVT_SERIAL, cpu->next_instruction + SERIAL_TRANSFER_CYCLES);
+		}
+		else
+		{
+			cpu_sched_remove(cpu, EVT_SERIAL);
+		}
+		break;
+	case IO_DIV:
+		// resetting the divider can produce a falling edge
+		cpu_timer_sync(cpu);
+		if (cpu_timer_signal(cpu, cpu->dev_map[IO_TAC], cpu->next_instruction))
+		{
+			cpu_timer_increment(cpu);
+		}
+		cpu_apu_div_reset(cpu);
+		cpu->timer.div_base = cpu->next_instruction;
+		cpu_timer_schedule(cpu);
+		break;
+	case IO_TIMA:
+		cpu_timer_sync(cpu);
+		if (cpu->timer.reload)
+		{
+			// writing during the reload delay cancels the reload
+			cpu->timer.reload = false;
+			cpu_sched_remove(cpu, EVT_TIMER);
+		}
+		cpu->timer.tima = val;
+		cpu_timer_schedule(cpu);
+		break;
+	case IO_TAC:
+		// so can disabling the timer or selecting another bit
+		cpu_timer_sync(cpu);
+		if (cpu_timer_signal(cpu, cpu->dev_map[IO_TAC], cpu->next_instruction) &&
+		    !cpu_timer_signal(cpu, val, cpu->next_instruction))
+		{
+			cpu_timer_increment(cpu);
+		}
+		cpu->dev_map[reg] = val & 0x07;
+		cpu_timer_schedule(cpu);
+		break;
+	case IO_IF:
+		cpu->dev_map[reg] = val & 0x1F;
+		cpu_int_update(cpu);
+		break;
+	case IO_NR10 ... IO_WAVE + 0x0F:
+		cpu_apu_write(cpu, reg, val);
+		break;
+	case IO_LCDC:
+		// lines that are due are drawn with the old value
+		cpu_sched_events(cpu);
+		if (0 != ((cpu->dev_map[reg] ^ val) & 0x80))
+		{
+			if (0 != (val & 0x80))
+			{
+				cpu_ppu_start(cpu);
+			}
+			else
+			{
+				cpu_ppu_stop(cpu);
+			}
+		}
+		cpu->dev_map[reg] = val;
+		cpu_ppu_stat(cpu);
+		break;
+	case IO_STAT:
+		cpu_sched_events(cpu);
+		if (cpu->ppu.lazy && (0 != (val & 0x28)))
+		{
+			cpu_ppu_exact(cpu);
+		}
+		cpu->dev_map[reg] = val & 0x78;
+		cpu_ppu_stat(cpu);
+		break;
+	case IO_LY:
+		// read-only
+		break;
+	case IO_LYC:
+		cpu_sched_events(cpu);
+		cpu->dev_map[reg] = val;
+		cpu_ppu_stat(cpu);
+		break;
+	case IO_SCY: case IO_SCX: case IO_BGP: case IO_OBP0: case IO_OBP1: case IO_WY: case IO_WX:
+		cpu_sched_events(cpu);
+		cpu->dev_map[reg] = val;
+		break;
+	case IO_DMA:
+		cpu->dev_map[reg] = val;
+		cpu_dma_start(cpu, val);
+		break;
+	case IO_HDMA5:
+		if (cpu->cart.cgb)
+		{
+			cpu_hdma_start(cpu, val);
+		}
+		else
+		{
+			cpu->dev_map[reg] = val;
+		}
+		break;
+	case IO_KEY1:
+		cpu->dev_map[reg] = cpu->cart.cgb ? (val & 0x01) : val;
+		break;
+	case IO_VBK: case IO_SVBK:
+		if (cpu->cart.cgb)
+		{
+			cpu_cgb_bank(cpu, reg, val);
+		}
+		else
+		{
+			cpu->dev_map[reg] = val;
+		}
+		break;
+	case IO_BCPD:
+		cpu_sched_events(cpu);
+		cpu_palette_write(cpu->ppu.bg_palette, &cpu->dev_map[IO_BCPS], val);
+		break;
+	case IO_OCPD:
+		cpu_sched_events(cpu);
+		cpu_palette_write(cpu->ppu.obj_palette, &cpu->dev_map[IO_OCPS], val);
+		break;
+	default:
+		cpu->dev_map[reg] = val;
+		break;
+	}
+}
+
+// remaining time of a real-time device, in CPU clocks of the new speed
+static uint64_t cpu_speed_scale(sm83_t *cpu, uint64_t t)
+{
+	return cpu->cgb.speed ? (t / 2) : (t * 2);
+}
+
+/* STOP with KEY1 bit 0 set: the CPU clock doubles or halves. DIV, the
+ * timer, the serial port and the OAM DMA count CPU clocks, so their events
+ * stay as they are. The PPU and the APU keep their clock, the time left
+ * until their pending events is rescaled, see cpu_event_realtime and
+ * PPU_TIME(). */
+static __attribute__((noinline)) void cpu_speed_switch(sm83_t *cpu)
+{
+	uint64_t now = cpu->next_instruction;
+
+	cpu_apu_sync(cpu);
+	for (uint32_t id = 0; id < EVT_COUNT; id++)
+	{
+		if (cpu_event_realtime[id] && (SCHED_IDLE != cpu->sched.pos[id]))
+		{
+			cpu_sched_add(cpu, id, now + cpu_speed_scale(cpu, cpu->sched.time[id] - now));
+		}
+	}
+	if (0 != (cpu->dev_map[IO_LCDC] & 0x80))
+	{
+		cpu->ppu.line_start = now - cpu_speed_scale(cpu, now - cpu->ppu.line_start);
+	}
+	cpu->apu.seq_next = now + cpu_speed_scale(cpu, cpu->apu.seq_next - now);
+	if (cpu->cart.rtc)
+	{
+		cpu_rtc_now(cpu);
+		cpu->cart.rtc_time = now - cpu_speed_scale(cpu, now - cpu->cart.rtc_time);
+	}
+	cpu->cgb.speed ^= 1;
+	cpu->dev_map[IO_KEY1] = 0;
+
+	// the divider stands still while the clock changes, then starts at 0
+	cpu->next_instruction += SPEED_SWITCH_CYCLES;
+	cpu_sched_events(cpu);
+	cpu_io_write(cpu, 0xFF00 | IO_DIV, 0);
+}
+#endif
+
+static uint8_t cpu_read_slow(sm83_t *cpu, uint16_t addr)
+{
+	uint8_t ret = 0;
+
+#if !(0 < BUILD_TEST_DLL)
+	if (0xFF80 <= addr)
+	{
+		// HRAM and IE, most of the slow path, e.g. the stack
+		return ((uint8_t *) &cpu->rom[0])[addr];
+	}
+	if (cpu->dma.active && cpu_dma_blocked(cpu, addr))
+	{
+		return cpu_dma_conflict(cpu, addr);
+	}
+#endif
+	if ((NULL != cpu->cart.rom) && (0xA000 == (addr & 0xE000)))
+	{
+		return cpu_mbc_read(cpu);
+	}
+
+#if (0 < BUILD_TEST_DLL)
+	ret = ((uint8_t *) &cpu->rom[0])[addr];
+#else
+	if (0xFF00 == (addr & 0xFF80))
+	{
+		ret = cpu_io_read(cpu, addr);
+	}
+	else if (((addr < 0xFEA0 ) || (addr > 0xFEFF)) &&
+	    ((addr < 0xE000 ) || (addr > 0xFDFF)))
+	{
+		ret = ((uint8_t *) &cpu->rom[0])[addr];
+	}
+	else
+	{
+		debug_printf ("illegal memory access at 0x%04x.\n", addr);
+	}
+#endif
+
+	return ret;
+}
+
+static void cpu_write_slow(sm83_t *cpu, uint16_t addr, uint8_t val)
+{
+	uint8_t *host = cpu_page_host(cpu, addr >> 8, true);
+
+	if ((NULL == host) && (NULL != cpu->cart.rom) && ((addr < 0x8000) || (0xA000 == (addr & 0xE000))))
+	{
+		// the ROM itself is never written, so no translated code to invalidate
+		cpu_mbc_write(cpu, addr, val);
+		return;
+	}
+
+	if (NULL != host)
+	{
+		// page with translated code
+		host[addr & 0xFF] = val;
+	}
+#if !(0 < BUILD_TEST_DLL)
+	else if (0xFF00 == (addr & 0xFF80))
+	{
+		cpu_io_write(cpu, addr, val);
+	}
+	else if (0xFFFF == addr)
+	{
+		cpu->int_en[0x7F] = val;
+		cpu_int_update(cpu);
+	}
+	else if (((addr < 0xFEA0 ) || (addr > 0xFEFF)) &&
+	    ((addr < 0xE000 ) || (addr > 0xFDFF)))
+	{
+		((uint8_t *) &cpu->rom[0])[addr] = val;
+	}
+#if (USE_0xE000_AS_PUTC_DEVICE)
+	else if (addr == 0xE000)
+	{
+#if (0 < DYNAREC_VERIFY)
+		if (!cpu->dynarec->verifying)
+#endif
+		{
+			cpu->putc_buf[cpu->putc_len++] = val;
+			if (CPU_PUTC_BUFFER == cpu->putc_len)
+			{
+				cpu_flush_putc(cpu);
+			}
+		}
+	}
+#endif
+	else
+	{
+		debug_printf ("illegal memory access at 0x%04x.\n", addr);
+	}
+#endif
+
+#if (0 < USE_DYNAREC)
+	// on page 0xFF only HRAM can hold code, not the I/O registers
+	if ((0 != cpu->dynarec->code_pages[addr >> 8]) && ((addr < 0xFF00) || IS_IN_RANGE(addr, 0xFF80, 0xFFFE)))
+	{
+		dynarec_invalidate(cpu, addr >> 8);
+		cpu_map_page(cpu, addr >> 8);
+	}
+#endif
+}
+
+/*---------------------------------------------------------------------*
+ *  public functions                                                   *
+ *---------------------------------------------------------------------*/
+uint8_t cpu_get_memory(sm83_t *cpu, uint16_t addr)
+{
+	const uint8_t *page = cpu->read_page[addr >> 8];
+
+	if (NULL != page)
+	{
+		return page[addr & 0xFF];
+	}
+	return cpu_read_slow(cpu, addr);
+}
+
+void cpu_set_memory(sm83_t *cpu, uint16_t addr, uint8_t val)
+{
+	uint8_t *page = cpu->write_page[addr >> 8];
+
+	if (NULL != page)
+	{
+		page[addr & 0xFF] = val;
+	}
+	else
+	{
+		cpu_write_slow(cpu, addr, val);
+	}
+
+	debug_printf("\nwrote %02x to %04x\n", val, addr);
+}
+
+static void cpu_build_decode_table(void);
+#if (0 < USE_ALU_TABLES) || (0 < BUILD_ALU_BENCHMARK)
+static void cpu_build_alu_tables(void);
+#endif
+
+/* The decode and ALU tables are shared by all instances. The first caller
+ * builds them, concurrent callers wait until they are complete. */
+static void cpu_build_tables(void)
+{
+	static int state = 0;	// 0: not built, 1: building, 2: done
+	int expected = 0;
+
+	if (2 == __atomic_load_n(&state, __ATOMIC_ACQUIRE))
+	{
+		return;
+	}
+
+	if (__atomic_compare_exchange_n(&state, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	{
+		cpu_build_decode_table();
+#if (0 < USE_ALU_TABLES)
+		cpu_build_alu_tables();
+#endif
+#if !(0 < BUILD_TEST_DLL)
+		cpu_build_apu_kernel();
+#endif
+#if (0 < USE_THREADED_DISPATCH)
+		// builds the label table of the threaded interpreter
+		cpu_run(NULL, 0);
+#endif
+		__atomic_store_n(&state, 2, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		while (2 != __atomic_load_n(&state, __ATOMIC_ACQUIRE))
+		{
+		}
+	}
+}
+
+sm83_t *cpu_create(void)
+{
+	sm83_t *cpu = calloc(1, sizeof(*cpu));
+
+	if (NULL == cpu)
+	{
+		DBG_ERROR();
+		return NULL;
+	}
+
+	cpu_build_tables();
+	cpu->putc_fd = 1;
+	cpu->frame_skip = 1;
+	cpu_init(cpu);
+
+	return cpu;
+}
+
+void cpu_destroy(sm83_t *cpu)
+{
+	if (NULL == cpu)
+	{
+		return;
+	}
+
+	cpu_flush_putc(cpu);
+	// finishes the WAV file of cpu_save_audio()
+	cpu_set_audio(cpu, NULL, 0, NULL, NULL);
+#if (0 < USE_DYNAREC)
+	dynarec_destroy(cpu);
+#endif
+	cpu_cart_release(cpu);
+	free(cpu);
+}
+
+void cpu_init(sm83_t *cpu)
+{
+	cpu_putc_t putc_cb;
+	void *putc_ctx;
+	int putc_fd;
+	uint32_t frame_skip = cpu->frame_skip;
+	__typeof__(cpu->cart) cart = cpu->cart;
+	__typeof__(cpu->audio) audio;
+#if (0 < USE_DYNAREC)
+	dynarec_t *dynarec = cpu->dynarec;
+#endif
+
+	cpu_flush_putc(cpu);
+	cpu_flush_audio(cpu);
+	audio = cpu->audio;
+	putc_cb = cpu->putc_cb;
+	putc_ctx = cpu->putc_ctx;
+	putc_fd = cpu->putc_fd;
+
+	memset(cpu, 0, sizeof(*cpu));
+
+	cpu->putc_cb = putc_cb;
+	cpu->putc_ctx = putc_ctx;
+	cpu->putc_fd = putc_fd;
+	cpu->frame_skip = frame_skip;
+	cpu->audio = audio;
+#if (0 < USE_DYNAREC)
+	cpu->dynarec = dynarec;
+	dynarec_init(cpu);
+#endif
+	cpu->cart = cart;
+	cpu->cart.rtc_time = 0;
+	cpu_mbc_reset(cpu);
+	cpu_sched_reset(cpu);
+#if !(0 < BUILD_TEST_DLL)
+	cpu->apu.seq_next = APU_SEQ_CYCLES;
+	cpu_apu_schedule(cpu);
+#endif
+}
+
+static void cpu_cart_release(sm83_t *cpu)
+{
+	if (NULL != cpu->cart.image)
+	{
+		cpu_rom_close(cpu->cart.image);
+	}
+	else
+	{
+		free((void *) cpu->cart.rom);
+	}
+	free(cpu->cart.ram);
+	memset(&cpu->cart, 0, sizeof(cpu->cart));
+}
+
+// 16 KiB banks of an image, a power of two and at most 8 MiB
+static uint32_t cpu_cart_banks(uint32_t size)
+{
+	uint32_t banks = 2;
+
+	while (((banks << 14) < size) && (banks < 512))
+	{
+		banks <<= 1;
+	}
+	return banks;
+}
+
+/* Takes the MBC and the size of the external RAM from the header and
+ * allocates that RAM. The ROM itself is set up by the caller. */
+static bool cpu_cart_setup(sm83_t *cpu, const uint8_t *rom, uint32_t size)
+{
+	// external RAM in 8 KiB banks, by header byte 0x149
+	static const uint8_t ram_banks[] = {0, 1, 1, 4, 16, 8};
+	uint8_t type = (0x147 < size) ? rom[0x147] : 0x00;
+	uint8_t ram_size = (0x149 < size) ? rom[0x149] : 0x00;
+
+	cpu_cart_release(cpu);
+	// 0x80: CGB enhanced, 0xC0: CGB only
+	cpu->cart.cgb = (0x143 < size) && (0 != (rom[0x143] & 0x80));
+
+	switch (type)
+	{
+		case 0x00: case 0x08: case 0x09:
+			cpu->cart.mbc = MBC_NONE;
+			break;
+		case 0x01: case 0x02: case 0x03:
+			cpu->cart.mbc = MBC_1;
+			break;
+		case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13:
+			cpu->cart.mbc = MBC_3;
+			cpu->cart.rtc = (type <= 0x10);
+			break;
+		case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+			cpu->cart.mbc = MBC_5;
+			break;
+		default:
+			printf("Warning: cartridge type 0x%02x not supported.\n", type);
+			cpu->cart.mbc = MBC_NONE;
+			break;
+	}
+
+	cpu->cart.rom_banks = cpu_cart_banks(size);
+	cpu->cart.ram_banks = (ram_size < sizeof(ram_banks)) ? ram_banks[ram_size] : 0;
+	if (0 < cpu->cart.ram_banks)
+	{
+		cpu->cart.ram = calloc(cpu->cart.ram_banks, 0x2000);
+		if (NULL == cpu->cart.ram)
+		{
+			DBG_ERROR();
+			cpu_cart_release(cpu);
+			return false;
+		}
+	}
+	cpu->cart.rtc_time = cpu->next_instruction;
+
+	return true;
+}
+
+/* Copies a complete cartridge image, the MBC is taken from the header. The
+ * banks are mapped in place, a bank switch only repoints the pages of its
+ * window. */
+bool cpu_load_rom(sm83_t *cpu, const uint8_t *rom, uint32_t size)
+{
+	uint8_t *copy = NULL;
+
+	if (cpu_cart_setup(cpu, rom, size))
+	{
+		copy = malloc(cpu->cart.rom_banks << 14);
+	}
+	if (NULL == copy)
+	{
+		DBG_ERROR();
+		cpu_cart_release(cpu);
+		cpu_mbc_reset(cpu);
+		return false;
+	}
+
+	if ((cpu->cart.rom_banks << 14) < size)
+	{
+		printf("Warning: cartridge truncated to %u KiB.\n", cpu->cart.rom_banks << 4);
+		size = cpu->cart.rom_banks << 14;
+	}
+	memset(copy, 0xFF, cpu->cart.rom_banks << 14);
+	memcpy(copy, rom, size);
+	cpu->cart.rom = copy;
+
+	cpu_mbc_reset(cpu);
+	return true;
+}
+
+/* Maps a cartridge file read-only. Every instance that loads the same path
+ * uses the same mapping, it is released with the last one. */
+cpu_rom_t *cpu_rom_open(const char *path)
+{
+	cpu_rom_t *rom;
+
+	pthread_mutex_lock(&cpu_roms_lock);
+	for (rom = cpu_roms; NULL != rom; rom = rom->next)
+	{
+		if (0 == strcmp(rom->path, path))
+		{
+			rom->refs++;
+			pthread_mutex_unlock(&cpu_roms_lock);
+			return rom;
+		}
+	}
+
+	rom = calloc(1, sizeof(*rom));
+	if (NULL != rom)
+	{
+#if defined(_WIN32)
+		HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		HANDLE mapping = NULL;
+		LARGE_INTEGER size;
+
+		if ((INVALID_HANDLE_VALUE != file) && GetFileSizeEx(file, &size) &&
+		    (0 < size.QuadPart) && (size.QuadPart <= UINT32_MAX))
+		{
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		}
+		if (NULL != mapping)
+		{
+			rom->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			rom->size = (uint32_t) size.QuadPart;
+			CloseHandle(mapping);
+		}
+		if (INVALID_HANDLE_VALUE != file)
+		{
+			CloseHandle(file);
+		}
+#else
+		int fd = open(path, O_RDONLY);
+		struct stat st;
+
+		if ((0 <= fd) && (0 == fstat(fd, &st)) && (0 < st.st_size) && (st.st_size <= UINT32_MAX))
+		{
+			void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			rom->data = (MAP_FAILED != data) ? data : NULL;
+			rom->size = (uint32_t) st.st_size;
+		}
+		if (0 <= fd)
+		{
+			close(fd);
+		}
+#endif
+		rom->path = strdup(path);
+	}
+	if ((NULL == rom) || (NULL == rom->data) || (NULL == rom->path))
+	{
+		printf("Error: Could not map file '%s'.\n", path);
+		if (NULL != rom)
+		{
+			free(rom->path);
+			free(rom);
+		}
+		pthread_mutex_unlock(&cpu_roms_lock);
+		return NULL;
+	}
+
+	rom->refs = 1;
+	rom->next = cpu_roms;
+	cpu_roms = rom;
+	pthread_mutex_unlock(&cpu_roms_lock);
+
+	return rom;
+}
+
+void cpu_rom_close(cpu_rom_t *rom)
+{
+	if (NULL == rom)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&cpu_roms_lock);
+	if (0 == --rom->refs)
+	{
+		cpu_rom_t **link = &cpu_roms;
+		while (rom != *link)
+		{
+			link = &(*link)->next;
+		}
+		*link = rom->next;
+#if defined(_WIN32)
+		UnmapViewOfFile(rom->data);
+#else
+		munmap((void *) rom->data, rom->size);
+#endif
+		free(rom->path);
+		free(rom);
+	}
+	pthread_mutex_unlock(&cpu_roms_lock);
+}
+
+// the ROM banks point straight into the shared mapping
+bool cpu_attach_rom(sm83_t *cpu, cpu_rom_t *rom)
+{
+	bool ret;
+
+	// referenced before the current cartridge is released, so attaching the
+	// same image again keeps it mapped
+	pthread_mutex_lock(&cpu_roms_lock);
+	rom->refs++;
+	pthread_mutex_unlock(&cpu_roms_lock);
+
+	if ((cpu_cart_banks(rom->size) << 14) != rom->size)
+	{
+		// banks past the end of the file would be outside the mapping
+		ret = cpu_load_rom(cpu, rom->data, rom->size);
+		cpu_rom_close(rom);
+		return ret;
+	}
+
+	ret = cpu_cart_setup(cpu, rom->data, rom->size);
+	if (ret)
+	{
+		cpu->cart.rom = rom->data;
+		cpu->cart.image = rom;
+	}
+	else
+	{
+		cpu_rom_close(rom);
+	}
+
+	cpu_mbc_reset(cpu);
+	return ret;
+}
+
+bool cpu_load_rom_file(sm83_t *cpu, const char *path)
+{
+	cpu_rom_t *rom = cpu_rom_open(path);
+	bool ret = (NULL != rom) && cpu_attach_rom(cpu, rom);
+
+	cpu_rom_close(rom);
+	return ret;
+}
+
+// NULL restores the output to the file descriptor, see cpu_set_putc_fd()
+void cpu_set_putc(sm83_t *cpu, cpu_putc_t putc_cb, void *ctx)
+{
+	cpu_flush_putc(cpu);
+	cpu->putc_cb = putc_cb;
+	cpu->putc_ctx = ctx;
+}
+
+// output without a callback goes to fd, stdout by default, -1 discards it
+void cpu_set_putc_fd(sm83_t *cpu, int fd)
+{
+	cpu_flush_putc(cpu);
+	cpu->putc_fd = fd;
+}
+
+/* Drains the buffered putc output. Called when the buffer is full, on STOP
+ * and when the output or the instance changes; a caller that stops running
+ * an instance before it executes STOP flushes the rest itself. */
+void cpu_flush_putc(sm83_t *cpu)
+{
+	uint32_t done = 0;
+
+	if (0 == cpu->putc_len)
+	{
+		return;
+	}
+
+	if (NULL != cpu->putc_cb)
+	{
+		cpu->putc_cb(cpu->putc_ctx, cpu->putc_buf, cpu->putc_len);
+	}
+	else if (0 <= cpu->putc_fd)
+	{
+		// keep the order with the printf() output of the emulator
+		fflush(stdout);
+		while (done < cpu->putc_len)
+		{
+#if defined(_WIN32)
+			int n = _write(cpu->putc_fd, &cpu->putc_buf[done], cpu->putc_len - done);
+#else
+			ssize_t n = write(cpu->putc_fd, &cpu->putc_buf[done], cpu->putc_len - done);
+#endif
+			if (n <= 0)
+			{
+				break;
+			}
+			done += n;
+		}
+	}
+	cpu->putc_len = 0;
+}
+
+uint64_t cpu_get_cycles(sm83_t *cpu)
+{
+	return cpu->cycle_cnt;
+}
+
+uint64_t cpu_get_time(sm83_t *cpu)
+{
+	return cpu->next_instruction;
+}
+
+void cpu_get_stats(sm83_t *cpu, cpu_stats_t *stats)
+{
+	*stats = cpu->stats;
+}
+
+bool cpu_is_stopped(sm83_t *cpu)
+{
+	return cpu->stopped;
+}
+
+/* A skipped frame is drawn when it is requested, from the state at the
+ * time of the request: effects that change registers between lines are
+ * lost, a static screen looks the same. */
+const uint16_t *cpu_get_frame(sm83_t *cpu)
+{
+#if !(0 < BUILD_TEST_DLL)
+	if (!cpu->ppu.valid && (0 != (cpu->dev_map[IO_LCDC] & 0x80)))
+	{
+		uint8_t window_line = cpu->ppu.window_line;
+
+		// into the front frame, the other one may be in the middle of being drawn
+		cpu->ppu.window_line = 0;
+		for (uint32_t ly = 0; ly < CPU_SCREEN_HEIGHT; ly++)
+		{
+			cpu_ppu_render(cpu, ly, cpu->ppu.frame[cpu->ppu.front][ly]);
+		}
+		cpu->ppu.window_line = window_line;
+		cpu->ppu.valid = true;
+	}
+#endif
+	return &cpu->ppu.frame[cpu->ppu.front][0][0];
+}
+
+void cpu_set_frame_skip(sm83_t *cpu, uint32_t n)
+{
+	cpu->frame_skip = n;
+}
+
+uint64_t cpu_get_frame_count(sm83_t *cpu)
+{
+	return cpu->ppu.frames;
+}
+
+// writes the last complete frame as binary PPM, for comparisons with reference images
+bool cpu_save_frame(sm83_t *cpu, const char *path)
+{
+	const uint16_t *frame = cpu_get_frame(cpu);
+	FILE *file = fopen(path, "wb");
+
+	if (NULL == file)
+	{
+		printf("Error: Could not open file '%s'.\n", path);
+		return false;
+	}
+
+	fprintf(file, "P6\n%u %u\n255\n", CPU_SCREEN_WIDTH, CPU_SCREEN_HEIGHT);
+	for (uint32_t i = 0; i < CPU_SCREEN_WIDTH * CPU_SCREEN_HEIGHT; i++)
+	{
+		uint8_t rgb[3];
+
+		for (uint32_t c = 0; c < 3; c++)
+		{
+			uint8_t v = (frame[i] >> (5 * c)) & 0x1F;
+			rgb[c] = (v << 3) | (v >> 2);
+		}
+		fwrite(rgb, 1, sizeof(rgb), file);
+	}
+
+	return (0 == fclose(file));
+}
+
+// sound output of cpu_save_audio(), the host is little-endian like WAV
+static void cpu_wav_write(void *ctx, const int16_t *samples, uint32_t frames)
+{
+	sm83_t *cpu = ctx;
+
+	fwrite(samples, 2 * sizeof(int16_t), frames, cpu->audio.wav);
+	cpu->audio.wav_frames += frames;
+}
+
+// 16 bit stereo PCM at CPU_AUDIO_RATE
+static void cpu_wav_header(FILE *file, uint32_t frames)
+{
+	uint32_t fields[] = { 36 + 4 * frames, 16, (2 << 16) | 1, CPU_AUDIO_RATE, 4 * CPU_AUDIO_RATE, (16 << 16) | 4, 4 * frames };
+	uint8_t header[44];
+
+	memcpy(&header[0], "RIFF", 4);
+	memcpy(&header[8], "WAVEfmt ", 8);
+	memcpy(&header[36], "data", 4);
+	for (uint32_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+	{
+		// RIFF size, then the fmt chunk from its size on, then the data size
+		uint32_t offset = (0 == i) ? 4 : (6 == i) ? 40 : (12 + 4 * i);
+
+		for (uint32_t b = 0; b < 4; b++)
+		{
+			header[offset + b] = (uint8_t) (fields[i] >> (8 * b));
+		}
+	}
+	fwrite(header, 1, sizeof(header), file);
+}
+
+// the sizes are written when the file is complete
+static void cpu_wav_close(sm83_t *cpu)
+{
+	if (NULL == cpu->audio.wav)
+	{
+		return;
+	}
+	rewind(cpu->audio.wav);
+	cpu_wav_header(cpu->audio.wav, cpu->audio.wav_frames);
+	fclose(cpu->audio.wav);
+	free(cpu->audio.buffer);
+	cpu->audio.wav = NULL;
+	cpu->audio.buffer = NULL;
+}
+
+void cpu_set_audio(sm83_t *cpu, int16_t *buffer, uint32_t frames, cpu_audio_t audio_cb, void *ctx)
+{
+	cpu_flush_audio(cpu);
+	cpu_wav_close(cpu);
+	cpu->audio.buffer = ((NULL != audio_cb) && (0 < frames)) ? buffer : NULL;
+	cpu->audio.frames = frames;
+	cpu->audio.used = 0;
+	cpu->audio.cb = audio_cb;
+	cpu->audio.ctx = ctx;
+#if !(0 < BUILD_TEST_DLL)
+	cpu_apu_schedule(cpu);
+#endif
+}
+
+/* Hands the complete samples to the callback of cpu_set_audio(). Called
+ * on STOP and when the output or the instance changes; a caller that stops
+ * running an instance before it executes STOP flushes the rest itself. */
+void cpu_flush_audio(sm83_t *cpu)
+{
+#if !(0 < BUILD_TEST_DLL)
+	if (NULL == cpu->audio.buffer)
+	{
+		return;
+	}
+	cpu_apu_sync(cpu);
+	cpu_apu_emit(cpu);
+	if (0 < cpu->audio.used)
+	{
+		cpu_audio_output(cpu);
+	}
+#endif
+}
+
+bool cpu_save_audio(sm83_t *cpu, const char *path)
+{
+	FILE *file = fopen(path, "wb");
+	int16_t *buffer = malloc(APU_WAV_FRAMES * 2 * sizeof(int16_t));
+
+	if ((NULL == file) || (NULL == buffer))
+	{
+		printf("Error: Could not open file '%s'.\n", path);
+		if (NULL != file)
+		{
+			fclose(file);
+		}
+		free(buffer);
+		return false;
+	}
+
+	cpu_wav_header(file, 0);
+	cpu_set_audio(cpu, buffer, APU_WAV_FRAMES, cpu_wav_write, cpu);
+	cpu->audio.wav = file;
+	cpu->audio.wav_frames = 0;
+
+	return true;
+}
+
+// RETI enables the interrupts without the delay of EI
+void cpu_isr_handled(sm83_t *cpu)
+{
+	cpu->interrupts_enabled = true;
+	cpu->ei_delay = 0;
+	cpu_int_update(cpu);
+}
+
+void eval_Z_flag(sm83_t *cpu, uint8_t reg)
+{
+	if (0 == reg)
+	{
+		cpu->af.f |= FLAG_Z;
+	}
+	else
+	{
+		cpu->af.f &= ~FLAG_Z;
+	}
+}
+
+void set_Z_flag(sm83_t *cpu, bool zero)
+{
+	if (zero)
+	{
+		cpu->af.f |= FLAG_Z;
+	}
+	else
+	{
+		cpu->af.f &= ~FLAG_Z;
+	}
+}
+
+void set_N_flag(sm83_t *cpu, bool subtract)
+{
+	if (subtract)
+	{
+		cpu->af.f |= FLAG_N;
+	}
+	else
+	{
+		cpu->af.f &= ~FLAG_N;
+	}
+}
+
+void eval_H_flag_c(sm83_t *cpu, uint8_t target, uint8_t operand, bool sub, uint8_t carry)
+{
+	bool h;
+	uint8_t temp = target + operand;
+	if (!sub)
+	{
+		h = ((target & 0xF) + (operand & 0xF) + carry) > 0xF;
+	}
+	else
+	{
+		h = ((int)((target & 0xf) - (operand & 0xf) - carry) < 0);
+	}
+
+	if (h)
+	{
+		cpu->af.f |= FLAG_H;
+	}
+	else
+	{
+		cpu->af.f &= ~FLAG_H;
+	}
+
+	return;
+}
+
+void eval_H_flag(sm83_t *cpu, uint8_t target, uint8_t operand, bool sub)
+{
+	eval_H_flag_c(cpu, target, operand, sub, 0);
+}
+
+void eval_H_flag_16(sm83_t *cpu, uint16_t target, uint16_t operand)
+{
+	if (((target & 0xFFF) + (operand & 0xFFF)) > 0xFFF)
+	{
+		cpu->af.f |= FLAG_H;
+	}
+	else
+	{
+		cpu->af.f &= ~FLAG_H;
+	}
+
+	return;
+}
+
+void set_H_flag(sm83_t *cpu, bool h)
+{
+	if (h)
+	{
+		cpu->af.f |= FLAG_H;
+	}
+	else
+	{
+		cpu->af.f &= ~FLAG_H;
+	}
+}
+
+void eval_C_flag_c(sm83_t *cpu, uint8_t target, uint8_t operand, bool sub, uint8_t carry)
+{
+	bool c;
+	if (!sub)
+	{
+		c = ((uint16_t)(target + operand + carry)) > 0xFF;
+	}
+	else
+	{
+		c = ((int) (target - operand - carry) < 0);
+	}
+
+	if (c)
+	{
+		cpu->af.f |= FLAG_C;
+	}
+	else
+	{
+		cpu->af.f &= ~FLAG_C;
+	}
+
+	return;
+}
+
+void eval_C_flag(sm83_t *cpu, uint8_t target, uint8_t operand, bool sub)
+{
+	eval_C_flag_c(cpu, target, operand, sub, 0);
+}
+
+void eval_C_flag_16(sm83_t *cpu, uint16_t target, uint16_t operand)
+{
+	if ((((uint32_t) target) + ((uint32_t) operand)) > 0xFFFF)
+	{
+		cpu->af.f |= FLAG_C;
+	}
+	else
+	{
+		cpu->af.f &= ~FLAG_C;
+	}
+
+	return;
+}
+
+void set_C_flag(sm83_t *cpu, bool c)
+{
+	if (c)
+	{
+		cpu->af.f |= FLAG_C;
+	}
+	else
+	{
+		cpu->af.f &= ~FLAG_C;
+	}
+}
+
+#if (0 < USE_ALU_TABLES) || (0 < BUILD_ALU_BENCHMARK)
+#define ALU_INDEX(_a, _b, _c) ((((uint32_t) (_c)) << 16) | (((uint32_t) (_a)) << 8) | (_b))
+#define SHIFT_INDEX(_op, _c, _val) ((((uint16_t) (_op)) << 9) | (((uint16_t) (_c)) << 8) | (_val))
+
+/* Precompute result and flags of the 8-bit ALU and the CB shift family,
+ * packed as (result << 8) | flags. */
+static void cpu_build_alu_tables(void)
+{
+	for (uint32_t c = 0; c < 2; c++)
+	{
+		for (uint32_t a = 0; a < 0x100; a++)
+		{
+			for (uint32_t b = 0; b < 0x100; b++)
+			{
+				uint8_t result = a + b + c;
+				uint8_t f = 0;
+				f |= (0 == result) ? FLAG_Z : 0;
+				f |= (((a & 0xF) + (b & 0xF) + c) > 0xF) ? FLAG_H : 0;
+				f |= ((a + b + c) > 0xFF) ? FLAG_C : 0;
+				alu_add_table[ALU_INDEX(a, b, c)] = ((uint16_t) result << 8) | f;
+
+				result = a - b - c;
+				f = FLAG_N;
+				f |= (0 == result) ? FLAG_Z : 0;
+				f |= ((a & 0xF) < ((b & 0xF) + c)) ? FLAG_H : 0;
+				f |= (a < (b + c)) ? FLAG_C : 0;
+				alu_sub_table[ALU_INDEX(a, b, c)] = ((uint16_t) result << 8) | f;
+			}
+
+			for (uint32_t op = 0; op < 8; op++)
+			{
+				uint8_t val = a;
+				uint8_t result;
+				bool c_out;
+				switch (op)
+				{
+				case SHIFT_RLC:  result = (val << 1) | (val >> 7); c_out = (0 != (val & 0x80)); break;
+				case SHIFT_RRC:  result = (val >> 1) | (val << 7); c_out = (0 != (val & 0x01)); break;
+				case SHIFT_RL:   result = (val << 1) | c;          c_out = (0 != (val & 0x80)); break;
+				case SHIFT_RR:   result = (val >> 1) | (c << 7);   c_out = (0 != (val & 0x01)); break;
+				case SHIFT_SLA:  result = (val << 1);              c_out = (0 != (val & 0x80)); break;
+				case SHIFT_SRA:  result = (val >> 1) | (val & 0x80); c_out = (0 != (val & 0x01)); break;
+				case SHIFT_SWAP: result = (val << 4) | (val >> 4); c_out = false; break;
+				default:         result = (val >> 1);              c_out = (0 != (val & 0x01)); break;
+				}
+				alu_shift_table[SHIFT_INDEX(op, c, val)] = ((uint16_t) result << 8) |
+					((0 == result) ? FLAG_Z : 0) | (c_out ? FLAG_C : 0);
+			}
+		}
+	}
+}
+#endif
+
+#if (0 < USE_LAZY_FLAGS)
+/* Materialize Z/N/H/C from the operands recorded by the last 8-bit ALU
+ * operation. Must be called before anything reads or partially updates F. */
+static void cpu_flags_sync(sm83_t *cpu)
+{
+	uint8_t f;
+
+	switch (cpu->lazy.op)
+	{
+	case LAZY_NONE:
+		return;
+
+#if (0 < USE_ALU_TABLES)
+	case LAZY_ADD:
+		f = LOW_BYTE(alu_add_table[ALU_INDEX(cpu->lazy.a, cpu->lazy.b, cpu->lazy.c)]);
+		break;
+
+	case LAZY_SUB:
+		f = LOW_BYTE(alu_sub_table[ALU_INDEX(cpu->lazy.a, cpu->lazy.b, cpu->lazy.c)]);
+		break;
+#else
+	case LAZY_ADD:
+		f = (((cpu->lazy.a & 0xF) + (cpu->lazy.b & 0xF) + cpu->lazy.c) > 0xF) ? FLAG_H : 0;
+		f |= ((cpu->lazy.a + cpu->lazy.b + cpu->lazy.c) > 0xFF) ? FLAG_C : 0;
+		f |= (0 == cpu->lazy.result) ? FLAG_Z : 0;
+		break;
+
+	case LAZY_SUB:
+		f = FLAG_N;
+		f |= ((cpu->lazy.a & 0xF) < ((cpu->lazy.b & 0xF) + cpu->lazy.c)) ? FLAG_H : 0;
+		f |= (cpu->lazy.a < (cpu->lazy.b + cpu->lazy.c)) ? FLAG_C : 0;
+		f |= (0 == cpu->lazy.result) ? FLAG_Z : 0;
+		break;
+#endif
+
+	case LAZY_AND:
+		f = FLAG_H | ((0 == cpu->lazy.result) ? FLAG_Z : 0);
+		break;
+
+	default:
+		f = (0 == cpu->lazy.result) ? FLAG_Z : 0;
+		break;
+	}
+
+	cpu->af.f = f | (cpu->af.f & 0x0F);
+	cpu->lazy.op = LAZY_NONE;
+}
+
+#define FLAGS_SYNC() cpu_flags_sync(cpu)
+#else
+#define FLAGS_SYNC() do {} while (0)
+#endif
+
+static inline uint8_t cpu_get_carry(sm83_t *cpu)
+{
+#if (0 < USE_LAZY_FLAGS)
+	switch (cpu->lazy.op)
+	{
+	case LAZY_NONE: break;
+	case LAZY_ADD: return ((cpu->lazy.a + cpu->lazy.b + cpu->lazy.c) > 0xFF) ? 1 : 0;
+	case LAZY_SUB: return (cpu->lazy.a < (cpu->lazy.b + cpu->lazy.c)) ? 1 : 0;
+	default: return 0;
+	}
+#endif
+	return (0 != (cpu->af.f & FLAG_C)) ? 1 : 0;
+}
+
+#if (0 < USE_LAZY_FLAGS)
+static inline void alu_flags_lazy(sm83_t *cpu, uint8_t op, uint8_t a, uint8_t b, uint8_t c, uint8_t result)
+{
+	cpu->lazy.op = op;
+	cpu->lazy.a = a;
+	cpu->lazy.b = b;
+	cpu->lazy.c = c;
+	cpu->lazy.result = result;
+}
+#endif
+
+// ADD, ADC
+static inline uint8_t alu_add(sm83_t *cpu, uint8_t a, uint8_t b, uint8_t c)
+{
+#if (0 < USE_LAZY_FLAGS)
+	uint8_t result = a + b + c;
+	alu_flags_lazy(cpu, LAZY_ADD, a, b, c, result);
+#elif (0 < USE_ALU_TABLES)
+	uint16_t entry = alu_add_table[ALU_INDEX(a, b, c)];
+	uint8_t result = HIGH_BYTE(entry);
+	cpu->af.f = LOW_BYTE(entry) | (cpu->af.f & 0x0F);
+#else
+	uint8_t result = a + b + c;
+	eval_Z_flag(cpu, result);
+	set_N_flag(cpu, false);
+	eval_H_flag_c(cpu, a, b, false, c);
+	eval_C_flag_c(cpu, a, b, false, c);
+#endif
+	return result;
+}
+
+// SUB, SBC, CP
+static inline uint8_t alu_sub(sm83_t *cpu, uint8_t a, uint8_t b, uint8_t c)
+{
+#if (0 < USE_LAZY_FLAGS)
+	uint8_t result = a - b - c;
+	alu_flags_lazy(cpu, LAZY_SUB, a, b, c, result);
+#elif (0 < USE_ALU_TABLES)
+	uint16_t entry = alu_sub_table[ALU_INDEX(a, b, c)];
+	uint8_t result = HIGH_BYTE(entry);
+	cpu->af.f = LOW_BYTE(entry) | (cpu->af.f & 0x0F);
+#else
+	uint8_t result = a - b - c;
+	eval_Z_flag(cpu, result);
+	set_N_flag(cpu, true);
+	eval_H_flag_c(cpu, a, b, true, c);
+	eval_C_flag_c(cpu, a, b, true, c);
+#endif
+	return result;
+}
+
+static inline uint8_t alu_and(sm83_t *cpu, uint8_t result)
+{
+#if (0 < USE_LAZY_FLAGS)
+	alu_flags_lazy(cpu, LAZY_AND, 0, 0, 0, result);
+#elif (0 < USE_ALU_TABLES)
+	// flags only depend on the result, no table needed
+	cpu->af.f = ((0 == result) ? FLAG_Z : 0) | FLAG_H | (cpu->af.f & 0x0F);
+#else
+	eval_Z_flag(cpu, result);
+	set_N_flag(cpu, false);
+	set_H_flag(cpu, true);
+	set_C_flag(cpu, false);
+#endif
+	return result;
+}
+
+// OR, XOR
+static inline uint8_t alu_or(sm83_t *cpu, uint8_t result)
+{
+#if (0 < USE_LAZY_FLAGS)
+	alu_flags_lazy(cpu, LAZY_OR, 0, 0, 0, result);
+#elif (0 < USE_ALU_TABLES)
+	cpu->af.f = ((0 == result) ? FLAG_Z : 0) | (cpu->af.f & 0x0F);
+#else
+	eval_Z_flag(cpu, result);
+	set_N_flag(cpu, false);
+	set_H_flag(cpu, false);
+	set_C_flag(cpu, false);
+#endif
+	return result;
+}
+
+/* RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL. Flags must be in sync, as these
+ * read C and overwrite all flags. */
+static inline uint8_t alu_shift(sm83_t *cpu, uint8_t op, uint8_t val)
+{
+#if (0 < USE_ALU_TABLES)
+	uint16_t entry = alu_shift_table[SHIFT_INDEX(op, cpu_get_carry(cpu), val)];
+	cpu->af.f = LOW_BYTE(entry) | (cpu->af.f & 0x0F);
+	return HIGH_BYTE(entry);
+#else
+	bool bit0 = (0 != (val & (1<<0)));
+	bool bit7 = (0 != (val & (1<<7)));
+	bool c = (0 != (cpu->af.f & FLAG_C));
+	uint8_t result;
+	bool c_out;
+
+	switch (op)
+	{
+	case SHIFT_RLC:  result = (val << 1) | (bit7 ? 0x01 : 0); c_out = bit7; break;
+	case SHIFT_RRC:  result = (val >> 1) | (bit0 ? 0x80 : 0); c_out = bit0; break;
+	case SHIFT_RL:   result = (val << 1) | (c ? 0x01 : 0);    c_out = bit7; break;
+	case SHIFT_RR:   result = (val >> 1) | (c ? 0x80 : 0);    c_out = bit0; break;
+	case SHIFT_SLA:  result = (val << 1);                     c_out = bit7; break;
+	case SHIFT_SRA:  result = (val >> 1) | (bit7 ? 0x80 : 0); c_out = bit0; break;
+	case SHIFT_SWAP: result = (LOW_NIBBLE(val) << 4) | HIGH_NIBBLE(val); c_out = false; break;
+	default:         result = (val >> 1);                     c_out = bit0; break;
+	}
+
+	eval_Z_flag(cpu, result);
+	set_N_flag(cpu, false);
+	set_H_flag(cpu, false);
+	set_C_flag(cpu, c_out);
+	return result;
+#endif
+}
+
+static inline uint8_t opc_get_src8(sm83_t *cpu, const opc_desc_t *d)
+{
+	return (REG_HLI == d->src) ? cpu_get_memory(cpu, cpu->hl.hl) : REG8(d->src);
+}
+
+static inline bool opc_cond(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	return ((cpu->af.f & d->cond_mask) == d->cond_val);
+}
+
+static OPC_INLINE void opc_none(sm83_t *cpu, const opc_desc_t *d)
+{
+	DBG_ERROR();
+}
+
+static OPC_INLINE void opc_nop(sm83_t *cpu, const opc_desc_t *d)
+{
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_stop(sm83_t *cpu, const opc_desc_t *d)
+{
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+#if !(0 < BUILD_TEST_DLL)
+	if (cpu->cart.cgb && (0 != (cpu->dev_map[IO_KEY1] & 0x01)))
+	{
+		cpu_speed_switch(cpu);
+		return;
+	}
+#endif
+	cpu->stopped = true;
+	cpu_flush_putc(cpu);
+	cpu_flush_audio(cpu);
+}
+
+static OPC_INLINE void opc_halt(sm83_t *cpu, const opc_desc_t *d)
+{
+#if !(0 < BUILD_TEST_DLL)
+	// the cycles of HALT are taken once, it then repeats until the CPU wakes up
+	if (!cpu->halted)
+	{
+		cpu->next_instruction += d->cycles;
+		cpu->halted = true;
+	}
+	if (!cpu_halt(cpu) && !cpu->stopped)
+	{
+		return;
+	}
+	cpu->halted = false;
+#else
+	cpu->next_instruction += d->cycles;
+#endif
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ei(sm83_t *cpu, const opc_desc_t *d)
+{
+	if (!cpu->interrupts_enabled)
+	{
+		// counts down after this and the next instruction, see cpu_sched_run()
+		cpu->ei_delay = 2;
+		cpu_sched_update(cpu);
+	}
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_di(sm83_t *cpu, const opc_desc_t *d)
+{
+	cpu->interrupts_enabled = false;
+	cpu->ei_delay = 0;
+	cpu_int_update(cpu);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_daa(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	uint8_t a_reg = cpu->af.a;
+	bool N = (0 != (cpu->af.f & FLAG_N));
+	bool C = (0 != (cpu->af.f & FLAG_C));
+	bool H = (0 != (cpu->af.f & FLAG_H));
+	bool new_C = C;
+	if (!N)
+	{  // after an addition, adjust if (half-)carry occurred or if result is out of bounds
+		if (C || (a_reg > 0x99))
+		{
+			a_reg += 0x60;
+			new_C = true;
+		}
+		if (H || ((a_reg & 0x0f) > 0x09))
+		{
+			a_reg += 0x6;
+		}
+	}
+	else
+	{  // after a subtraction, only adjust if (half-)carry occurred
+		if (C)
+		{
+			a_reg -= 0x60;
+		}
+		if (H)
+		{
+			a_reg -= 0x6;
+		}
+	}
+	set_C_flag(cpu, new_C);
+	set_H_flag(cpu, false);
+	eval_Z_flag(cpu, a_reg);
+	cpu->af.a = a_reg;
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_cpl(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	set_N_flag(cpu, true);
+	set_H_flag(cpu, true);
+	cpu->af.a = ~cpu->af.a;
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_scf(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	set_N_flag(cpu, false);
+	set_H_flag(cpu, false);
+	set_C_flag(cpu, true);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ccf(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	set_N_flag(cpu, false);
+	set_H_flag(cpu, false);
+	set_C_flag(cpu, (0 == (cpu->af.f & FLAG_C)));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_rlca(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	cpu->af.a = alu_shift(cpu, SHIFT_RLC, cpu->af.a);
+	set_Z_flag(cpu, false);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_rla(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	cpu->af.a = alu_shift(cpu, SHIFT_RL, cpu->af.a);
+	set_Z_flag(cpu, false);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_rrca(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	cpu->af.a = alu_shift(cpu, SHIFT_RRC, cpu->af.a);
+	set_Z_flag(cpu, false);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_rra(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	cpu->af.a = alu_shift(cpu, SHIFT_RR, cpu->af.a);
+	set_Z_flag(cpu, false);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_cb(sm83_t *cpu, const opc_desc_t *d)
+{
+	const opc_desc_t *d2 = &opc_decode[0x100 + cpu_fetch(cpu, cpu->pc + 1)];
+	d2->handler(cpu, d2);
+}
+
+static OPC_INLINE void opc_call(sm83_t *cpu, const opc_desc_t *d)
+{
+	if (opc_cond(cpu, d))
+	{
+		uint8_t hi, lo;
+		uint16_t next_pc = cpu->pc + 3;
+		lo = cpu_fetch(cpu, cpu->pc + 1);
+		hi = cpu_fetch(cpu, cpu->pc + 2);
+		cpu_set_memory(cpu, --cpu->sp, HIGH_BYTE(next_pc));
+		cpu_set_memory(cpu, --cpu->sp, LOW_BYTE(next_pc));
+		cpu->pc = ((uint16_t)hi << 8) | lo;
+		cpu->next_instruction += d->cycles_taken;
+	}
+	else
+	{
+		cpu->next_instruction += d->cycles;
+		cpu->pc += d->length;
+	}
+}
+
+static OPC_INLINE void opc_jr(sm83_t *cpu, const opc_desc_t *d)
+{
+	if (opc_cond(cpu, d))
+	{
+		int8_t offset = (int8_t) cpu_fetch(cpu, cpu->pc + 1);
+		cpu->pc += (offset + 2);
+		cpu->next_instruction += d->cycles_taken;
+#if !(0 < BUILD_TEST_DLL)
+		// short polling loop?
+		if ((0 > offset) && (-IDLE_MAX_LOOP <= offset) && (0 != d->cond_mask) &&
+		    ((0x10000u | cpu->pc) != cpu->idle_reject[cpu->pc % IDLE_CACHE]))
+		{
+			cpu_idle_loop(cpu, cpu->pc - offset - 2);
+		}
+#endif
+	}
+	else
+	{
+		cpu->next_instruction += d->cycles;
+		cpu->pc += d->length;
+	}
+}
+
+static OPC_INLINE void opc_jp(sm83_t *cpu, const opc_desc_t *d)
+{
+	if (opc_cond(cpu, d))
+	{
+		uint8_t hi, lo;
+		lo = cpu_fetch(cpu, cpu->pc + 1);
+		hi = cpu_fetch(cpu, cpu->pc + 2);
+		cpu->pc = ((uint16_t)hi << 8) | lo;
+		cpu->next_instruction += d->cycles_taken;
+	}
+	else
+	{
+		cpu->next_instruction += d->cycles;
+		cpu->pc += d->length;
+	}
+}
+
+static OPC_INLINE void opc_jphl(sm83_t *cpu, const opc_desc_t *d)
+{
+	cpu->pc = cpu->hl.hl;
+	cpu->next_instruction += d->cycles;
+}
+
+static OPC_INLINE void opc_ret(sm83_t *cpu, const opc_desc_t *d)
+{
+	if (opc_cond(cpu, d))
+	{
+		uint8_t lo, hi;
+		lo = cpu_get_memory(cpu, cpu->sp++);
+		hi = cpu_get_memory(cpu, cpu->sp++);
+		cpu->pc = ((uint16_t)hi << 8) | lo;
+		cpu->next_instruction += d->cycles_taken;
+	}
+	else
+	{
+		cpu->next_instruction += d->cycles;
+		cpu->pc += d->length;
+	}
+}
+
+static OPC_INLINE void opc_reti(sm83_t *cpu, const opc_desc_t *d)
+{
+	cpu_isr_handled(cpu);
+	opc_ret(cpu, d);
+}
+
+static OPC_INLINE void opc_rst(sm83_t *cpu, const opc_desc_t *d)
+{
+	cpu_set_memory(cpu, --cpu->sp, (((cpu->pc + 1) & 0xFF00) >> 8));
+	cpu_set_memory(cpu, --cpu->sp, (((cpu->pc + 1) & 0x00FF) >> 0));
+	cpu->pc = d->arg;
+	cpu->next_instruction += d->cycles;
+}
+
+static OPC_INLINE void opc_add(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = opc_get_src8(cpu, d);
+	cpu->af.a = alu_add(cpu, cpu->af.a, operand, 0);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_sub(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = opc_get_src8(cpu, d);
+	cpu->af.a = alu_sub(cpu, cpu->af.a, operand, 0);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_and(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = opc_get_src8(cpu, d);
+	cpu->af.a = alu_and(cpu, cpu->af.a & operand);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_or(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = opc_get_src8(cpu, d);
+	cpu->af.a = alu_or(cpu, cpu->af.a | operand);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_adc(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = opc_get_src8(cpu, d);
+	uint8_t c = cpu_get_carry(cpu);
+	cpu->af.a = alu_add(cpu, cpu->af.a, operand, c);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_sbc(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = opc_get_src8(cpu, d);
+	uint8_t c = cpu_get_carry(cpu);
+	cpu->af.a = alu_sub(cpu, cpu->af.a, operand, c);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_xor(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = opc_get_src8(cpu, d);
+	cpu->af.a = alu_or(cpu, cpu->af.a ^ operand);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_cp(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = opc_get_src8(cpu, d);
+	alu_sub(cpu, cpu->af.a, operand, 0);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_add2(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = cpu_fetch(cpu, cpu->pc + 1);
+	cpu->af.a = alu_add(cpu, cpu->af.a, operand, 0);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_sub2(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = cpu_fetch(cpu, cpu->pc + 1);
+	cpu->af.a = alu_sub(cpu, cpu->af.a, operand, 0);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_and2(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = cpu_fetch(cpu, cpu->pc + 1);
+	cpu->af.a = alu_and(cpu, cpu->af.a & operand);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_or2(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = cpu_fetch(cpu, cpu->pc + 1);
+	cpu->af.a = alu_or(cpu, cpu->af.a | operand);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_adc2(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = cpu_fetch(cpu, cpu->pc + 1);
+	uint8_t c = cpu_get_carry(cpu);
+	cpu->af.a = alu_add(cpu, cpu->af.a, operand, c);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_sbc2(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = cpu_fetch(cpu, cpu->pc + 1);
+	uint8_t c = cpu_get_carry(cpu);
+	cpu->af.a = alu_sub(cpu, cpu->af.a, operand, c);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_xor2(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = cpu_fetch(cpu, cpu->pc + 1);
+	cpu->af.a = alu_or(cpu, cpu->af.a ^ operand);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_cp2(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = cpu_fetch(cpu, cpu->pc + 1);
+	alu_sub(cpu, cpu->af.a, operand, 0);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ld(sm83_t *cpu, const opc_desc_t *d)
+{
+	REG8(d->dst) = opc_get_src8(cpu, d);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ld2(sm83_t *cpu, const opc_desc_t *d)
+{
+	cpu_set_memory(cpu, cpu->hl.hl, REG8(d->src));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ldd8(sm83_t *cpu, const opc_desc_t *d)
+{
+	REG8(d->dst) = cpu_fetch(cpu, cpu->pc + 1);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ldd82(sm83_t *cpu, const opc_desc_t *d)
+{
+	cpu_set_memory(cpu, cpu->hl.hl, cpu_fetch(cpu, cpu->pc + 1));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_lda2r(sm83_t *cpu, const opc_desc_t *d)
+{
+	// (BC), (DE), (HL+), (HL-): d->arg holds the post-increment of the pointer
+	uint16_t addr = REG16(d->dst);
+	REG16(d->dst) = addr + (int8_t) d->arg;
+	cpu_set_memory(cpu, addr, cpu->af.a);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ldr2a(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint16_t addr = REG16(d->src);
+	REG16(d->src) = addr + (int8_t) d->arg;
+	cpu->af.a = cpu_get_memory(cpu, addr);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ldd16(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t hi, lo;
+	lo = cpu_fetch(cpu, cpu->pc + 1);
+	hi = cpu_fetch(cpu, cpu->pc + 2);
+	REG16(d->dst) = ((uint16_t)(hi << 8)) | lo;
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ld16s(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t hi, lo;
+	uint16_t addr;
+	lo = cpu_fetch(cpu, cpu->pc + 1);
+	hi = cpu_fetch(cpu, cpu->pc + 2);
+	addr = ((uint16_t)(hi << 8)) | lo;
+	cpu_set_memory(cpu, addr + 0, LOW_BYTE(cpu->sp));
+	cpu_set_memory(cpu, addr + 1, HIGH_BYTE(cpu->sp));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ldha8(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t a8 = cpu_fetch(cpu, cpu->pc + 1);
+	cpu_set_memory(cpu, 0xff00 + a8, cpu->af.a);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ldha(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t a8 = cpu_fetch(cpu, cpu->pc + 1);
+	cpu->af.a = cpu_get_memory(cpu, 0xff00 + a8);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ldca(sm83_t *cpu, const opc_desc_t *d)
+{
+	cpu_set_memory(cpu, 0xff00 + cpu->bc.c, cpu->af.a);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ldac(sm83_t *cpu, const opc_desc_t *d)
+{
+	cpu->af.a = cpu_get_memory(cpu, 0xff00 + cpu->bc.c);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_push(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	uint16_t src = REG16(d->src);
+	cpu_set_memory(cpu, --cpu->sp, HIGH_BYTE(src));
+	cpu_set_memory(cpu, --cpu->sp, LOW_BYTE(src));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_pop(sm83_t *cpu, const opc_desc_t *d)
+{
+	// d->arg masks the unused lower nibble of F for POP AF, which also
+	// replaces any pending lazy flags
+	uint8_t hi, lo;
+	FLAGS_SYNC();
+	lo = cpu_get_memory(cpu, cpu->sp++) & d->arg;
+	hi = cpu_get_memory(cpu, cpu->sp++);
+	REG16(d->dst) = ((uint16_t)(hi << 8)) | lo;
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_inc(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	uint8_t *val = &REG8(d->dst);
+	eval_H_flag(cpu, *val, 1, false);
+	set_N_flag(cpu, false);
+	(*val)++;
+	eval_Z_flag(cpu, *val);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_inc3(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	uint8_t val = cpu_get_memory(cpu, cpu->hl.hl);
+	eval_H_flag(cpu, val, 1, false);
+	set_N_flag(cpu, false);
+	cpu_set_memory(cpu, cpu->hl.hl, val + 1);
+	eval_Z_flag(cpu, val + 1);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_inc16(sm83_t *cpu, const opc_desc_t *d)
+{
+	REG16(d->dst)++;
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_dec(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	uint8_t *val = &REG8(d->dst);
+	eval_H_flag(cpu, *val, 1, true);
+	set_N_flag(cpu, true);
+	(*val)--;
+	eval_Z_flag(cpu, *val);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_dec3(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	uint8_t val = cpu_get_memory(cpu, cpu->hl.hl);
+	eval_H_flag(cpu, val, 1, true);
+	set_N_flag(cpu, true);
+	cpu_set_memory(cpu, cpu->hl.hl, val - 1);
+	eval_Z_flag(cpu, val - 1);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_dec16(sm83_t *cpu, const opc_desc_t *d)
+{
+	REG16(d->dst)--;
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_add16(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	uint16_t operand = REG16(d->src);
+	set_N_flag(cpu, false);
+	eval_H_flag_16(cpu, cpu->hl.hl, operand);
+	eval_C_flag_16(cpu, cpu->hl.hl, operand);
+	cpu->hl.hl += operand;
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_addsp(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	int8_t r8 = cpu_fetch(cpu, cpu->pc + 1);
+	set_Z_flag(cpu, false);
+	set_N_flag(cpu, false);
+	eval_H_flag(cpu, cpu->sp, r8, false);
+	eval_C_flag(cpu, cpu->sp, r8, false);
+	cpu->sp += r8;
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ldhls(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	int8_t r8 = cpu_fetch(cpu, cpu->pc + 1);
+	set_Z_flag(cpu, false);
+	set_N_flag(cpu, false);
+	eval_H_flag(cpu, cpu->sp, r8, false);
+	eval_C_flag(cpu, cpu->sp, r8, false);
+	cpu->hl.hl = cpu->sp + r8;
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ldshl(sm83_t *cpu, const opc_desc_t *d)
+{
+	cpu->sp = cpu->hl.hl;
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_ld16a(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t hi, lo;
+	uint16_t a16;
+	lo = cpu_fetch(cpu, cpu->pc + 1);
+	hi = cpu_fetch(cpu, cpu->pc + 2);
+	a16 = ((uint16_t)(hi << 8)) | lo;
+	cpu_set_memory(cpu, a16, cpu->af.a);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_lda16(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t hi, lo;
+	uint16_t a16;
+	lo = cpu_fetch(cpu, cpu->pc + 1);
+	hi = cpu_fetch(cpu, cpu->pc + 2);
+	a16 = ((uint16_t)(hi << 8)) | lo;
+	cpu->af.a = cpu_get_memory(cpu, a16);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+/* CB-prefixed instructions. d->dst is the target register, d->arg the bit
+ * mask for BIT/RES/SET. */
+static OPC_INLINE void opc_rlc(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	REG8(d->dst) = alu_shift(cpu, SHIFT_RLC, REG8(d->dst));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_rrc(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	REG8(d->dst) = alu_shift(cpu, SHIFT_RRC, REG8(d->dst));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_rl(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	REG8(d->dst) = alu_shift(cpu, SHIFT_RL, REG8(d->dst));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_rr(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	REG8(d->dst) = alu_shift(cpu, SHIFT_RR, REG8(d->dst));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_sla(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	REG8(d->dst) = alu_shift(cpu, SHIFT_SLA, REG8(d->dst));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_sra(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	REG8(d->dst) = alu_shift(cpu, SHIFT_SRA, REG8(d->dst));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_swap(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	REG8(d->dst) = alu_shift(cpu, SHIFT_SWAP, REG8(d->dst));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_srl(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	REG8(d->dst) = alu_shift(cpu, SHIFT_SRL, REG8(d->dst));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_bit(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	eval_Z_flag(cpu, (REG8(d->dst) & d->arg));
+	set_N_flag(cpu, false);
+	set_H_flag(cpu, true);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_res(sm83_t *cpu, const opc_desc_t *d)
+{
+	REG8(d->dst) &= ~d->arg;
+	// no flags affected
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_set(sm83_t *cpu, const opc_desc_t *d)
+{
+	REG8(d->dst) |= d->arg;
+	// no flags affected
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_rlc2(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	cpu_set_memory(cpu, cpu->hl.hl, alu_shift(cpu, SHIFT_RLC, cpu_get_memory(cpu, cpu->hl.hl)));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_rrc2(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	cpu_set_memory(cpu, cpu->hl.hl, alu_shift(cpu, SHIFT_RRC, cpu_get_memory(cpu, cpu->hl.hl)));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_rl2(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	cpu_set_memory(cpu, cpu->hl.hl, alu_shift(cpu, SHIFT_RL, cpu_get_memory(cpu, cpu->hl.hl)));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_rr2(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	cpu_set_memory(cpu, cpu->hl.hl, alu_shift(cpu, SHIFT_RR, cpu_get_memory(cpu, cpu->hl.hl)));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_sla2(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	cpu_set_memory(cpu, cpu->hl.hl, alu_shift(cpu, SHIFT_SLA, cpu_get_memory(cpu, cpu->hl.hl)));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_sra2(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	cpu_set_memory(cpu, cpu->hl.hl, alu_shift(cpu, SHIFT_SRA, cpu_get_memory(cpu, cpu->hl.hl)));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_swap2(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	cpu_set_memory(cpu, cpu->hl.hl, alu_shift(cpu, SHIFT_SWAP, cpu_get_memory(cpu, cpu->hl.hl)));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_srl2(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	cpu_set_memory(cpu, cpu->hl.hl, alu_shift(cpu, SHIFT_SRL, cpu_get_memory(cpu, cpu->hl.hl)));
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_bit2(sm83_t *cpu, const opc_desc_t *d)
+{
+	FLAGS_SYNC();
+	uint8_t operand = cpu_get_memory(cpu, cpu->hl.hl);
+	eval_Z_flag(cpu, (operand & d->arg));
+	set_N_flag(cpu, false);
+	set_H_flag(cpu, true);
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_res2(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = cpu_get_memory(cpu, cpu->hl.hl);
+	cpu_set_memory(cpu, cpu->hl.hl, (operand & ~d->arg));
+	// no flags affected
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static OPC_INLINE void opc_set2(sm83_t *cpu, const opc_desc_t *d)
+{
+	uint8_t operand = cpu_get_memory(cpu, cpu->hl.hl);
+	cpu_set_memory(cpu, cpu->hl.hl, (operand | d->arg));
+	// no flags affected
+	cpu->next_instruction += d->cycles;
+	cpu->pc += d->length;
+}
+
+static const opc_handler_t opc_handlers[] =
+{
+	[OPC_NONE]  = opc_none,  [OPC_NOP]   = opc_nop,   [OPC_STOP]  = opc_stop,
+	[OPC_HALT]  = opc_halt,  [OPC_EI]    = opc_ei,    [OPC_DI]    = opc_di,
+	[OPC_DAA]   = opc_daa,   [OPC_CPL]   = opc_cpl,   [OPC_SCF]   = opc_scf,
+	[OPC_CCF]   = opc_ccf,   [OPC_RLCA]  = opc_rlca,  [OPC_RLA]   = opc_rla,
+	[OPC_RRCA]  = opc_rrca,  [OPC_RRA]   = opc_rra,   [OPC_CB]    = opc_cb,
+	[OPC_CALL]  = opc_call,  [OPC_CAL2]  = opc_call,  [OPC_JRc]   = opc_jr,
+	[OPC_JR]    = opc_jr,    [OPC_JPc]   = opc_jp,    [OPC_JP]    = opc_jp,
+	[OPC_JPHL]  = opc_jphl,  [OPC_RETc]  = opc_ret,   [OPC_RET]   = opc_ret,
+	[OPC_RETI]  = opc_reti,  [OPC_RST]   = opc_rst,   [OPC_ADD]   = opc_add,
+	[OPC_SUB]   = opc_sub,   [OPC_AND]   = opc_and,   [OPC_OR]    = opc_or,
+	[OPC_ADD2]  = opc_add2,  [OPC_SUB2]  = opc_sub2,  [OPC_AND2]  = opc_and2,
+	[OPC_OR2]   = opc_or2,   [OPC_ADC]   = opc_adc,   [OPC_SBC]   = opc_sbc,
+	[OPC_XOR]   = opc_xor,   [OPC_CP]    = opc_cp,    [OPC_ADC2]  = opc_adc2,
+	[OPC_SBC2]  = opc_sbc2,  [OPC_XOR2]  = opc_xor2,  [OPC_CP2]   = opc_cp2,
+	[OPC_LD]    = opc_ld,    [OPC_LD2]   = opc_ld2,   [OPC_LDd8]  = opc_ldd8,
+	[OPC_LDd82] = opc_ldd82, [OPC_LDa2r] = opc_lda2r, [OPC_LDr2a] = opc_ldr2a,
+	[OPC_LDd16] = opc_ldd16, [OPC_LD16s] = opc_ld16s, [OPC_LDHa8] = opc_ldha8,
+	[OPC_LDHA]  = opc_ldha,  [OPC_LDCA]  = opc_ldca,  [OPC_LDAC]  = opc_ldac,
+	[OPC_LDHLS] = opc_ldhls, [OPC_LDSHL] = opc_ldshl, [OPC_LD16A] = opc_ld16a,
+	[OPC_LDA16] = opc_lda16, [OPC_INC1]  = opc_inc,   [OPC_INC2]  = opc_inc,
+	[OPC_INC3]  = opc_inc3,  [OPC_INC16] = opc_inc16, [OPC_DEC1]  = opc_dec,
+	[OPC_DEC2]  = opc_dec,   [OPC_DEC3]  = opc_dec3,  [OPC_DEC16] = opc_dec16,
+	[OPC_ADD16] = opc_add16, [OPC_ADDSP] = opc_addsp, [OPC_POP]   = opc_pop,
+	[OPC_PUSH]  = opc_push,
+};
+
+static const opc_handler_t opc_handlers2[] =
+{
+	[OPC_RLC]   = opc_rlc,   [OPC_RRC]   = opc_rrc,   [OPC_RL]    = opc_rl,
+	[OPC_RR]    = opc_rr,    [OPC_SLA]   = opc_sla,   [OPC_SRA]   = opc_sra,
+	[OPC_SWAP]  = opc_swap,  [OPC_SRL]   = opc_srl,   [OPC_BIT]   = opc_bit,
+	[OPC_RES]   = opc_res,   [OPC_SET]   = opc_set,   [OPC_RLC2]  = opc_rlc2,
+	[OPC_RRC2]  = opc_rrc2,  [OPC_RL2]   = opc_rl2,   [OPC_RR2]   = opc_rr2,
+	[OPC_SLA2]  = opc_sla2,  [OPC_SRA2]  = opc_sra2,  [OPC_SWAP2] = opc_swap2,
+	[OPC_SRL2]  = opc_srl2,  [OPC_BIT2]  = opc_bit2,  [OPC_RES2]  = opc_res2,
+	[OPC_SET2]  = opc_set2,
+};
+
+/* Decode every opcode once, so cpu_handle_opcode() only needs a single
+ * table lookup and an indirect call per instruction. */
+static void cpu_build_decode_table(void)
+{
+	// register operands as encoded in the opcode bits
+	static const uint8_t r8_lut[8] = {
+		REG_OFFSET(bc.b), REG_OFFSET(bc.c), REG_OFFSET(de.d), REG_OFFSET(de.e),
+		REG_OFFSET(hl.h), REG_OFFSET(hl.l), REG_HLI         , REG_OFFSET(af.a),
+	};
+	static const uint8_t r16_lut[4] = {
+		REG_OFFSET(bc.bc), REG_OFFSET(de.de), REG_OFFSET(hl.hl), REG_OFFSET(sp),
+	};
+	static const uint8_t r16_stk_lut[4] = {
+		REG_OFFSET(bc.bc), REG_OFFSET(de.de), REG_OFFSET(hl.hl), REG_OFFSET(af.af),
+	};
+	// (BC), (DE), (HL+), (HL-)
+	static const uint8_t r16_mem_lut[4] = {
+		REG_OFFSET(bc.bc), REG_OFFSET(de.de), REG_OFFSET(hl.hl), REG_OFFSET(hl.hl),
+	};
+	static const int8_t r16_mem_inc_lut[4] = { 0, 0, 1, -1 };
+	// NZ, Z, NC, C
+	static const uint8_t cond_mask_lut[4] = { FLAG_Z, FLAG_Z, FLAG_C, FLAG_C };
+	static const uint8_t cond_val_lut[4]  = { 0     , FLAG_Z, 0     , FLAG_C };
+
+	for (int opcode = 0; opcode < 0x100; opcode++)
+	{
+		opc_desc_t *d = &opc_decode[opcode];
+		opcode_t opcode_type = opcode_types[opcode];
+		uint8_t r0 = (opcode & 0x38) >> 3;
+		uint8_t r1 = (opcode & 0x07) >> 0;
+		uint8_t rr = (opcode & 0x30) >> 4;
+		uint8_t cc = (opcode & 0x18) >> 3;
+
+		memset(d, 0, sizeof(*d));
+		d->handler = opc_handlers[opcode_type];
+		d->opcode = opcode;
+		d->length = 1;
+		d->cycles = 4;
+		d->dst = REG_NONE;
+		d->src = REG_NONE;
+
+		switch (opcode_type)
+		{
+		case OPC_NONE:
+			d->length = 0;
+			d->cycles = 0;
+			break;
+
+		case OPC_STOP:
+		case OPC_ADD2: case OPC_SUB2: case OPC_AND2: case OPC_OR2:
+		case OPC_ADC2: case OPC_SBC2: case OPC_XOR2: case OPC_CP2:
+			d->length = 2;
+			d->cycles = (OPC_STOP == opcode_type) ? 4 : 8;
+			break;
+
+		case OPC_CB:
+			d->length = 2;
+			d->cycles = 8;
+			break;
+
+		case OPC_CALL:
+		case OPC_JPc:
+			d->cond_mask = cond_mask_lut[cc];
+			d->cond_val = cond_val_lut[cc];
+			/* fall through */
+		case OPC_CAL2:
+		case OPC_JP:
+			d->length = 3;
+			d->cycles = 12;
+			d->cycles_taken = ((OPC_CALL == opcode_type) || (OPC_CAL2 == opcode_type)) ? 24 : 16;
+			break;
+
+		case OPC_JRc:
+			d->cond_mask = cond_mask_lut[cc];
+			d->cond_val = cond_val_lut[cc];
+			/* fall through */
+		case OPC_JR:
+			d->length = 2;
+			d->cycles = 8;
+			d->cycles_taken = 12;
+			break;
+
+		case OPC_RETc:
+			d->cond_mask = cond_mask_lut[cc];
+			d->cond_val = cond_val_lut[cc];
+			d->cycles = 8;
+			d->cycles_taken = 20;
+			break;
+
+		case OPC_RET:
+		case OPC_RETI:
+			d->cycles = 16;
+			d->cycles_taken = 16;
+			break;
+
+		case OPC_RST:
+			d->arg = opcode & 0x38;
+			d->cycles = 16;
+			break;
+
+		case OPC_ADD: case OPC_SUB: case OPC_AND: case OPC_OR:
+		case OPC_ADC: case OPC_SBC: case OPC_XOR: case OPC_CP:
+			d->src = r8_lut[r1];
+			d->cycles = (REG_HLI == d->src) ? 8 : 4;
+			break;
+
+		case OPC_LD:
+			d->dst = r8_lut[r0];
+			d->src = r8_lut[r1];
+			d->cycles = (REG_HLI == d->src) ? 8 : 4;
+			break;
+
+		case OPC_LD2:
+			d->src = r8_lut[r1];
+			d->cycles = 8;
+			break;
+
+		case OPC_LDd8:
+			d->dst = r8_lut[r0];
+			/* fall through */
+		case OPC_LDd82:
+			d->length = 2;
+			d->cycles = 8;
+			break;
+
+		case OPC_LDa2r:
+			d->dst = r16_mem_lut[rr];
+			d->arg = (uint8_t) r16_mem_inc_lut[rr];
+			d->cycles = 8;
+			break;
+
+		case OPC_LDr2a:
+			d->src = r16_mem_lut[rr];
+			d->arg = (uint8_t) r16_mem_inc_lut[rr];
+			d->cycles = 8;
+			break;
+
+		case OPC_LDd16:
+			d->dst = r16_lut[rr];
+			d->length = 3;
+			d->cycles = 12;
+			break;
+
+		case OPC_LD16s:
+			d->length = 3;
+			d->cycles = 20;
+			break;
+
+		case OPC_LDHa8:
+		case OPC_LDHA:
+			d->length = 2;
+			d->cycles = 12;
+			break;
+
+		case OPC_LDCA:
+		case OPC_LDAC:
+		case OPC_LDSHL:
+			d->cycles = 8;
+			break;
+
+		case OPC_LD16A:
+		case OPC_LDA16:
+			d->length = 3;
+			d->cycles = 16;
+			break;
+
+		case OPC_PUSH:
+			d->src = r16_stk_lut[rr];
+			d->cycles = 16;
+			break;
+
+		case OPC_POP:
+			d->dst = r16_stk_lut[rr];
+			d->arg = (3 == rr) ? 0xf0 : 0xff;
+			d->cycles = 12;
+			break;
+
+		case OPC_INC1: case OPC_INC2:
+		case OPC_DEC1: case OPC_DEC2:
+			d->dst = r8_lut[r0];
+			break;
+
+		case OPC_INC3:
+		case OPC_DEC3:
+			d->cycles = 12;
+			break;
+
+		case OPC_INC16:
+		case OPC_DEC16:
+			d->dst = r16_lut[rr];
+			d->cycles = 8;
+			break;
+
+		case OPC_ADD16:
+			d->src = r16_lut[rr];
+			d->cycles = 8;
+			break;
+
+		case OPC_ADDSP:
+			d->length = 2;
+			d->cycles = 16;
+			break;
+
+		case OPC_LDHLS:
+			d->length = 2;
+			d->cycles = 12;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	for (int opcode2 = 0; opcode2 < 0x100; opcode2++)
+	{
+		opc_desc_t *d = &opc_decode[0x100 + opcode2];
+		uint8_t i = opcode2 & 0x07;
+
+		memset(d, 0, sizeof(*d));
+		d->handler = opc_handlers2[opcode_types2[opcode2]];
+		d->opcode = opcode2;
+		d->length = 2;
+		d->cycles = (i == 6) ? 16 : 8;
+		d->dst = r8_lut[i];
+		d->src = REG_NONE;
+		d->arg = 1 << ((opcode2 & 0x38) >> 3);
+	}
+}
+
+void cpu_handle_opcode(sm83_t *cpu)
+{
+	const opc_desc_t *d = &opc_decode[cpu_fetch(cpu, cpu->pc)];
+	d->handler(cpu, d);
+}
+
+void cpu_print_state(sm83_t *cpu)
+{
+	FLAGS_SYNC();
+	bool zf,nf,hf,cf;
+	zf = (0 != (cpu->af.f & FLAG_Z));
+	nf = (0 != (cpu->af.f & FLAG_N));
+	hf = (0 != (cpu->af.f & FLAG_H));
+	cf = (0 != (cpu->af.f & FLAG_C));
+	uint8_t a,b,c,d,e,h,l;
+	a = cpu->af.a;
+	b = cpu->bc.b;
+	c = cpu->bc.c;
+	d = cpu->de.d;
+	e = cpu->de.e;
+	h = cpu->hl.h;
+	l = cpu->hl.l;
+	printf("\n");
+	printf("PC: %04x (Next Opcode = %02x), SP: %04x\n", cpu->pc, cpu_get_memory(cpu, cpu->pc), cpu->sp);
+	printf("Z: %d, N: %d, H: %d, C: %d\n", zf, nf, hf, cf);
+	printf("A: %02x, B: %02x, C: %02x, D: %02x, E: %02x, H: %02x, L: %02x\n", a, b, c, d, e, h, l);
+	printf("BC: %04x, DE: %04x, HL: %04x\n", cpu->bc.bc, cpu->de.de, cpu->hl.hl);
+}
+
+#if (0 < USE_THREADED_DISPATCH) || (0 < USE_DYNAREC)
+void cpu_run(sm83_t *cpu, uint64_t instructions);
+#endif
+
+void cpu_tick(sm83_t *cpu)
+{
+#if (0 < USE_THREADED_DISPATCH) || (0 < USE_DYNAREC)
+	cpu_run(cpu, 1);
+#else
+	cpu_handle_opcode(cpu);
+	cpu->cycle_cnt++;
+	cpu_sched_check(cpu);
+#endif
+
+	return;
+}
+
+#if (0 < USE_THREADED_DISPATCH)
+/* Threaded interpreter: each handler label fetches and dispatches the next
+ * opcode itself instead of returning to cpu_tick(), so every handler has its
+ * own indirect jump (and branch predictor entry). */
+#define THREADED_OP(_type, _handler) \
+	L_##_type: _handler(cpu, d); DISPATCH();
+
+#define DISPATCH() \
+	do \
+	{ \
+		cpu->cycle_cnt++; \
+		if (__builtin_expect(cpu->sched.next <= cpu->next_instruction, 0)) \
+		{ \
+			goto L_SCHED; \
+		} \
+		if (0 == --instructions) \
+		{ \
+			return; \
+		} \
+		opcode = cpu_fetch(cpu, cpu->pc); \
+		d = &opc_decode[opcode]; \
+		goto *dispatch[opcode]; \
+	} while (0)
+
+void cpu_run(sm83_t *cpu, uint64_t instructions)
+{
+	static void * const labels[] =
+	{
+		[OPC_NONE]  = &&L_OPC_NONE,  [OPC_NOP]   = &&L_OPC_NOP,   [OPC_STOP]  = &&L_OPC_STOP,
+		[OPC_HALT]  = &&L_OPC_HALT,  [OPC_EI]    = &&L_OPC_EI,    [OPC_DI]    = &&L_OPC_DI,
+		[OPC_DAA]   = &&L_OPC_DAA,   [OPC_CPL]   = &&L_OPC_CPL,   [OPC_SCF]   = &&L_OPC_SCF,
+		[OPC_CCF]   = &&L_OPC_CCF,   [OPC_RLCA]  = &&L_OPC_RLCA,  [OPC_RLA]   = &&L_OPC_RLA,
+		[OPC_RRCA]  = &&L_OPC_RRCA,  [OPC_RRA]   = &&L_OPC_RRA,   [OPC_CB]    = &&L_OPC_CB,
+		[OPC_CALL]  = &&L_OPC_CALL,  [OPC_CAL2]  = &&L_OPC_CAL2,  [OPC_JRc]   = &&L_OPC_JRc,
+		[OPC_JR]    = &&L_OPC_JR,    [OPC_JPc]   = &&L_OPC_JPc,   [OPC_JP]    = &&L_OPC_JP,
+		[OPC_JPHL]  = &&L_OPC_JPHL,  [OPC_RETc]  = &&L_OPC_RETc,  [OPC_RET]   = &&L_OPC_RET,
+		[OPC_RETI]  = &&L_OPC_RETI,  [OPC_RST]   = &&L_OPC_RST,   [OPC_ADD]   = &&L_OPC_ADD,
+		[OPC_SUB]   = &&L_OPC_SUB,   [OPC_AND]   = &&L_OPC_AND,   [OPC_OR]    = &&L_OPC_OR,
+		[OPC_ADD2]  = &&L_OPC_ADD2,  [OPC_SUB2]  = &&L_OPC_SUB2,  [OPC_AND2]  = &&L_OPC_AND2,
+		[OPC_OR2]   = &&L_OPC_OR2,   [OPC_ADC]   = &&L_OPC_ADC,   [OPC_SBC]   = &&L_OPC_SBC,
+		[OPC_XOR]   = &&L_OPC_XOR,   [OPC_CP]    = &&L_OPC_CP,    [OPC_ADC2]  = &&L_OPC_ADC2,
+		[OPC_SBC2]  = &&L_OPC_SBC2,  [OPC_XOR2]  = &&L_OPC_XOR2,  [OPC_CP2]   = &&L_OPC_CP2,
+		[OPC_LD]    = &&L_OPC_LD,    [OPC_LD2]   = &&L_OPC_LD2,   [OPC_LDd8]  = &&L_OPC_LDd8,
+		[OPC_LDd82] = &&L_OPC_LDd82, [OPC_LDa2r] = &&L_OPC_LDa2r, [OPC_LDr2a] = &&L_OPC_LDr2a,
+		[OPC_LDd16] = &&L_OPC_LDd16, [OPC_LD16s] = &&L_OPC_LD16s, [OPC_LDHa8] = &&L_OPC_LDHa8,
+		[OPC_LDHA]  = &&L_OPC_LDHA,  [OPC_LDCA]  = &&L_OPC_LDCA,  [OPC_LDAC]  = &&L_OPC_LDAC,
+		[OPC_LDHLS] = &&L_OPC_LDHLS, [OPC_LDSHL] = &&L_OPC_LDSHL, [OPC_LD16A] = &&L_OPC_LD16A,
+		[OPC_LDA16] = &&L_OPC_LDA16, [OPC_INC1]  = &&L_OPC_INC1,  [OPC_INC2]  = &&L_OPC_INC2,
+		[OPC_INC3]  = &&L_OPC_INC3,  [OPC_INC16] = &&L_OPC_INC16, [OPC_DEC1]  = &&L_OPC_DEC1,
+		[OPC_DEC2]  = &&L_OPC_DEC2,  [OPC_DEC3]  = &&L_OPC_DEC3,  [OPC_DEC16] = &&L_OPC_DEC16,
+		[OPC_ADD16] = &&L_OPC_ADD16, [OPC_ADDSP] = &&L_OPC_ADDSP, [OPC_POP]   = &&L_OPC_POP,
+		[OPC_PUSH]  = &&L_OPC_PUSH,
+	};
+	static void * const labels2[] =
+	{
+		[OPC_RLC]   = &&L_OPC_RLC,   [OPC_RRC]   = &&L_OPC_RRC,   [OPC_RL]    = &&L_OPC_RL,
+		[OPC_RR]    = &&L_OPC_RR,    [OPC_SLA]   = &&L_OPC_SLA,   [OPC_SRA]   = &&L_OPC_SRA,
+		[OPC_SWAP]  = &&L_OPC_SWAP,  [OPC_SRL]   = &&L_OPC_SRL,   [OPC_BIT]   = &&L_OPC_BIT,
+		[OPC_RES]   = &&L_OPC_RES,   [OPC_SET]   = &&L_OPC_SET,   [OPC_RLC2]  = &&L_OPC_RLC2,
+		[OPC_RRC2]  = &&L_OPC_RRC2,  [OPC_RL2]   = &&L_OPC_RL2,   [OPC_RR2]   = &&L_OPC_RR2,
+		[OPC_SLA2]  = &&L_OPC_SLA2,  [OPC_SRA2]  = &&L_OPC_SRA2,  [OPC_SWAP2] = &&L_OPC_SWAP2,
+		[OPC_SRL2]  = &&L_OPC_SRL2,  [OPC_BIT2]  = &&L_OPC_BIT2,  [OPC_RES2]  = &&L_OPC_RES2,
+		[OPC_SET2]  = &&L_OPC_SET2,
+	};
+	// 0x000 - 0x0FF: opcodes, 0x100 - 0x1FF: CB-prefixed opcodes
+	static void *dispatch[0x200];
+	const opc_desc_t *d;
+	uint16_t opcode;
+
+	if (NULL == dispatch[0])
+	{
+		for (opcode = 0; opcode < 0x100; opcode++)
+		{
+			dispatch[opcode] = labels[opcode_types[opcode]];
+			dispatch[0x100 + opcode] = labels2[opcode_types2[opcode]];
+		}
+	}
+
+	if (0 == instructions)
+	{
+		return;
+	}
+
+	opcode = cpu_fetch(cpu, cpu->pc);
+	d = &opc_decode[opcode];
+	goto *dispatch[opcode];
+
+	// shared by all handlers, which keeps the rare event path out of them
+	L_SCHED:
+	cpu_sched_run(cpu);
+	if (0 == --instructions)
+	{
+		return;
+	}
+	opcode = cpu_fetch(cpu, cpu->pc);
+	d = &opc_decode[opcode];
+	goto *dispatch[opcode];
+
+	L_OPC_CB:
+	opcode = 0x100 + cpu_fetch(cpu, cpu->pc + 1);
+	d = &opc_decode[opcode];
+	goto *dispatch[opcode];
+
+	L_OPC_STOP:
+	opc_stop(cpu, d);
+	if (cpu->stopped)
+	{
+		cpu->cycle_cnt++;
+		return;
+	}
+	DISPATCH();
+
+	L_OPC_HALT:
+	opc_halt(cpu, d);
+	if (cpu->stopped)
+	{
+		cpu->cycle_cnt++;
+		return;
+	}
+	DISPATCH();
+
+	THREADED_OP(OPC_NONE,  opc_none)
+	THREADED_OP(OPC_NOP,   opc_nop)
+	THREADED_OP(OPC_EI,    opc_ei)
+	THREADED_OP(OPC_DI,    opc_di)
+	THREADED_OP(OPC_DAA,   opc_daa)
+	THREADED_OP(OPC_CPL,   opc_cpl)
+	THREADED_OP(OPC_SCF,   opc_scf)
+	THREADED_OP(OPC_CCF,   opc_ccf)
+	THREADED_OP(OPC_RLCA,  opc_rlca)
+	THREADED_OP(OPC_RLA,   opc_rla)
+	THREADED_OP(OPC_RRCA,  opc_rrca)
+	THREADED_OP(OPC_RRA,   opc_rra)
+	THREADED_OP(OPC_CALL,  opc_call)
+	THREADED_OP(OPC_CAL2,  opc_call)
+	THREADED_OP(OPC_JRc,   opc_jr)
+	THREADED_OP(OPC_JR,    opc_jr)
+	THREADED_OP(OPC_JPc,   opc_jp)
+	THREADED_OP(OPC_JP,    opc_jp)
+	THREADED_OP(OPC_JPHL,  opc_jphl)
+	THREADED_OP(OPC_RETc,  opc_ret)
+	THREADED_OP(OPC_RET,   opc_ret)
+	THREADED_OP(OPC_RETI,  opc_reti)
+	THREADED_OP(OPC_RST,   opc_rst)
+	THREADED_OP(OPC_ADD,   opc_add)
+	THREADED_OP(OPC_SUB,   opc_sub)
+	THREADED_OP(OPC_AND,   opc_and)
+	THREADED_OP(OPC_OR,    opc_or)
+	THREADED_OP(OPC_ADD2,  opc_add2)
+	THREADED_OP(OPC_SUB2,  opc_sub2)
+	THREADED_OP(OPC_AND2,  opc_and2)
+	THREADED_OP(OPC_OR2,   opc_or2)
+	THREADED_OP(OPC_ADC,   opc_adc)
+	THREADED_OP(OPC_SBC,   opc_sbc)
+	THREADED_OP(OPC_XOR,   opc_xor)
+	THREADED_OP(OPC_CP,    opc_cp)
+	THREADED_OP(OPC_ADC2,  opc_adc2)
+	THREADED_OP(OPC_SBC2,  opc_sbc2)
+	THREADED_OP(OPC_XOR2,  opc_xor2)
+	THREADED_OP(OPC_CP2,   opc_cp2)
+	THREADED_OP(OPC_LD,    opc_ld)
+	THREADED_OP(OPC_LD2,   opc_ld2)
+	THREADED_OP(OPC_LDd8,  opc_ldd8)
+	THREADED_OP(OPC_LDd82, opc_ldd82)
+	THREADED_OP(OPC_LDa2r, opc_lda2r)
+	THREADED_OP(OPC_LDr2a, opc_ldr2a)
+	THREADED_OP(OPC_LDd16, opc_ldd16)
+	THREADED_OP(OPC_LD16s, opc_ld16s)
+	THREADED_OP(OPC_LDHa8, opc_ldha8)
+	THREADED_OP(OPC_LDHA,  opc_ldha)
+	THREADED_OP(OPC_LDCA,  opc_ldca)
+	THREADED_OP(OPC_LDAC,  opc_ldac)
+	THREADED_OP(OPC_LDHLS, opc_ldhls)
+	THREADED_OP(OPC_LDSHL, opc_ldshl)
+	THREADED_OP(OPC_LD16A, opc_ld16a)
+	THREADED_OP(OPC_LDA16, opc_lda16)
+	THREADED_OP(OPC_INC1,  opc_inc)
+	THREADED_OP(OPC_INC2,  opc_inc)
+	THREADED_OP(OPC_INC3,  opc_inc3)
+	THREADED_OP(OPC_INC16, opc_inc16)
+	THREADED_OP(OPC_DEC1,  opc_dec)
+	THREADED_OP(OPC_DEC2,  opc_dec)
+	THREADED_OP(OPC_DEC3,  opc_dec3)
+	THREADED_OP(OPC_DEC16, opc_dec16)
+	THREADED_OP(OPC_ADD16, opc_add16)
+	THREADED_OP(OPC_ADDSP, opc_addsp)
+	THREADED_OP(OPC_POP,   opc_pop)
+	THREADED_OP(OPC_PUSH,  opc_push)
+
+	THREADED_OP(OPC_RLC,   opc_rlc)
+	THREADED_OP(OPC_RRC,   opc_rrc)
+	THREADED_OP(OPC_RL,    opc_rl)
+	THREADED_OP(OPC_RR,    opc_rr)
+	THREADED_OP(OPC_SLA,   opc_sla)
+	THREADED_OP(OPC_SRA,   opc_sra)
+	THREADED_OP(OPC_SWAP,  opc_swap)
+	THREADED_OP(OPC_SRL,   opc_srl)
+	THREADED_OP(OPC_BIT,   opc_bit)
+	THREADED_OP(OPC_RES,   opc_res)
+	THREADED_OP(OPC_SET,   opc_set)
+	THREADED_OP(OPC_RLC2,  opc_rlc2)
+	THREADED_OP(OPC_RRC2,  opc_rrc2)
+	THREADED_OP(OPC_RL2,   opc_rl2)
+	THREADED_OP(OPC_RR2,   opc_rr2)
+	THREADED_OP(OPC_SLA2,  opc_sla2)
+	THREADED_OP(OPC_SRA2,  opc_sra2)
+	THREADED_OP(OPC_SWAP2, opc_swap2)
+	THREADED_OP(OPC_SRL2,  opc_srl2)
+	THREADED_OP(OPC_BIT2,  opc_bit2)
+	THREADED_OP(OPC_RES2,  opc_res2)
+	THREADED_OP(OPC_SET2,  opc_set2)
+}
+
+#undef DISPATCH
+#undef THREADED_OP
+#elif (0 < USE_DYNAREC)
+/* Dynamic recompiler: hot blocks are translated into x86-64 code. Loads,
+ * 8-bit ALU operations, INC/DEC, ADD HL,rr and JR are emitted inline on the
+ * registers in sm83_t (with USE_LAZY_FLAGS only the ones that leave F alone),
+ * everything else calls the pre-decoded handler of the instruction. A taken
+ * JR leaves the block, a jump back to its own start loops without returning
+ * as long as the budget and the next event allow it. Blocks end at the
+ * first other instruction that changes the control flow. The interpreter
+ * (cpu_handle_opcode()) runs everything that is not translated.
+ *
+ * Registers of the translated code (all callee-saved):
+ *   rbx  cpu
+ *   r12  T-cycles until the next event, from the last time inline code
+ *        synced next_instruction, see dynarec_emit_budget()
+ *   r13  instructions executed by earlier iterations of the block
+ *   r14  instructions the block may execute, its argument
+ * Inline instructions only count their cycles and bytes at translation
+ * time, next_instruction and pc are updated before handler calls and when
+ * the block is left. */
+static void dynarec_emit8(sm83_t *cpu, uint8_t val)
+{
+	cpu->dynarec->code[cpu->dynarec->code_used++] = val;
+}
+
+static void dynarec_emit16(sm83_t *cpu, uint16_t val)
+{
+	memcpy(&cpu->dynarec->code[cpu->dynarec->code_used], &val, sizeof(val));
+	cpu->dynarec->code_used += sizeof(val);
+}
+
+static void dynarec_emit32(sm83_t *cpu, uint32_t val)
+{
+	memcpy(&cpu->dynarec->code[cpu->dynarec->code_used], &val, sizeof(val));
+	cpu->dynarec->code_used += sizeof(val);
+}
+
+static void dynarec_emit64(sm83_t *cpu, uint64_t val)
+{
+	memcpy(&cpu->dynarec->code[cpu->dynarec->code_used], &val, sizeof(val));
+	cpu->dynarec->code_used += sizeof(val);
+}
+
+// ModRM of the operand [rbx + off], a field of sm83_t
+static void dynarec_emit_field(sm83_t *cpu, uint8_t reg, uint32_t off)
+{
+	if (off < 0x80)
+	{
+		dynarec_emit8(cpu, 0x43 | (reg << 3));
+		dynarec_emit8(cpu, off);
+	}
+	else
+	{
+		dynarec_emit8(cpu, 0x83 | (reg << 3));
+		dynarec_emit32(cpu, off);
+	}
+}
+
+// <op> r/m8 with the operand [rbx + off]
+static void dynarec_emit_op8(sm83_t *cpu, uint8_t op, uint8_t reg, uint32_t off)
+{
+	dynarec_emit8(cpu, op);
+	dynarec_emit_field(cpu, reg, off);
+}
+
+// jcc rel32, returns the position of rel32 for dynarec_patch()
+static uint32_t dynarec_emit_jcc(sm83_t *cpu, uint8_t cc)
+{
+	dynarec_emit8(cpu, 0x0F);
+	dynarec_emit8(cpu, 0x80 | cc);
+	dynarec_emit32(cpu, 0);
+	return cpu->dynarec->code_used - 4;
+}
+
+// lets the jump at pos continue at the current position
+static void dynarec_patch(sm83_t *cpu, uint32_t pos)
+{
+	uint32_t rel = cpu->dynarec->code_used - (pos + 4);
+	memcpy(&cpu->dynarec->code[pos], &rel, sizeof(rel));
+}
+
+// mov <first argument register>, rbx; mov <second argument register>, arg1; mov rax, func; call rax
+static void dynarec_emit_call(sm83_t *cpu, void *func, uint64_t arg1)
+{
+	dynarec_emit8(cpu, 0x48);
+	dynarec_emit8(cpu, 0x89);
+	dynarec_emit8(cpu, DYNAREC_ARG0_RBX);
+	dynarec_emit8(cpu, 0x48);
+	dynarec_emit8(cpu, DYNAREC_ARG1_MOV);
+	dynarec_emit64(cpu, arg1);
+	dynarec_emit8(cpu, 0x48);
+	dynarec_emit8(cpu, 0xB8);
+	dynarec_emit64(cpu, (uint64_t) (uintptr_t) func);
+	dynarec_emit8(cpu, 0xFF);
+	dynarec_emit8(cpu, 0xD0);
+}
+
+// adds the cycles and bytes of the inline instructions to next_instruction and pc
+static void dynarec_emit_sync(sm83_t *cpu, uint32_t cycles, uint16_t bytes)
+{
+	if (0 < cycles)
+	{
+		// add qword [rbx + next_instruction], cycles
+		dynarec_emit8(cpu, 0x48);
+		dynarec_emit_op8(cpu, (cycles < 0x80) ? 0x83 : 0x81, 0, offsetof(sm83_t, next_instruction));
+		(cycles < 0x80) ? dynarec_emit8(cpu, cycles) : dynarec_emit32(cpu, cycles);
+	}
+	if (0 < bytes)
+	{
+		// add word [rbx + pc], bytes
+		dynarec_emit8(cpu, 0x66);
+		dynarec_emit_op8(cpu, (bytes < 0x80) ? 0x83 : 0x81, 0, offsetof(sm83_t, pc));
+		(bytes < 0x80) ? dynarec_emit8(cpu, bytes) : dynarec_emit16(cpu, bytes);
+	}
+}
+
+// mov word [rbx + pc], pc
+static void dynarec_emit_set_pc(sm83_t *cpu, uint16_t pc)
+{
+	dynarec_emit8(cpu, 0x66);
+	dynarec_emit_op8(cpu, 0xC7, 0, offsetof(sm83_t, pc));
+	dynarec_emit16(cpu, pc);
+}
+
+// push rbx, r12, r13, r14; sub rsp, DYNAREC_FRAME; mov rbx, cpu; mov r14d, budget; xor r13d, r13d
+static void dynarec_emit_prologue(sm83_t *cpu)
+{
+	static const uint8_t code[] =
+	{
+		0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56,
+		0x48, 0x83, 0xEC, DYNAREC_FRAME,
+		0x41, 0x89, DYNAREC_R14_ARG0,
+		0x45, 0x31, 0xED,
+	};
+
+	for (uint32_t i = 0; i < sizeof(code); i++)
+	{
+		dynarec_emit8(cpu, code[i]);
+	}
+	dynarec_emit8(cpu, 0x48);
+	dynarec_emit8(cpu, 0xBB);
+	dynarec_emit64(cpu, (uint64_t) (uintptr_t) cpu);
+}
+
+// lea eax, [r13 + executed]; add rsp, DYNAREC_FRAME; pop r14, r13, r12, rbx; ret
+static void dynarec_emit_return(sm83_t *cpu, uint32_t executed)
+{
+	static const uint8_t code[] =
+	{
+		0x48, 0x83, 0xC4, DYNAREC_FRAME,
+		0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3,
+	};
+
+	dynarec_emit8(cpu, 0x41);
+	dynarec_emit8(cpu, 0x8D);
+	dynarec_emit8(cpu, 0x45);
+	dynarec_emit8(cpu, executed);
+	for (uint32_t i = 0; i < sizeof(code); i++)
+	{
+		dynarec_emit8(cpu, code[i]);
+	}
+}
+
+// leaves the block after executed instructions when the jump jcc is taken
+static void dynarec_emit_exit(sm83_t *cpu, uint8_t cc, uint32_t cycles, uint16_t bytes, uint32_t executed)
+{
+	uint32_t skip = dynarec_emit_jcc(cpu, cc ^ 1);
+
+	dynarec_emit_sync(cpu, cycles, bytes);
+	dynarec_emit_return(cpu, executed);
+	dynarec_patch(cpu, skip);
+}
+
+/* r12 = sched.next - next_instruction, flags set like cmp, so ja continues
+ * and jbe leaves the block when an event is due */
+static void dynarec_emit_budget(sm83_t *cpu)
+{
+	dynarec_emit8(cpu, 0x4C);
+	dynarec_emit_op8(cpu, 0x8B, 4, offsetof(sm83_t, sched.next));
+	dynarec_emit8(cpu, 0x4C);
+	dynarec_emit_op8(cpu, 0x2B, 4, offsetof(sm83_t, next_instruction));
+}
+
+/* Leaves the block when an event is due after cycles of inline instructions,
+ * so events and interrupts are not delayed to its end: cmp r12, cycles */
+static void dynarec_emit_sched_check(sm83_t *cpu, uint32_t cycles, uint16_t bytes, uint32_t executed)
+{
+	dynarec_emit8(cpu, 0x49);
+	dynarec_emit8(cpu, (cycles < 0x80) ? 0x83 : 0x81);
+	dynarec_emit8(cpu, 0xFC);
+	(cycles < 0x80) ? dynarec_emit8(cpu, cycles) : dynarec_emit32(cpu, cycles);
+	dynarec_emit_exit(cpu, DYNAREC_JBE, cycles, bytes, executed);
+}
+
+#if !(0 < USE_LAZY_FLAGS)
+/* Copies the flags of the x86 operation just executed into F: lahf, then
+ * ZF (and AF) or AF alone as selected by zh_mask moved up by one bit to
+ * Z (and H), CF to C if carry, the bits keep of F kept and set added. */
+static void dynarec_emit_flags(sm83_t *cpu, uint8_t zh_mask, bool carry, uint8_t keep, uint8_t set)
+{
+	// lahf; movzx ecx, ah
+	dynarec_emit8(cpu, 0x9F);
+	dynarec_emit8(cpu, 0x0F);
+	dynarec_emit8(cpu, 0xB6);
+	dynarec_emit8(cpu, 0xCC);
+	if (carry)
+	{
+		// mov edx, ecx; and edx, 1; shl edx, 4
+		dynarec_emit8(cpu, 0x89);
+		dynarec_emit8(cpu, 0xCA);
+		dynarec_emit8(cpu, 0x83);
+		dynarec_emit8(cpu, 0xE2);
+		dynarec_emit8(cpu, 0x01);
+		dynarec_emit8(cpu, 0xC1);
+		dynarec_emit8(cpu, 0xE2);
+		dynarec_emit8(cpu, 0x04);
+	}
+	// and ecx, zh_mask; add ecx, ecx
+	dynarec_emit8(cpu, 0x83);
+	dynarec_emit8(cpu, 0xE1);
+	dynarec_emit8(cpu, zh_mask);
+	dynarec_emit8(cpu, 0x01);
+	dynarec_emit8(cpu, 0xC9);
+	if (carry)
+	{
+		// or ecx, edx
+		dynarec_emit8(cpu, 0x09);
+		dynarec_emit8(cpu, 0xD1);
+	}
+	// mov dl, f; and dl, keep; or dl, cl; or dl, set; mov f, dl
+	dynarec_emit_op8(cpu, 0x8A, 2, REG_OFFSET(af.f));
+	dynarec_emit8(cpu, 0x80);
+	dynarec_emit8(cpu, 0xE2);
+	dynarec_emit8(cpu, keep);
+	dynarec_emit8(cpu, 0x08);
+	dynarec_emit8(cpu, 0xCA);
+	if (0 != set)
+	{
+		dynarec_emit8(cpu, 0x80);
+		dynarec_emit8(cpu, 0xCA);
+		dynarec_emit8(cpu, set);
 	}
-	break;
+	dynarec_emit_op8(cpu, 0x88, 2, REG_OFFSET(af.f));
+}
+#endif
 
-	case OPC_CALL:
-	{
-		bool cond_lut[4] = {
-			(0 == (cpu.af.f & FLAG_Z)), (0 != (cpu.af.f & FLAG_Z)),
-			(0 == (cpu.af.f & FLAG_C)), (0 != (cpu.af.f & FLAG_C)),
-		};
-		uint8_t cond = ((opcode & 0x38) >> 3);
-		bool call_taken = cond_lut[cond];
+/* Emits the inline code of the instruction at addr, returns false if its
+ * handler has to be called. */
+static bool dynarec_emit_inline(sm83_t *cpu, const opc_desc_t *d, opcode_t opcode_type, uint16_t addr)
+{
 
-		if (call_taken)
-		{
-			uint8_t hi, lo;
-			uint16_t next_pc = cpu.pc + 3;
-			lo = cpu_get_memory(cpu.pc + 1);
-			hi = cpu_get_memory(cpu.pc + 2);
-			cpu_set_memory(--cpu.sp, HIGH_BYTE(next_pc));
-			cpu_set_memory(--cpu.sp, LOW_BYTE(next_pc));
-			cpu.pc = ((uint16_t)hi << 8) | lo;
-			cpu.next_instruction += 24;
-		}
-		else
+	switch (opcode_type)
+	{
+	case OPC_LD:
+		if (REG_HLI == d->src)
 		{
-			cpu.next_instruction += 12;
-			cpu.pc += 3;
+			return false;
 		}
+		// mov al, src; mov dst, al
+		dynarec_emit_op8(cpu, 0x8A, 0, d->src);
+		dynarec_emit_op8(cpu, 0x88, 0, d->dst);
+		return true;
+
+	case OPC_LDd8:
+		// mov byte dst, imm8
+		dynarec_emit_op8(cpu, 0xC6, 0, d->dst);
+		dynarec_emit8(cpu, cpu_get_memory(cpu, addr + 1));
+		return true;
+
+	case OPC_INC16:
+	case OPC_DEC16:
+		// inc / dec word dst
+		dynarec_emit8(cpu, 0x66);
+		dynarec_emit_op8(cpu, 0xFF, (OPC_DEC16 == opcode_type) ? 1 : 0, d->dst);
+		return true;
+
+	default:
+		break;
 	}
-	break;
 
-	case OPC_CAL2:
+#if (0 < USE_LAZY_FLAGS)
+	// F is materialized by the handlers, see cpu_flags_sync()
+	return false;
+#else
+	// x86 opcodes of op al, r/m8 and of op al, imm8, the flags of F they set
+	static const struct
 	{
-		uint8_t hi, lo;
-		uint16_t next_pc = cpu.pc + 3;
-		lo = cpu_get_memory(cpu.pc + 1);
-		hi = cpu_get_memory(cpu.pc + 2);
-		cpu_set_memory(--cpu.sp, HIGH_BYTE(next_pc));
-		cpu_set_memory(--cpu.sp, LOW_BYTE(next_pc));
-		cpu.pc = ((uint16_t)hi << 8) | lo;
-		cpu.next_instruction += 24;
-	}
-	break;
+		uint8_t op_rm, op_imm;
+		uint8_t zh_mask;
+		bool carry_in, carry;
+		uint8_t set;
+		bool store;
+	} alu[] =
+	{
+		[OPC_ADD] = {0x02, 0x04, 0x50, false, true,  0x00, true},
+		[OPC_ADC] = {0x12, 0x14, 0x50, true,  true,  0x00, true},
+		[OPC_SUB] = {0x2A, 0x2C, 0x50, false, true,  0x40, true},
+		[OPC_SBC] = {0x1A, 0x1C, 0x50, true,  true,  0x40, true},
+		[OPC_AND] = {0x22, 0x24, 0x40, false, false, 0x20, true},
+		[OPC_XOR] = {0x32, 0x34, 0x40, false, false, 0x00, true},
+		[OPC_OR]  = {0x0A, 0x0C, 0x40, false, false, 0x00, true},
+		[OPC_CP]  = {0x3A, 0x3C, 0x50, false, true,  0x40, false},
+	};
+	opcode_t op = opcode_type;
+	bool imm = false;
 
-	case OPC_JRc:
+	switch (opcode_type)
 	{
-		bool cond_lut[4] = {
-			(0 == (cpu.af.f & FLAG_Z)), (0 != (cpu.af.f & FLAG_Z)),
-			(0 == (cpu.af.f & FLAG_C)), (0 != (cpu.af.f & FLAG_C)),
-		};
-		uint8_t cond = ((opcode & 0x38) >> 3) - 4;
-		bool jump_taken = cond_lut[cond];
+	case OPC_INC1: case OPC_INC2:
+	case OPC_DEC1: case OPC_DEC2:
+	{
+		bool dec = (OPC_DEC1 == opcode_type) || (OPC_DEC2 == opcode_type);
+		// inc / dec byte dst, C is not changed
+		dynarec_emit_op8(cpu, 0xFE, dec ? 1 : 0, d->dst);
+		dynarec_emit_flags(cpu, 0x50, false, 0x1F, dec ? 0x40 : 0x00);
+		return true;
+	}
 
-		if (jump_taken)
-		{
-			int8_t offset = (int8_t) cpu_get_memory(cpu.pc + 1);
-			cpu.pc += (offset + 2);
-			cpu.next_instruction += 12;
-		}
-		else
+	case OPC_ADD16:
+		// mov ax, hl; mov cx, src; add al, cl; adc ah, ch; mov hl, ax, H from bit 11, Z is not changed
+		dynarec_emit8(cpu, 0x66);
+		dynarec_emit_op8(cpu, 0x8B, 0, REG_OFFSET(hl.hl));
+		dynarec_emit8(cpu, 0x66);
+		dynarec_emit_op8(cpu, 0x8B, 1, d->src);
+		dynarec_emit8(cpu, 0x00);
+		dynarec_emit8(cpu, 0xC8);
+		dynarec_emit8(cpu, 0x10);
+		dynarec_emit8(cpu, 0xEC);
+		dynarec_emit8(cpu, 0x66);
+		dynarec_emit_op8(cpu, 0x89, 0, REG_OFFSET(hl.hl));
+		dynarec_emit_flags(cpu, 0x10, true, 0x8F, 0x00);
+		return true;
+
+	case OPC_ADD2: op = OPC_ADD; imm = true; break;
+	case OPC_ADC2: op = OPC_ADC; imm = true; break;
+	case OPC_SUB2: op = OPC_SUB; imm = true; break;
+	case OPC_SBC2: op = OPC_SBC; imm = true; break;
+	case OPC_AND2: op = OPC_AND; imm = true; break;
+	case OPC_XOR2: op = OPC_XOR; imm = true; break;
+	case OPC_OR2:  op = OPC_OR;  imm = true; break;
+	case OPC_CP2:  op = OPC_CP;  imm = true; break;
+
+	case OPC_ADD: case OPC_ADC: case OPC_SUB: case OPC_SBC:
+	case OPC_AND: case OPC_XOR: case OPC_OR:  case OPC_CP:
+		if (REG_HLI == d->src)
 		{
-			cpu.next_instruction += 8;
-			cpu.pc += 2;
+			return false;
 		}
+		break;
+
+	default:
+		return false;
 	}
-	break;
 
-	case OPC_JR:
+	// mov al, a
+	dynarec_emit_op8(cpu, 0x8A, 0, REG_OFFSET(af.a));
+	if (alu[op].carry_in)
 	{
-		int8_t offset = (int8_t) cpu_get_memory(cpu.pc + 1);
-		cpu.pc += (offset + 2);
-		cpu.next_instruction += 12;
+		// mov dl, f; shr dl, 5: CF = C
+		dynarec_emit_op8(cpu, 0x8A, 2, REG_OFFSET(af.f));
+		dynarec_emit8(cpu, 0xC0);
+		dynarec_emit8(cpu, 0xEA);
+		dynarec_emit8(cpu, 0x05);
 	}
-	break;
-
-	case OPC_JPc:
+	if (imm)
 	{
-		bool cond_lut[4] = {
-			(0 == (cpu.af.f & FLAG_Z)), (0 != (cpu.af.f & FLAG_Z)),
-			(0 == (cpu.af.f & FLAG_C)), (0 != (cpu.af.f & FLAG_C)),
-		};
-		uint8_t cond = ((opcode & 0x38) >> 3);
-		bool jump_taken = cond_lut[cond];
-
-		if (jump_taken)
-		{
-			uint8_t hi, lo;
-			lo = cpu_get_memory(cpu.pc + 1);
-			hi = cpu_get_memory(cpu.pc + 2);
-			cpu.pc = ((uint16_t)hi << 8) | lo;
-			cpu.next_instruction += 16;
-		}
-		else
-		{
-			cpu.next_instruction += 12;
-			cpu.pc += 3;
-		}
+		dynarec_emit8(cpu, alu[op].op_imm);
+		dynarec_emit8(cpu, cpu_get_memory(cpu, addr + 1));
 	}
-	break;
-
-	case OPC_JP:
+	else
 	{
-		uint8_t hi, lo;
-		lo = cpu_get_memory(cpu.pc + 1);
-		hi = cpu_get_memory(cpu.pc + 2);
-		cpu.pc = ((uint16_t)hi << 8) | lo;
-		cpu.next_instruction += 16;
+		dynarec_emit_op8(cpu, alu[op].op_rm, 0, d->src);
 	}
-	break;
-
-	case OPC_JPHL:
+	// lahf only changes ah, al still holds the result
+	dynarec_emit_flags(cpu, alu[op].zh_mask, alu[op].carry, 0x0F, alu[op].set);
+	if (alu[op].store)
 	{
-		cpu.pc = cpu.hl.hl;
-		cpu.next_instruction += 4;
+		dynarec_emit_op8(cpu, 0x88, 0, REG_OFFSET(af.a));
 	}
-	break;
+	return true;
+#endif
+}
 
-	case OPC_RETc:
+static void dynarec_flush(sm83_t *cpu)
+{
+	cpu->dynarec->code_used = 0;
+	cpu->dynarec->n_blocks = 0;
+	memset(cpu->dynarec->hash, 0xFF, sizeof(cpu->dynarec->hash));
+	memset(cpu->dynarec->hits, 0, sizeof(cpu->dynarec->hits));
+	memset(cpu->dynarec->code_pages, 0, sizeof(cpu->dynarec->code_pages));
+	cpu_map_memory(cpu);
+}
+
+static void dynarec_init(sm83_t *cpu)
+{
+	if (NULL == cpu->dynarec)
 	{
-		bool cond_lut[4] = {
-			(0 == (cpu.af.f & FLAG_Z)), (0 != (cpu.af.f & FLAG_Z)),
-			(0 == (cpu.af.f & FLAG_C)), (0 != (cpu.af.f & FLAG_C)),
-		};
-		uint8_t cond = (opcode & 0x38) >> 3;
-		bool return_taken = cond_lut[cond];
-		
-		if (return_taken)
+		cpu->dynarec = calloc(1, sizeof(*cpu->dynarec));
+		if (NULL == cpu->dynarec)
 		{
-			uint8_t lo, hi;
-			lo = cpu_get_memory(cpu.sp++);
-			hi = cpu_get_memory(cpu.sp++);
-			cpu.pc = ((uint16_t)hi << 8) | lo;
-			cpu.next_instruction += 20;
+			DBG_ERROR();
+			exit(1);
 		}
-		else
+#if defined(_WIN32)
+		cpu->dynarec->code = VirtualAlloc(NULL, DYNAREC_CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+		cpu->dynarec->code = mmap(NULL, DYNAREC_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == cpu->dynarec->code)
+		{
+			cpu->dynarec->code = NULL;
+		}
+#endif
+		if (NULL == cpu->dynarec->code)
 		{
-			cpu.next_instruction += 8;
-			cpu.pc += 1;
+			DBG_ERROR();
+			exit(1);
 		}
 	}
-	break;
+	dynarec_flush(cpu);
+}
 
-	case OPC_RETI:
-		cpu_isr_handled();
-		/* fall through */
-	case OPC_RET:
+static void dynarec_destroy(sm83_t *cpu)
+{
+	if (NULL == cpu->dynarec)
 	{
-		uint8_t lo, hi;
-		lo = cpu_get_memory(cpu.sp++);
-		hi = cpu_get_memory(cpu.sp++);
-		cpu.pc = ((uint16_t)hi << 8) | lo;
-		cpu.next_instruction += 16;
+		return;
 	}
-	break;
+#if defined(_WIN32)
+	VirtualFree(cpu->dynarec->code, 0, MEM_RELEASE);
+#else
+	munmap(cpu->dynarec->code, DYNAREC_CODE_SIZE);
+#endif
+	free(cpu->dynarec);
+	cpu->dynarec = NULL;
+}
 
-	case OPC_RST:
+static void dynarec_invalidate(sm83_t *cpu, uint8_t page)
+{
+	for (uint32_t i = 0; i < cpu->dynarec->n_blocks; i++)
 	{
-		uint8_t offset_lut[8] = {0x00, 0x08, 0x10, 0x18, 0x20, 0x28, 0x30, 0x38};
-		uint8_t t = (opcode & 0x38) >> 3;
-		uint8_t offset = offset_lut[t];
-
-		cpu_set_memory(--cpu.sp, (((cpu.pc + 1) & 0xFF00) >> 8));
-		cpu_set_memory(--cpu.sp, (((cpu.pc + 1) & 0x00FF) >> 0));
-
-		cpu.pc = offset;
+		dynarec_block_t *block = &cpu->dynarec->blocks[i];
+		uint8_t first = block->start >> 8;
+		uint8_t pages = (uint8_t) ((block->end >> 8) - first);
 
-		cpu.next_instruction += 16;
+		if ((DYNAREC_INVALID != block->key) && ((uint8_t) (page - first) <= pages))
+		{
+			block->key = DYNAREC_INVALID;
+		}
 	}
-	break;
+	cpu->dynarec->code_pages[page] = 0;
+	// leave the currently running block after the writing instruction
+	cpu->dynarec->exit_block = true;
+}
 
-	case OPC_ADD:
-	{
-		uint8_t operand_lut[8] = {
-			cpu.bc.b, cpu.bc.c, cpu.de.d, cpu.de.e, 
-			cpu.hl.h, cpu.hl.l, cpu_get_memory(cpu.hl.hl), cpu.af.a,
-		};
-		uint8_t i = (opcode & 0x07);
-		uint8_t operand = operand_lut[i];
-		uint8_t duration = (i == 6) ? 8 : 4;
-		uint8_t result = cpu.af.a + operand;
-		eval_Z_flag(result);
-		set_N_flag(false);
-		eval_H_flag(cpu.af.a, operand, false);
-		eval_C_flag(cpu.af.a, operand, false);
-		cpu.af.a = result;
-		cpu.next_instruction += duration;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_SUB:
-	{
-		uint8_t operand_lut[8] = {
-			cpu.bc.b, cpu.bc.c, cpu.de.d, cpu.de.e, 
-			cpu.hl.h, cpu.hl.l, cpu_get_memory(cpu.hl.hl), cpu.af.a, 
-		};
-		uint8_t i = (opcode & 0x07);
-		uint8_t operand = operand_lut[i];
-		uint8_t duration = (i == 6) ? 8 : 4;
-		uint8_t result = cpu.af.a - operand;
-		eval_Z_flag(result);
-		set_N_flag(true);
-		eval_H_flag(cpu.af.a, operand, true);
-		eval_C_flag(cpu.af.a, operand, true);
-		cpu.af.a = result;
-		cpu.next_instruction += duration;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_AND:
-	{
-		uint8_t operand_lut[8] = {
-			cpu.bc.b, cpu.bc.c, cpu.de.d, cpu.de.e, 
-			cpu.hl.h, cpu.hl.l, cpu_get_memory(cpu.hl.hl), cpu.af.a, 
-		};
-		uint8_t i = (opcode & 0x07);
-		uint8_t operand = operand_lut[i];
-		uint8_t duration = (i == 6) ? 8 : 4;
-		cpu.af.a = cpu.af.a & operand;
-		eval_Z_flag(cpu.af.a);
-		set_N_flag(false);
-		set_H_flag(true);
-		set_C_flag(false);
-		cpu.next_instruction += duration;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_OR:
-	{
-		uint8_t operand_lut[8] = {
-			cpu.bc.b, cpu.bc.c, cpu.de.d, cpu.de.e, 
-			cpu.hl.h, cpu.hl.l, cpu_get_memory(cpu.hl.hl), cpu.af.a, 
-		};
-		uint8_t i = (opcode & 0x07);
-		uint8_t operand = operand_lut[i];
-		uint8_t duration = (i == 6) ? 8 : 4;
-		cpu.af.a = cpu.af.a | operand;
-		eval_Z_flag(cpu.af.a);
-		set_N_flag(false);
-		set_H_flag(false);
-		set_C_flag(false);
-		cpu.next_instruction += duration;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_ADD2:
-	{
-		uint8_t operand = cpu_get_memory(cpu.pc + 1);
-		eval_C_flag(cpu.af.a, operand, false);
-		eval_H_flag(cpu.af.a, operand, false);
-		set_N_flag(false);
-		cpu.af.a += operand;
-		eval_Z_flag(cpu.af.a);
-		cpu.next_instruction += 8;
-		cpu.pc += 2;
-	}
-	break;
-
-	case OPC_SUB2:
-	{
-		uint8_t operand = cpu_get_memory(cpu.pc + 1);
-		eval_C_flag(cpu.af.a, operand, true);
-		eval_H_flag(cpu.af.a, operand, true);
-		set_N_flag(true);
-		cpu.af.a -= operand;
-		eval_Z_flag(cpu.af.a);
-		cpu.next_instruction += 8;
-		cpu.pc += 2;
-	}
-	break;
-
-	case OPC_AND2:
-	{
-		uint8_t operand = cpu_get_memory(cpu.pc + 1);
-		set_C_flag(false);
-		set_H_flag(true);
-		set_N_flag(false);
-		cpu.af.a = cpu.af.a & operand;
-		eval_Z_flag(cpu.af.a);
-		cpu.next_instruction += 8;
-		cpu.pc += 2;
-	}
-	break;
-
-	case OPC_OR2:
-	{
-		uint8_t operand = cpu_get_memory(cpu.pc + 1);
-		set_C_flag(false);
-		set_H_flag(false);
-		set_N_flag(false);
-		cpu.af.a = cpu.af.a | operand;
-		eval_Z_flag(cpu.af.a);
-		cpu.next_instruction += 8;
-		cpu.pc += 2;
-	}
-	break;
-
-	case OPC_ADC:
-	{
-		uint8_t operand_lut[8] = {
-			cpu.bc.b, cpu.bc.c, cpu.de.d, cpu.de.e, 
-			cpu.hl.h, cpu.hl.l, cpu_get_memory(cpu.hl.hl), cpu.af.a, 
-		};
-		uint8_t i = (opcode & 0x07);
-		uint8_t operand = operand_lut[i];
-		uint8_t duration = (i == 6) ? 8 : 4;
-		uint8_t c = (0 != (cpu.af.f & FLAG_C)) ? 1 : 0;
-		uint8_t result = cpu.af.a + operand + c;
-		eval_Z_flag(result);
-		set_N_flag(false);
-		eval_H_flag_c(cpu.af.a, operand, false, c);
-		eval_C_flag_c(cpu.af.a, operand, false, c);
-		cpu.af.a = result;
-		cpu.next_instruction += duration;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_SBC:
-	{
-		uint8_t operand_lut[8] = {
-			cpu.bc.b, cpu.bc.c, cpu.de.d, cpu.de.e, 
-			cpu.hl.h, cpu.hl.l, cpu_get_memory(cpu.hl.hl), cpu.af.a, 
-		};
-		uint8_t i = (opcode & 0x07);
-		uint8_t operand = operand_lut[i];
-		uint8_t duration = (i == 6) ? 8 : 4;
-		uint8_t c = (0 != (cpu.af.f & FLAG_C)) ? 1 : 0;
-		uint8_t result = cpu.af.a - operand - c;
-		eval_Z_flag(result);
-		set_N_flag(true);
-		eval_H_flag_c(cpu.af.a, operand, true, c);
-		eval_C_flag_c(cpu.af.a, operand, true, c);
-		cpu.af.a = result;
-		cpu.next_instruction += duration;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_XOR:
-	{
-		uint8_t operand_lut[8] = {
-			cpu.bc.b, cpu.bc.c, cpu.de.d, cpu.de.e, 
-			cpu.hl.h, cpu.hl.l, cpu_get_memory(cpu.hl.hl), cpu.af.a, 
-		};
-		uint8_t i = (opcode & 0x07);
-		uint8_t operand = operand_lut[i];
-		uint8_t duration = (i == 6) ? 8 : 4;
-		cpu.af.a = cpu.af.a ^ operand;
-		eval_Z_flag(cpu.af.a);
-		set_N_flag(false);
-		set_H_flag(false);
-		set_C_flag(false);
-		cpu.next_instruction += duration;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_CP:
-	{
-		uint8_t operand_lut[8] = {
-			cpu.bc.b, cpu.bc.c, cpu.de.d, cpu.de.e, 
-			cpu.hl.h, cpu.hl.l, cpu_get_memory(cpu.hl.hl), cpu.af.a, 
-		};
-		uint8_t i = (opcode & 0x07);
-		uint8_t operand = operand_lut[i];
-		uint8_t duration = (i == 6) ? 8 : 4;
-		uint8_t result = cpu.af.a - operand;
-		eval_Z_flag(result);
-		set_N_flag(true);
-		eval_H_flag(cpu.af.a, operand, true);
-		eval_C_flag(cpu.af.a, operand, true);
-		eval_H_flag(cpu.af.a, operand, true);
-		eval_C_flag(cpu.af.a, operand, true);
-		cpu.next_instruction += duration;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_ADC2:
-	{
-		uint8_t operand = cpu_get_memory(cpu.pc + 1);
-		uint8_t c = (cpu.af.f & FLAG_C) ? 1: 0;
-		eval_C_flag_c(cpu.af.a, operand, false, c);
-		eval_H_flag_c(cpu.af.a, operand, false, c);
-		set_N_flag(false);
-		cpu.af.a += operand + c;
-		eval_Z_flag(cpu.af.a);
-		cpu.next_instruction += 8;
-		cpu.pc += 2;
-	}
-	break;
-
-	case OPC_SBC2:
-	{
-		uint8_t operand = cpu_get_memory(cpu.pc + 1);
-		uint8_t c = (cpu.af.f & FLAG_C) ? 1: 0;
-		eval_C_flag_c(cpu.af.a, operand, true, c);
-		eval_H_flag_c(cpu.af.a, operand, true, c);
-		set_N_flag(true);
-		cpu.af.a -= (operand + c);
-		eval_Z_flag(cpu.af.a);
-		cpu.next_instruction += 8;
-		cpu.pc += 2;
-	}
-	break;
-
-	case OPC_XOR2:
-	{
-		uint8_t operand = cpu_get_memory(cpu.pc + 1);
-		uint8_t c = (cpu.af.f & FLAG_C) ? 1: 0;
-		set_C_flag(false);
-		set_H_flag(false);
-		set_N_flag(false);
-		cpu.af.a = cpu.af.a ^ operand;
-		eval_Z_flag(cpu.af.a);
-		cpu.next_instruction += 8;
-		cpu.pc += 2;
-	}
-	break;
-
-	case OPC_CP2:
-	{
-		uint8_t operand = cpu_get_memory(cpu.pc + 1);
-		uint8_t c = (cpu.af.f & FLAG_C) ? 1: 0;
-		eval_C_flag(cpu.af.a, operand, true);
-		eval_H_flag(cpu.af.a, operand, true);
-		set_N_flag(true);
-		eval_Z_flag(cpu.af.a - operand);
-		cpu.next_instruction += 8;
-		cpu.pc += 2;
-	}
-	break;
+static inline uint32_t dynarec_key(sm83_t *cpu, uint16_t pc)
+{
+	// the bank tells code of the banked windows apart
+	uint32_t bank = 0;
 
-	case OPC_LD:
+	if (pc < 0x4000)
 	{
-		uint8_t src_lut[8] = {
-			cpu.bc.b, cpu.bc.c, cpu.de.d, cpu.de.e,
-			cpu.hl.h, cpu.hl.l, cpu_get_memory(cpu.hl.hl), cpu.af.a
-		};
-		uint8_t *dst_lut[8] = {
-			&cpu.bc.b, &cpu.bc.c, &cpu.de.d, &cpu.de.e,
-			&cpu.hl.h, &cpu.hl.l, NULL     , &cpu.af.a
-		};
-		uint8_t r0 = (opcode & 0x38) >> 3;
-		uint8_t r1 = (opcode & 0x07) >> 0;
-		uint8_t src = src_lut[r1];
-		uint8_t *dst = dst_lut[r0];
-		uint8_t duration = ((6 == r0) || (6 == r1)) ? 8 : 4;
-		*dst = src;
-		cpu.next_instruction += duration;
-		cpu.pc += 1;
+		bank = cpu->mbc.rom_bank0;
 	}
-	break;
-
-	case OPC_LD2:
+	else if (pc < 0x8000)
 	{
-		uint8_t src_lut[8] = {
-			cpu.bc.b, cpu.bc.c, cpu.de.d, cpu.de.e,
-			cpu.hl.h, cpu.hl.l, 0       , cpu.af.a
-		};
-		uint8_t r1 = (opcode & 0x07) >> 0;
-		uint8_t src = src_lut[r1];
-		cpu_set_memory(cpu.hl.hl, src);
-		cpu.next_instruction += 8;
-		cpu.pc += 1;
+		bank = cpu->mbc.rom_bank;
 	}
-	break;
-
-	case OPC_LDd8:
+	else if (0xA000 == (pc & 0xE000))
 	{
-		uint8_t data = cpu_get_memory(cpu.pc + 1);
-		uint8_t *dst_lut[8] = {
-			&cpu.bc.b, &cpu.bc.c, &cpu.de.d, &cpu.de.e,
-			&cpu.hl.h, &cpu.hl.l, NULL     , &cpu.af.a
-		};
-		uint8_t r = (opcode & 0x38) >> 3;
-		uint8_t *dst = dst_lut[r];
-		*dst = data;
-		cpu.next_instruction += 8;
-		cpu.pc += 2;
+		bank = cpu->mbc.ram_bank;
 	}
-	break;
-
-	case OPC_LDd82:
+	else if (0x8000 == (pc & 0xE000))
 	{
-		uint8_t data = cpu_get_memory(cpu.pc + 1);
-		uint8_t r = (opcode & 0x38) >> 3;
-		cpu_set_memory(cpu.hl.hl, data);
-		cpu.next_instruction += 8;
-		cpu.pc += 2;
+		bank = cpu->cgb.vram_bank;
 	}
-	break;
-
-	case OPC_LDa2r:
+	else if (0xD000 == (pc & 0xF000))
 	{
-		uint8_t mux = (opcode & 0x30) >> 4;
-		switch (mux)
-		{
-		case 0: cpu_set_memory(cpu.bc.bc, cpu.af.a); break;
-		case 1: cpu_set_memory(cpu.de.de, cpu.af.a); break;
-		case 2: cpu_set_memory(cpu.hl.hl++, cpu.af.a); break;
-		case 3: cpu_set_memory(cpu.hl.hl--, cpu.af.a); break;
-		default: DBG_ERROR(); break;
-		}
-		cpu.next_instruction += 8;
-		cpu.pc += 1;
+		bank = cpu->cgb.wram_bank;
 	}
-	break;
+	return (bank << 16) | pc;
+}
+
+static dynarec_block_t *dynarec_lookup(sm83_t *cpu, uint32_t key)
+{
+	int32_t i = cpu->dynarec->hash[key % DYNAREC_HASH_SIZE];
 
-	case OPC_LDr2a:
+	while (0 <= i)
 	{
-		uint8_t src;
-		uint8_t mux = (opcode & 0x30) >> 4;
-		switch (mux)
+		if (key == cpu->dynarec->blocks[i].key)
 		{
-		case 0: src = cpu_get_memory(cpu.bc.bc); break;
-		case 1: src = cpu_get_memory(cpu.de.de); break;
-		case 2: src = cpu_get_memory(cpu.hl.hl++); break;
-		case 3: src = cpu_get_memory(cpu.hl.hl--); break;
-		default: DBG_ERROR(); break;
+			return &cpu->dynarec->blocks[i];
 		}
-		cpu.af.a = src;
-		cpu.next_instruction += 8;
-		cpu.pc += 1;
+		i = cpu->dynarec->blocks[i].next;
 	}
-	break;
 
-	case OPC_LDd16:
+	return NULL;
+}
+
+static bool dynarec_ends_block(opcode_t opcode_type)
+{
+	switch (opcode_type)
 	{
-		uint8_t hi, lo;
-		uint16_t d16;
-		uint8_t mux = (opcode & 0x30) >> 4;
-		lo = cpu_get_memory(cpu.pc + 1);
-		hi = cpu_get_memory(cpu.pc + 2);
-		d16 = ((uint16_t)(hi << 8)) | lo;
-		switch (mux)
-		{
-		case 0: cpu.bc.bc = d16; break;
-		case 1: cpu.de.de = d16; break;
-		case 2: cpu.hl.hl = d16; break;
-		case 3: cpu.sp = d16; break;
-		default: DBG_ERROR(); break;
-		}
-		cpu.next_instruction += 12;
-		cpu.pc += 3;
+	case OPC_NONE: case OPC_STOP: case OPC_HALT: case OPC_EI: case OPC_DI:
+	case OPC_CALL: case OPC_CAL2: case OPC_JRc: case OPC_JR: case OPC_JPc:
+	case OPC_JP: case OPC_JPHL: case OPC_RETc: case OPC_RET: case OPC_RETI:
+	case OPC_RST:
+		return true;
+	default:
+		return false;
 	}
-	break;
+}
 
-	case OPC_LD16s:
+static bool dynarec_writes_memory(uint8_t opcode, uint8_t opcode2)
+{
+	switch (opcode_types[opcode])
 	{
-		uint8_t hi, lo;
-		uint16_t addr;
-		lo = cpu_get_memory(cpu.pc + 1);
-		hi = cpu_get_memory(cpu.pc + 2);
-		addr = ((uint16_t)(hi << 8)) | lo;
-		cpu_set_memory(addr + 0, LOW_BYTE(cpu.sp));
-		cpu_set_memory(addr + 1, HIGH_BYTE(cpu.sp));
-		cpu.next_instruction += 20;
-		cpu.pc += 3;
+	case OPC_LD2: case OPC_LDd82: case OPC_LDa2r: case OPC_LD16s: case OPC_LDHa8:
+	case OPC_LDCA: case OPC_INC3: case OPC_DEC3: case OPC_LD16A: case OPC_PUSH:
+		return true;
+	case OPC_CB:
+		return (6 == (opcode2 & 0x07)) && (OPC_BIT2 != opcode_types2[opcode2]);
+	default:
+		return false;
 	}
-	break;
+}
 
-	case OPC_LDHa8:
+#if (0 < DYNAREC_VERIFY)
+static void dynarec_get_regs(sm83_t *cpu, dynarec_regs_t *regs)
+{
+	FLAGS_SYNC();
+	regs->af = cpu->af.af;
+	regs->bc = cpu->bc.bc;
+	regs->de = cpu->de.de;
+	regs->hl = cpu->hl.hl;
+	regs->sp = cpu->sp;
+	regs->pc = cpu->pc;
+}
+
+// called by translated code after every instruction
+static void dynarec_verify_step(sm83_t *cpu, uint64_t i)
+{
+	dynarec_regs_t regs;
+	dynarec_get_regs(cpu, &regs);
+	if (0 != memcmp(&regs, &cpu->dynarec->verify_regs[i], sizeof(regs)))
 	{
-		uint8_t a8 = cpu_get_memory(cpu.pc + 1);
-		uint16_t addr = 0xff00 + a8;
-		cpu_set_memory(addr, cpu.af.a);
-		cpu.next_instruction += 12;
-		cpu.pc += 2;
+		printf("dynarec: register mismatch after instruction %u of block at %04x\n",
+		       (unsigned) i, cpu->dynarec->verify_start.pc);
+		DBG_ERROR();
 	}
-	break;
+}
+#endif
+
+/* JR and JR cc at addr. Not taken, JR cc continues the block, the cycles
+ * and bytes of the inline instructions before are in cycles and bytes.
+ * Taken, the block is left, or restarted if it jumps to its own start. */
+static void dynarec_emit_jr(sm83_t *cpu, dynarec_block_t *block, const opc_desc_t *d, uint16_t addr,
+                            uint32_t loop, uint32_t cycles, uint16_t bytes, uint32_t executed)
+{
+	int8_t offset = (int8_t) cpu_get_memory(cpu, addr + 1);
+	uint16_t target = addr + 2 + offset;
+	uint32_t not_taken = 0;
 
-	case OPC_LDHA:
+	if (0 != d->cond_mask)
 	{
-		uint8_t a8 = cpu_get_memory(cpu.pc + 1);
-		uint16_t addr = 0xff00 + a8;
-		cpu.af.a = cpu_get_memory(addr);
-		cpu.next_instruction += 12;
-		cpu.pc += 2;
+		// test byte f, cond_mask
+		dynarec_emit_op8(cpu, 0xF6, 0, REG_OFFSET(af.f));
+		dynarec_emit8(cpu, d->cond_mask);
+		not_taken = dynarec_emit_jcc(cpu, (0 != d->cond_val) ? DYNAREC_JE : DYNAREC_JNE);
+
+#if !(0 < BUILD_TEST_DLL)
+		// the handler looks for a polling loop unless it already rejected this one, see opc_jr()
+		if ((0 > offset) && (-IDLE_MAX_LOOP <= offset))
+		{
+			uint32_t skip;
+
+			// cmp dword idle_reject[target % IDLE_CACHE], 0x10000 | target
+			dynarec_emit_op8(cpu, 0x81, 7, offsetof(sm83_t, idle_reject[target % IDLE_CACHE]));
+			dynarec_emit32(cpu, 0x10000 | target);
+			skip = dynarec_emit_jcc(cpu, DYNAREC_JE);
+			dynarec_emit_sync(cpu, cycles, bytes);
+			dynarec_emit_call(cpu, d->handler, (uint64_t) (uintptr_t) d);
+			dynarec_emit_return(cpu, executed);
+			dynarec_patch(cpu, skip);
+		}
+#endif
 	}
-	break;
 
-	case OPC_LDCA:
+	dynarec_emit_sync(cpu, cycles + d->cycles_taken, 0);
+	dynarec_emit_set_pc(cpu, target);
+	if (target == block->start)
 	{
-		uint16_t addr = 0xff00 + cpu.bc.c;
-		cpu_set_memory(addr, cpu.af.a);
-		cpu.next_instruction += 8;
-		cpu.pc += 1;
+		// add r13d, length; lea eax, [r13 + length]; cmp eax, r14d: room for another pass?
+		dynarec_emit8(cpu, 0x41);
+		dynarec_emit8(cpu, 0x83);
+		dynarec_emit8(cpu, 0xC5);
+		dynarec_emit8(cpu, executed);
+		dynarec_emit8(cpu, 0x41);
+		dynarec_emit8(cpu, 0x8D);
+		dynarec_emit8(cpu, 0x45);
+		dynarec_emit8(cpu, executed);
+		dynarec_emit8(cpu, 0x44);
+		dynarec_emit8(cpu, 0x39);
+		dynarec_emit8(cpu, 0xF0);
+		dynarec_emit_exit(cpu, DYNAREC_JA, 0, 0, 0);
+		// cmp byte dma.active, 0: blocks do not run while the OAM DMA blocks their bus
+		dynarec_emit_op8(cpu, 0x80, 7, offsetof(sm83_t, dma.active));
+		dynarec_emit8(cpu, 0x00);
+		dynarec_emit_exit(cpu, DYNAREC_JNE, 0, 0, 0);
+		dynarec_emit_budget(cpu);
+		dynarec_emit_exit(cpu, DYNAREC_JBE, 0, 0, 0);
+		// jmp loop
+		dynarec_emit8(cpu, 0xE9);
+		dynarec_emit32(cpu, loop - (cpu->dynarec->code_used + 4));
 	}
-	break;
-
-	case OPC_LDAC:
+	else
 	{
-		uint16_t addr = 0xff00 + cpu.bc.c;
-		cpu.af.a = cpu_get_memory(addr);
-		cpu.next_instruction += 8;
-		cpu.pc += 1;
+		dynarec_emit_return(cpu, executed);
 	}
-	break;
 
-	case OPC_PUSH:
+	if (0 != d->cond_mask)
 	{
-		uint8_t r = (opcode & 0x30) >> 4;
-		uint16_t src_lut[4] = { cpu.bc.bc, cpu.de.de, cpu.hl.hl, cpu.af.af };
-		uint16_t src = src_lut[r];
-		cpu_set_memory(--cpu.sp, HIGH_BYTE(src));
-		cpu_set_memory(--cpu.sp, LOW_BYTE(src));
-		cpu.next_instruction += 16;
-		cpu.pc += 1;
+		dynarec_patch(cpu, not_taken);
 	}
-	break;
+}
+
+static dynarec_block_t *dynarec_translate(sm83_t *cpu, uint32_t key, uint16_t pc)
+{
+	dynarec_block_t *block;
+	uint16_t addr = pc;
+	uint16_t length = 0;
+	uint32_t loop;
+	opcode_t last_type;
+	// cycles and bytes of the inline instructions since the last sync
+	uint32_t cycles = 0;
+	uint16_t bytes = 0;
 
-	case OPC_POP:
+	if ((DYNAREC_MAX_BLOCKS == cpu->dynarec->n_blocks) ||
+	    ((DYNAREC_CODE_SIZE - cpu->dynarec->code_used) < DYNAREC_MAX_BLOCK_CODE))
 	{
-		uint8_t hi, lo;
-		uint8_t r = (opcode & 0x30) >> 4;
-		uint16_t *dst_lut[4] = { &cpu.bc.bc, &cpu.de.de, &cpu.hl.hl, &cpu.af.af };
-		uint16_t *dst = dst_lut[r];
-		lo = cpu_get_memory(cpu.sp++) & ((dst == &cpu.af.af) ? 0xf0 : 0xff);
-		hi = cpu_get_memory(cpu.sp++);
-		*dst = ((uint16_t)(hi << 8)) | lo;
-		cpu.next_instruction += 12;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_INC1:
-	{
-		uint8_t mux = (opcode & 0x30) >> 4;
-		uint8_t *val;
-		switch (mux)
-		{
-		case 0: val = &cpu.bc.b; break;
-		case 1: val = &cpu.de.d; break;
-		case 2: val = &cpu.hl.h; break;
-		default: DBG_ERROR(); break;
-		}
-		eval_H_flag(*val, 1, false);
-		set_N_flag(false);
-		(*val)++;
-		eval_Z_flag(*val);
-		cpu.next_instruction += 4;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_INC2:
-	{
-		uint8_t mux = (opcode & 0x30) >> 4;
-		uint8_t *val;
-		switch (mux)
-		{
-		case 0: val = &cpu.bc.c; break;
-		case 1: val = &cpu.de.e; break;
-		case 2: val = &cpu.hl.l; break;
-		case 3: val = &cpu.af.a; break;
-		default: DBG_ERROR(); break;
-		}
-		eval_H_flag(*val, 1, false);
-		set_N_flag(false);
-		(*val)++;
-		eval_Z_flag(*val);
-		cpu.next_instruction += 4;
-		cpu.pc += 1;
-	}
-	break;
-
-	case OPC_INC3:
-	{
-		uint8_t val = cpu_get_memory(cpu.hl.hl);
-		eval_H_flag(val, 1, false);
-		set_N_flag(false);
-		cpu_set_memory(cpu.hl.hl, val + 1);
-		eval_Z_flag(val + 1);
-		cpu.next_instruction += 12;
-		cpu.pc += 1;
-	}
-	break;
+		dynarec_flush(cpu);
+	}
 
-	case OPC_INC16:
+	block = &cpu->dynarec->blocks[cpu->dynarec->n_blocks];
+	block->code = (dynarec_code_t) &cpu->dynarec->code[cpu->dynarec->code_used];
+	block->key = key;
+	block->start = pc;
+
+	dynarec_emit_prologue(cpu);
+	dynarec_emit_budget(cpu);
+	loop = cpu->dynarec->code_used;
+
+	for (;;)
 	{
-		uint8_t mux = (opcode & 0x30) >> 4;
-		switch (mux)
+		uint8_t opcode = cpu_get_memory(cpu, addr);
+		uint8_t opcode2 = cpu_get_memory(cpu, addr + 1);
+		opcode_t opcode_type = opcode_types[opcode];
+		const opc_desc_t *d = &opc_decode[opcode];
+#if (0 < USE_LAZY_FLAGS)
+		// the condition of JRc reads F, which only the handlers materialize
+		bool inline_jr = (OPC_JR == opcode_type);
+#else
+		bool inline_jr = (OPC_JR == opcode_type) || (OPC_JRc == opcode_type);
+#endif
+		bool call = false;
+
+		last_type = opcode_type;
+		if (OPC_CB == opcode_type)
 		{
-		case 0: cpu.bc.bc++; break;
-		case 1: cpu.de.de++; break;
-		case 2: cpu.hl.hl++; break;
-		case 3: cpu.sp++; break;
-		default: DBG_ERROR(); break;
+			d = &opc_decode[0x100 + opcode2];
 		}
-		cpu.next_instruction += 8;
-		cpu.pc += 1;
-	}
-	break;
 
-	case OPC_DEC1:
-	{
-		uint8_t mux = (opcode & 0x30) >> 4;
-		uint8_t *val;
-		switch (mux)
+		length++;
+		if (inline_jr)
 		{
-		case 0: val = &cpu.bc.b; break;
-		case 1: val = &cpu.de.d; break;
-		case 2: val = &cpu.hl.h; break;
-		default: DBG_ERROR(); break;
+			dynarec_emit_jr(cpu, block, d, addr, loop, cycles, bytes, length);
+			cycles += d->cycles;
+			bytes += d->length;
 		}
-		eval_H_flag((uint8_t)*val, 1, true);
-		set_N_flag(true);
-		(*val)--;
-		eval_Z_flag(*val);
-		cpu.next_instruction += 4;
-		cpu.pc += 1;
-	}
-	break;
+		else if (dynarec_emit_inline(cpu, d, opcode_type, addr))
+		{
+			cycles += d->cycles;
+			bytes += d->length;
+		}
+		else
+		{
+			dynarec_emit_sync(cpu, cycles, bytes);
+			cycles = 0;
+			bytes = 0;
+			dynarec_emit_call(cpu, d->handler, (uint64_t) (uintptr_t) d);
+			call = true;
+		}
+		addr += d->length;
 
-	case OPC_DEC2:
-	{
-		uint8_t mux = (opcode & 0x30) >> 4;
-		uint8_t *val;
-		switch (mux)
+#if (0 < DYNAREC_VERIFY)
+		dynarec_emit_sync(cpu, cycles, bytes);
+		cycles = 0;
+		bytes = 0;
+		dynarec_emit_call(cpu, dynarec_verify_step, length - 1);
+		call = true;
+#endif
+
+		// a block does not leave its bank window, see dynarec_key()
+		if ((dynarec_ends_block(opcode_type) && !inline_jr) || (OPC_JR == opcode_type) ||
+		    (DYNAREC_MAX_BLOCK_LEN == length) || ((addr >> 13) != (pc >> 13)))
+		{
+			break;
+		}
+
+		if (dynarec_writes_memory(opcode, opcode2))
+		{
+			// mov rax, &cpu->dynarec->exit_block; cmp byte [rax], 0
+			dynarec_emit8(cpu, 0x48);
+			dynarec_emit8(cpu, 0xB8);
+			dynarec_emit64(cpu, (uint64_t) (uintptr_t) &cpu->dynarec->exit_block);
+			dynarec_emit8(cpu, 0x80);
+			dynarec_emit8(cpu, 0x38);
+			dynarec_emit8(cpu, 0x00);
+			dynarec_emit_exit(cpu, DYNAREC_JNE, 0, 0, length);
+		}
+		if (call)
+		{
+			// handlers update next_instruction and may schedule events
+			dynarec_emit_budget(cpu);
+			dynarec_emit_exit(cpu, DYNAREC_JBE, 0, 0, length);
+		}
+		else
 		{
-		case 0: val = &cpu.bc.c; break;
-		case 1: val = &cpu.de.e; break;
-		case 2: val = &cpu.hl.l; break;
-		case 3: val = &cpu.af.a; break;
-		default: DBG_ERROR(); break;
+			dynarec_emit_sched_check(cpu, cycles, bytes, length);
 		}
-		eval_H_flag(*val, 1, true);
-		set_N_flag(true);
-		(*val)--;
-		eval_Z_flag(*val);
-		cpu.next_instruction += 4;
-		cpu.pc += 1;
 	}
-	break;
 
-	case OPC_DEC3:
+	// a taken JR has already left the block
+	if (OPC_JR != last_type)
 	{
-		uint8_t val = cpu_get_memory(cpu.hl.hl);
-		eval_H_flag(val, 1, true);
-		set_N_flag(true);
-		cpu_set_memory(cpu.hl.hl, val - 1);
-		eval_Z_flag(val - 1);
-		cpu.next_instruction += 12;
-		cpu.pc += 1;
+		dynarec_emit_sync(cpu, cycles, bytes);
+		dynarec_emit_return(cpu, length);
+	}
+	if (DYNAREC_MAX_BLOCK_CODE < (uint32_t) ((uint8_t *) &cpu->dynarec->code[cpu->dynarec->code_used] - (uint8_t *) block->code))
+	{
+		DBG_ERROR();
 	}
-	break;
 
-	case OPC_DEC16:
+	block->end = addr - 1;
+	block->length = length;
+	block->next = cpu->dynarec->hash[key % DYNAREC_HASH_SIZE];
+	cpu->dynarec->hash[key % DYNAREC_HASH_SIZE] = cpu->dynarec->n_blocks++;
+	for (uint8_t page = block->start >> 8; ; page++)
 	{
-		uint8_t mux = (opcode & 0x30) >> 4;
-		switch (mux)
+		cpu->dynarec->code_pages[page] = 1;
+		cpu->write_page[page] = NULL;
+		if (page == (uint8_t) (block->end >> 8))
 		{
-		case 0: cpu.bc.bc--; break;
-		case 1: cpu.de.de--; break;
-		case 2: cpu.hl.hl--; break;
-		case 3: cpu.sp--; break;
-		default: DBG_ERROR(); break;
+			break;
 		}
-		cpu.next_instruction += 8;
-		cpu.pc += 1;
 	}
-	break;
 
-	case OPC_ADD16:
+	return block;
+}
+
+static uint32_t dynarec_execute(sm83_t *cpu, dynarec_block_t *block, uint32_t budget)
+{
+	uint32_t executed;
+
+#if (0 < DYNAREC_VERIFY)
+	// run the interpreter as reference, then the block from the same state
+	uint32_t expected = 0;
+	uint32_t ram_size = cpu->cart.ram_banks * 0x2000;
+	memcpy(&cpu->dynarec->verify_start, cpu, sizeof(*cpu));
+	if (0 < ram_size)
+	{
+		memcpy(cpu->dynarec->verify_ram[0], cpu->cart.ram, ram_size);
+	}
+	cpu->dynarec->exit_block = false;
+	cpu->dynarec->verifying = true;
+	while (expected < block->length)
+	{
+		uint16_t pc = cpu->pc;
+		bool jrc = (OPC_JRc == opcode_types[cpu_get_memory(cpu, pc)]);
+		cpu_handle_opcode(cpu);
+		cpu->cycle_cnt++;
+		dynarec_get_regs(cpu, &cpu->dynarec->verify_regs[expected++]);
+		// a taken JRc leaves the block, see dynarec_emit_jr()
+		if (cpu->dynarec->exit_block || (cpu->sched.next <= cpu->next_instruction) ||
+		    (jrc && ((uint16_t) (pc + 2) != cpu->pc)))
+		{
+			break;
+		}
+	}
+	cpu->dynarec->verifying = false;
+	memcpy(&cpu->dynarec->verify_end, cpu, sizeof(*cpu));
+	memcpy(cpu, &cpu->dynarec->verify_start, sizeof(*cpu));
+	// the external RAM is not part of sm83_t
+	if (0 < ram_size)
 	{
-		uint16_t operand_lut[4] = { cpu.bc.bc, cpu.de.de, cpu.hl.hl, cpu.sp };
-		uint8_t ss = (opcode & 0x30) >> 4;
-		uint16_t operand = operand_lut[ss];
-		set_N_flag(false);
-		eval_H_flag_16(cpu.hl.hl, operand);
-		eval_C_flag_16(cpu.hl.hl, operand);
-		cpu.hl.hl += operand;
-		cpu.next_instruction += 8;
-		cpu.pc += 1;
+		memcpy(cpu->dynarec->verify_ram[1], cpu->cart.ram, ram_size);
+		memcpy(cpu->cart.ram, cpu->dynarec->verify_ram[0], ram_size);
 	}
-	break;
+#endif
+
+	cpu->dynarec->exit_block = false;
+#if (0 < DYNAREC_VERIFY)
+	// one pass through the block, a loop would run ahead of the reference
+	budget = block->length;
+#endif
+	executed = block->code(budget);
+	cpu->cycle_cnt += executed;
 
-	case OPC_ADDSP:
+#if (0 < DYNAREC_VERIFY)
+	// translated code does not fetch the opcodes, so the fetch cache may differ
+	cpu->dynarec->verify_end.fetch_page = cpu->fetch_page;
+	cpu->dynarec->verify_end.fetch_host = cpu->fetch_host;
+	// the reference run does not produce putc output
+	cpu->dynarec->verify_end.putc_len = cpu->putc_len;
+	memcpy(cpu->dynarec->verify_end.putc_buf, cpu->putc_buf, sizeof(cpu->putc_buf));
+	if ((executed != expected) || (0 != memcmp(cpu, &cpu->dynarec->verify_end, sizeof(*cpu))) ||
+	    ((0 < ram_size) && (0 != memcmp(cpu->cart.ram, cpu->dynarec->verify_ram[1], ram_size))))
 	{
-		int8_t r8 = cpu_get_memory(cpu.pc + 1);
-		set_Z_flag(false);
-		set_N_flag(false);
-		eval_H_flag(cpu.sp, r8, false);
-		eval_C_flag(cpu.sp, r8, false);
-		cpu.sp += r8;
-		cpu.next_instruction += 16;
-		cpu.pc += 2;
+		printf("dynarec: state mismatch after block at %04x (%u/%u instructions)\n",
+		       block->start, executed, expected);
+		DBG_ERROR();
 	}
-	break;
+#endif
+
+	return executed;
+}
 
-	case OPC_LDHLS:
+void cpu_run(sm83_t *cpu, uint64_t instructions)
+{
+	while ((0 < instructions) && !cpu->stopped)
+	{
+		uint32_t key = dynarec_key(cpu, cpu->pc);
+		dynarec_block_t *block = dynarec_lookup(cpu, key);
+
+		if ((NULL == block) && (DYNAREC_HOT_THRESHOLD <= cpu->dynarec->hits[cpu->pc]) && !cpu->dma.active)
+		{
+			block = dynarec_translate(cpu, key, cpu->pc);
+		}
+
+		// the instruction after EI runs alone, so IME is set right after it.
+		// Translated code does not fetch its opcodes, so it is neither
+		// created nor run while an OAM DMA may block its bus.
+		if ((NULL != block) && (block->length <= instructions) && (0 == cpu->ei_delay) && !cpu->dma.active)
+		{
+			instructions -= dynarec_execute(cpu, block, (UINT32_MAX > instructions) ? (uint32_t) instructions : UINT32_MAX);
+		}
+		else
+		{
+			if (0xFF > cpu->dynarec->hits[cpu->pc])
+			{
+				cpu->dynarec->hits[cpu->pc]++;
+			}
+			cpu_handle_opcode(cpu);
+			cpu->cycle_cnt++;
+			instructions--;
+		}
+		// blocks return when an event is due, see dynarec_emit_sched_check()
+		cpu_sched_check(cpu);
+	}
+}
+#else
+void cpu_run(sm83_t *cpu, uint64_t instructions)
+{
+	while ((0 < instructions--) && !cpu->stopped)
 	{
-		int8_t r8 = cpu_get_memory(cpu.pc + 1);
-		set_Z_flag(false);
-		set_N_flag(false);
-		eval_H_flag(cpu.sp, r8, false);
-		eval_C_flag(cpu.sp, r8, false);
-		cpu.hl.hl = cpu.sp + r8;
-		cpu.next_instruction += 12;
-		cpu.pc += 2;
+		cpu_tick(cpu);
 	}
-	break;
+}
+#endif
+
+void cpu_setup(sm83_t *cpu, uint8_t a, uint8_t f, uint8_t b, uint8_t c, uint8_t d, uint8_t e, uint8_t h, uint8_t l, uint16_t pc, uint16_t sp)
+{
+	cpu_init(cpu);
+	cpu->af.a = a;
+	cpu->af.f = f;
+	cpu->bc.b = b;
+	cpu->bc.c = c;
+	cpu->de.d = d;
+	cpu->de.e = e;
+	cpu->hl.h = h;
+	cpu->hl.l = l;
+	cpu->pc = pc;
+	cpu->sp = sp;
+}
+
+void cpu_get_state(sm83_t *cpu, uint8_t *a, uint8_t *f, uint8_t *b, uint8_t *c, uint8_t *d, uint8_t *e, uint8_t *h, uint8_t *l, uint16_t *pc, uint16_t *sp)
+{
+	FLAGS_SYNC();
+	*a = cpu->af.a;
+	*f = cpu->af.f;
+	*b = cpu->bc.b;
+	*c = cpu->bc.c;
+	*d = cpu->de.d;
+	*e = cpu->de.e;
+	*h = cpu->hl.h;
+	*l = cpu->hl.l;
+	*pc = cpu->pc;
+	*sp = cpu->sp;
+}
+
+#if (0 < BUILD_ALU_BENCHMARK)
+/* Microbenchmark: flags of ADD/ADC/SUB/SBC/CP computed by the branchy
+ * eval_* helpers vs. a single load from the ALU tables. */
+int main(int argc, char *argv[])
+{
+	enum { N_INPUTS = 1 << 20, N_ROUNDS = 32 };
+	static uint32_t inputs[N_INPUTS];
+	uint32_t seed = 0x12345678;
+	uint32_t sum_helpers = 0;
+	uint32_t sum_tables = 0;
+	clock_t start;
+	double t_helpers, t_tables;
+	sm83_t *cpu = cpu_create();
 
-	case OPC_LDSHL:
+	cpu_build_alu_tables();
+
+	for (int i = 0; i < N_INPUTS; i++)
 	{
-		cpu.sp = cpu.hl.hl;
-		cpu.next_instruction += 8;
-		cpu.pc += 1;
+		seed = seed * 1103515245 + 12345;
+		inputs[i] = (seed >> 8) & 0x3FFFF;	// sub << 17 | c << 16 | a << 8 | b
 	}
-	break;
 
-	case OPC_LD16A:
+	start = clock();
+	for (int round = 0; round < N_ROUNDS; round++)
 	{
-		uint8_t hi, lo;
-		uint16_t a16;
-		lo = cpu_get_memory(cpu.pc + 1);
-		hi = cpu_get_memory(cpu.pc + 2);
-		a16 = ((uint16_t)(hi << 8)) | lo;
-		cpu_set_memory(a16, cpu.af.a);
-		cpu.next_instruction += 16;
-		cpu.pc += 3;
+		for (int i = 0; i < N_INPUTS; i++)
+		{
+			uint8_t a = inputs[i] >> 8;
+			uint8_t b = inputs[i];
+			uint8_t c = (inputs[i] >> 16) & 1;
+			bool sub = (0 != (inputs[i] >> 17));
+			uint8_t result = sub ? (a - b - c) : (a + b + c);
+			cpu->af.f = 0;
+			eval_Z_flag(cpu, result);
+			set_N_flag(cpu, sub);
+			eval_H_flag_c(cpu, a, b, sub, c);
+			eval_C_flag_c(cpu, a, b, sub, c);
+			sum_helpers += ((uint16_t) result << 8) | cpu->af.f;
+		}
 	}
-	break;
+	t_helpers = (double) (clock() - start) / CLOCKS_PER_SEC;
 
-	case OPC_LDA16:
+	start = clock();
+	for (int round = 0; round < N_ROUNDS; round++)
 	{
-		uint8_t hi, lo;
-		uint16_t a16;
-		lo = cpu_get_memory(cpu.pc + 1);
-		hi = cpu_get_memory(cpu.pc + 2);
-		a16 = ((uint16_t)(hi << 8)) | lo;
-		cpu.af.a = cpu_get_memory(a16);
-		cpu.next_instruction += 16;
-		cpu.pc += 3;
+		for (int i = 0; i < N_INPUTS; i++)
+		{
+			uint16_t *table = (0 != (inputs[i] >> 17)) ? alu_sub_table : alu_add_table;
+			sum_tables += table[inputs[i] & 0x1FFFF];
+		}
 	}
-	break;
+	t_tables = (double) (clock() - start) / CLOCKS_PER_SEC;
 
-	default: DBG_ERROR(); break;
+	printf("helpers: %.2f ns/op\n", t_helpers * 1e9 / ((double) N_INPUTS * N_ROUNDS));
+	printf("tables:  %.2f ns/op\n", t_tables * 1e9 / ((double) N_INPUTS * N_ROUNDS));
+	if (sum_helpers != sum_tables)
+	{
+		printf("Error: results differ (%08x != %08x).\n", sum_helpers, sum_tables);
+		cpu_destroy(cpu);
+		return 1;
 	}
 
+	cpu_destroy(cpu);
+	return 0;
 }
+#elif (0 < BUILD_PPU_BENCHMARK)
+typedef void (*ppu_decode_t)(const uint8_t *rows, uint8_t *pixels, uint32_t n);
+typedef void (*ppu_colors_t)(const uint8_t *pixels, const uint16_t *colors, uint16_t *out, uint32_t n);
 
-void cpu_print_state(void)
+// colors of n_lines background lines, returns the time per line
+static double ppu_bench_lines(ppu_decode_t decode, ppu_colors_t colors, const uint8_t *rows,
+                              const uint16_t *palette, uint32_t n_lines, uint16_t *out)
 {
-	bool zf,nf,hf,cf;
-	zf = (0 != (cpu.af.f & FLAG_Z));
-	nf = (0 != (cpu.af.f & FLAG_N));
-	hf = (0 != (cpu.af.f & FLAG_H));
-	cf = (0 != (cpu.af.f & FLAG_C));
-	uint8_t a,b,c,d,e,h,l;
-	a = cpu.af.a;
-	b = cpu.bc.b;
-	c = cpu.bc.c;
-	d = cpu.de.d;
-	e = cpu.de.e;
-	h = cpu.hl.h;
-	l = cpu.hl.l;
-	printf("\n");
-	printf("PC: %04x (Next Opcode = %02x), SP: %04x\n", cpu.pc, cpu_get_memory(cpu.pc), cpu.sp);
-	printf("Z: %d, N: %d, H: %d, C: %d\n", zf, nf, hf, cf);
-	printf("A: %02x, B: %02x, C: %02x, D: %02x, E: %02x, H: %02x, L: %02x\n", a, b, c, d, e, h, l);
-	printf("BC: %04x, DE: %04x, HL: %04x\n", cpu.bc.bc, cpu.de.de, cpu.hl.hl);
-}
+	enum { N_ROUNDS = 64 };
+	uint8_t pixels[PPU_FETCH_TILES * 8];
+	clock_t start = clock();
 
-void cpu_tick(void)
-{
-	// currently ignoring cpu.next_instruction, which can be used for cycle-accuracy
-	cpu_handle_opcode();
-	cpu.cycle_cnt++;
+	for (int round = 0; round < N_ROUNDS; round++)
+	{
+		for (uint32_t line = 0; line < n_lines; line++)
+		{
+			decode(&rows[2 * PPU_FETCH_TILES * line], pixels, PPU_FETCH_TILES);
+			colors(&pixels[line % 8], palette, &out[CPU_SCREEN_WIDTH * line], CPU_SCREEN_WIDTH);
+		}
+	}
 
-	return;
+	return (double) (clock() - start) / CLOCKS_PER_SEC / ((double) n_lines * N_ROUNDS);
 }
 
-#if (0 < BUILD_TEST_DLL)
-void cpu_setup(uint8_t a, uint8_t f, uint8_t b, uint8_t c, uint8_t d, uint8_t e, uint8_t h, uint8_t l, uint16_t pc, uint16_t sp)
+/* Microbenchmark: decoding and coloring of background lines by the scalar
+ * code vs. the SIMD variants, which have to give exactly the same pixels. */
+int main(int argc, char *argv[])
 {
-	memset(&cpu, 0, sizeof(cpu));
-	cpu.af.a = a;
-	cpu.af.f = f;
-	cpu.bc.b = b;
-	cpu.bc.c = c;
-	cpu.de.d = d;
-	cpu.de.e = e;
-	cpu.hl.h = h;
-	cpu.hl.l = l;
-	cpu.pc = pc;
-	cpu.sp = sp;
-}
+	enum { N_TILES = 0x10000, N_LINES = N_TILES / PPU_FETCH_TILES, N_INDICES = 4099 };
+	static uint8_t rows[2 * N_TILES];
+	static uint8_t pixels[3][8 * N_TILES];
+	static uint8_t indices[N_INDICES];
+	static uint16_t colors[3][N_INDICES];
+	static uint16_t lines[3][CPU_SCREEN_WIDTH * N_LINES];
+	static const char *names[3] = { "scalar", "sse2", "avx2" };
+	ppu_decode_t decode[3] = { cpu_ppu_decode_scalar };
+	ppu_colors_t color[3] = { cpu_ppu_colors_scalar };
+	uint16_t palette[32];
+	uint32_t n_variants = 1;
+	uint32_t seed = 0x12345678;
+	int ret = 0;
 
-void cpu_get_state(uint8_t *a, uint8_t *f, uint8_t *b, uint8_t *c, uint8_t *d, uint8_t *e, uint8_t *h, uint8_t *l, uint16_t *pc, uint16_t *sp)
-{
-	*a = cpu.af.a;
-	*f = cpu.af.f;
-	*b = cpu.bc.b;
-	*c = cpu.bc.c;
-	*d = cpu.de.d;
-	*e = cpu.de.e;
-	*h = cpu.hl.h;
-	*l = cpu.hl.l;
-	*pc = cpu.pc;
-	*sp = cpu.sp;
-}
+#if (0 < USE_PPU_SIMD)
+	decode[n_variants] = cpu_ppu_decode_sse2;
+	color[n_variants++] = cpu_ppu_colors_scalar;
+	if (__builtin_cpu_supports("avx2"))
+	{
+		decode[n_variants] = cpu_ppu_decode_avx2;
+		color[n_variants++] = cpu_ppu_colors_avx2;
+	}
 #endif
 
-int main(int argc, char *argv[])
-{
-	if (2 == argc)
+	// every combination of the two bit planes
+	for (uint32_t i = 0; i < N_TILES; i++)
 	{
-		char *FileName  = argv[1];
-		FILE *gbFile = fopen(FileName, "rb");
-		if (NULL == gbFile)
-		{
-			printf("Error: Could not open file '%s'.\n", FileName);
-			return 1;
-		}
-		fread(cpu.rom, 1, 32*1024, gbFile);
-		fclose(gbFile);
+		rows[2 * i] = (uint8_t) i;
+		rows[2 * i + 1] = (uint8_t) (i >> 8);
 	}
-	else
+	for (uint32_t i = 0; i < 32; i++)
 	{
-		printf("Error: Expecting FileName as argument.\nInvocation:\n\t'%s <file>'.\n", argv[0]);
-		return 1;
+		seed = seed * 1103515245 + 12345;
+		palette[i] = (seed >> 8) & 0x7FFF;
 	}
-	
-	for (;;)
+	for (uint32_t i = 0; i < N_INDICES; i++)
 	{
-		cpu_tick();
-		if (cpu.stopped)
+		seed = seed * 1103515245 + 12345;
+		indices[i] = (seed >> 8) & 0x1F;
+	}
+
+	for (uint32_t v = 0; v < n_variants; v++)
+	{
+		// odd counts cover the scalar tails of the vector loops
+		decode[v](rows, pixels[v], N_TILES - 3);
+		decode[v](&rows[2 * (N_TILES - 3)], &pixels[v][8 * (N_TILES - 3)], 3);
+		color[v](indices, palette, colors[v], N_INDICES);
+		double t = ppu_bench_lines(decode[v], color[v], rows, palette, N_LINES, lines[v]);
+
+		printf("%-6s: %.2f ns/line\n", names[v], t * 1e9);
+		if ((0 != memcmp(pixels[v], pixels[0], sizeof(pixels[0]))) ||
+		    (0 != memcmp(colors[v], colors[0], sizeof(colors[0]))) ||
+		    (0 != memcmp(lines[v], lines[0], sizeof(lines[0]))))
 		{
-			printf("\nCPU Stopped!\n");
-			break;
+			printf("Error: %s differs from scalar.\n", names[v]);
+			ret = 1;
 		}
 	}
+
+	return ret;
 }
+#endif
 
 /*---------------------------------------------------------------------*
  *  eof                                                                *
@@ -0,0 +1,113 @@
+/*---------------------------------------------------------------------*
+ *                                                                     *
+ *                         SM83 Microcontroller                        *
+ *                                                                     *
+ *                                                                     *
+ *       project: Gameboy Color Emulator                               *
+ *   module name: cpu.h                                                *
+ *        author: tstr92                                               *
+ *          date: 2024-04-09                                           *
+ *                                                                     *
+ *---------------------------------------------------------------------*/
+#ifndef CPU_H
+#define CPU_H
+
+/*---------------------------------------------------------------------*
+ *  include files                                                      *
+ *---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdbool.h>
+
+/*---------------------------------------------------------------------*
+ *  global definitions                                                 *
+ *---------------------------------------------------------------------*/
+// frames of cpu_get_frame()
+#define CPU_SCREEN_WIDTH (160)
+#define CPU_SCREEN_HEIGHT (144)
+// PCM of cpu_set_audio(), interleaved stereo frames of 16 bit samples
+#define CPU_AUDIO_RATE (48000)
+
+/*---------------------------------------------------------------------*
+ *  type declarations                                                  *
+ *---------------------------------------------------------------------*/
+/* Complete state of one emulated Game Boy. Instances are independent of
+ * each other, so different instances may run on different threads. */
+typedef struct sm83_s sm83_t;
+
+// cartridge file mapped read-only, shared by all instances using it
+typedef struct cpu_rom_s cpu_rom_t;
+
+// receives the characters written to the putc device at 0xE000, in batches
+typedef void (*cpu_putc_t)(void *ctx, const uint8_t *data, uint32_t len);
+
+// receives the buffer of cpu_set_audio() holding frames stereo frames
+typedef void (*cpu_audio_t)(void *ctx, const int16_t *samples, uint32_t frames);
+
+// time skipped instead of executed, see cpu_get_stats()
+typedef struct
+{
+	uint64_t halt_cycles;	// T-cycles fast-forwarded in HALT
+	uint64_t idle_loops;	// idle loops detected and skipped
+	uint64_t idle_cycles;	// T-cycles fast-forwarded in idle loops
+	uint64_t frames_skipped;	// frames not drawn, see cpu_set_frame_skip()
+} cpu_stats_t;
+
+/*---------------------------------------------------------------------*
+ *  function prototypes                                                *
+ *---------------------------------------------------------------------*/
+sm83_t *cpu_create(void);
+void cpu_destroy(sm83_t *cpu);
+void cpu_init(sm83_t *cpu);
+bool cpu_load_rom(sm83_t *cpu, const uint8_t *rom, uint32_t size);
+bool cpu_load_rom_file(sm83_t *cpu, const char *path);
+cpu_rom_t *cpu_rom_open(const char *path);
+void cpu_rom_close(cpu_rom_t *rom);
+bool cpu_attach_rom(sm83_t *cpu, cpu_rom_t *rom);
+void cpu_set_putc(sm83_t *cpu, cpu_putc_t putc_cb, void *ctx);
+void cpu_set_putc_fd(sm83_t *cpu, int fd);
+void cpu_flush_putc(sm83_t *cpu);
+
+uint8_t cpu_get_memory(sm83_t *cpu, uint16_t addr);
+void cpu_set_memory(sm83_t *cpu, uint16_t addr, uint8_t val);
+
+void cpu_tick(sm83_t *cpu);
+void cpu_run(sm83_t *cpu, uint64_t instructions);
+void cpu_print_state(sm83_t *cpu);
+uint64_t cpu_get_cycles(sm83_t *cpu);
+// T-cycles since cpu_init(), including the fast-forwarded ones
+uint64_t cpu_get_time(sm83_t *cpu);
+void cpu_get_stats(sm83_t *cpu, cpu_stats_t *stats);
+bool cpu_is_stopped(sm83_t *cpu);
+
+/* Last complete frame, CPU_SCREEN_HEIGHT rows of CPU_SCREEN_WIDTH RGB555
+ * pixels (red in the low bits, like the CGB palettes). Stays valid until
+ * the next cpu_run() or cpu_tick(). */
+const uint16_t *cpu_get_frame(sm83_t *cpu);
+uint64_t cpu_get_frame_count(sm83_t *cpu);
+bool cpu_save_frame(sm83_t *cpu, const char *path);
+/* Draws only every nth frame (default 1), 0: none. LY, STAT and the
+ * interrupts keep their timing, cpu_get_frame() draws a skipped frame on
+ * request. Kept by cpu_init(). */
+void cpu_set_frame_skip(sm83_t *cpu, uint32_t n);
+/* Synthesizes the sound into buffer (frames stereo frames at
+ * CPU_AUDIO_RATE), audio_cb gets it whenever it is full and on
+ * cpu_flush_audio(). NULL: no audio (default), the APU then costs nothing
+ * but its register accesses. Kept by cpu_init(). */
+void cpu_set_audio(sm83_t *cpu, int16_t *buffer, uint32_t frames, cpu_audio_t audio_cb, void *ctx);
+void cpu_flush_audio(sm83_t *cpu);
+/* Writes the sound to a WAV file until the next cpu_set_audio() or
+ * cpu_destroy(). */
+bool cpu_save_audio(sm83_t *cpu, const char *path);
+
+void cpu_setup(sm83_t *cpu, uint8_t a, uint8_t f, uint8_t b, uint8_t c, uint8_t d, uint8_t e, uint8_t h, uint8_t l, uint16_t pc, uint16_t sp);
+void cpu_get_state(sm83_t *cpu, uint8_t *a, uint8_t *f, uint8_t *b, uint8_t *c, uint8_t *d, uint8_t *e, uint8_t *h, uint8_t *l, uint16_t *pc, uint16_t *sp);
+
+/*---------------------------------------------------------------------*
+ *  global data                                                        *
+ *---------------------------------------------------------------------*/
+
+#endif /* CPU_H */
+
+/*---------------------------------------------------------------------*
+ *  eof                                                                *
+ *---------------------------------------------------------------------*/
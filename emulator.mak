@@ -10,30 +10,53 @@ BIN	= $(COMPILER)/objcopy
 OUTDIR = .release
 
 DEBUG?=0
+PRINT_PERFORMANCE?=0
+THREADED_DISPATCH?=0
+LAZY_FLAGS?=0
+ALU_TABLES?=0
+DYNAREC?=0
+DYNAREC_VERIFY?=0
+PPU_SIMD?=0
 
 ifeq ($(MAKELEVEL),0)
 	useless := $(shell echo -e "Make Emulator")
 	useless := $(shell mkdir -p $(OUTDIR))
 endif
 
-SRC = cpu.c
+SRC = main.c \
+      cpu.c \
+      batch.c
+
+# everything but the front end, for the benchmark builds
+LIB_SRC = $(filter-out main.c,$(SRC))
 
 OBJS = $(addprefix $(OUTDIR)/,$(SRC:.c=.o))
 
 CFLAGS = \
 		-DDEBUG=$(DEBUG) \
 		-DUSE_0xE000_AS_PUTC_DEVICE=1 \
+		-DPRINT_PERFORMANCE=$(PRINT_PERFORMANCE) \
+		-DUSE_THREADED_DISPATCH=$(THREADED_DISPATCH) \
+		-DUSE_LAZY_FLAGS=$(LAZY_FLAGS) \
+		-DUSE_ALU_TABLES=$(ALU_TABLES) \
+		-DUSE_DYNAREC=$(DYNAREC) \
+		-DDYNAREC_VERIFY=$(DYNAREC_VERIFY) \
+		-DUSE_PPU_SIMD=$(PPU_SIMD) \
 		-ffunction-sections \
 		-fdata-sections \
+		-pthread \
 		-g \
 		-O2
 
 LDFLAGS = \
 		-ffunction-sections \
 		-fdata-sections \
+		-pthread \
 		-Wl,-gc-sections
 
-.PHONY: clean all exe lss
+LIBS = -lm
+
+.PHONY: clean all exe lss dll alu_bench ppu_bench test test_rom
 
 exe: $(OUTDIR)/$(TARGET).exe
 lss: $(OUTDIR)/$(TARGET).lss
@@ -46,7 +69,7 @@ $(OUTDIR)/%.o : %.c
 
 # generate .elf file from objects
 $(OUTDIR)/$(TARGET).elf: $(OBJS)
-	$(CC) $(LDFLAGS) $(OBJS) -o $@
+	$(CC) $(LDFLAGS) $(OBJS) -o $@ $(LIBS)
 
 # generate .lss file from .elf file
 $(OUTDIR)/%.lss: $(OUTDIR)/%.elf
@@ -61,7 +84,23 @@ $(OUTDIR)/%.exe: $(OUTDIR)/%.elf
 	$(BIN) -O binary $< $@
 
 dll:
-	$(CC) -m32 -static-libgcc -shared -DBUILD_TEST_DLL=1 -o $(OUTDIR)/$(TARGET).dll $(SRC)
+	$(CC) -m32 -static-libgcc -shared -DBUILD_TEST_DLL=1 -o $(OUTDIR)/$(TARGET).dll cpu.c
+
+# microbenchmark of the ALU flag helpers vs. the ALU tables
+alu_bench:
+	$(CC) $(CFLAGS) -DBUILD_ALU_BENCHMARK=1 -o $(OUTDIR)/alu_bench.exe $(LIB_SRC) $(LIBS)
+
+# microbenchmark of the scalar vs. the SIMD tile decoding, see PPU_SIMD
+ppu_bench:
+	$(CC) $(CFLAGS) -DBUILD_PPU_BENCHMARK=1 -o $(OUTDIR)/ppu_bench.exe $(LIB_SRC) $(LIBS)
+
+# native runner for the sm83 cpu tests, see test_cpu.c
+test:
+	$(CC) $(CFLAGS) -DBUILD_TEST_DLL=1 -o $(OUTDIR)/test_cpu.exe cpu.c test_cpu.c
+
+# regression tests of the emulator on small built-in ROMs, see test_rom.c
+test_rom:
+	$(CC) $(CFLAGS) -o $(OUTDIR)/test_rom.exe cpu.c test_rom.c $(LIBS)
 
 clean:
 	rm -rf $(OUTDIR)
@@ -1,6 +1,6 @@
 # Makefile gb
 
-TARGET=gb
+TARGET?=gb
 
 COMPILER = "/c/Program Files (x86)/SDCC/bin"
 MAKEBIN = $(COMPILER)/makebin
@@ -9,11 +9,11 @@ CC = $(COMPILER)/sdcc
 OUTDIR = .$(TARGET)
 
 ifeq ($(MAKELEVEL),0)
-	useless := $(shell echo -e "Make gb")
+	useless := $(shell echo -e "Make $(TARGET)")
 	useless := $(shell mkdir -p $(OUTDIR))
 endif
 
-SRC = gb.c\
+SRC = $(TARGET).c\
 
 CFLAGS = -msm83 \
 
@@ -27,9 +27,9 @@ compile:
 	@echo "compiling $< ..."
 	$(CC) $(CFLAGS) $(CFLAGS) $(SRC) -o $(OUTDIR)/$(TARGET).ihx
 
-bin: compile $(OUTDIR)/gb.bin
+bin: compile $(OUTDIR)/$(TARGET).bin
 
-$(OUTDIR)/gb.bin: $(OUTDIR)/gb.ihx
+$(OUTDIR)/$(TARGET).bin: $(OUTDIR)/$(TARGET).ihx
 	@echo "generating $@ ..."
 	$(MAKEBIN) $< $@
 
@@ -0,0 +1,99 @@
+/*---------------------------------------------------------------------*
+ *                                                                     *
+ *                         Emulator Front End                          *
+ *                                                                     *
+ *                                                                     *
+ *       project: Gameboy Color Emulator                               *
+ *   module name: main.c                                               *
+ *        author: tstr92                                               *
+ *          date: 2024-04-09                                           *
+ *                                                                     *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  include files                                                      *
+ *---------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include "cpu.h"
+#include "batch.h"
+
+/*---------------------------------------------------------------------*
+ *  global functions                                                   *
+ *---------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+	if ((2 <= argc) && (0 == strcmp(argv[1], "--batch")))
+	{
+		return batch_main(argc - 1, &argv[1]);
+	}
+
+	sm83_t *cpu = cpu_create();
+
+	if (NULL == cpu)
+	{
+		return 1;
+	}
+
+	if ((2 <= argc) && (argc <= 4))
+	{
+		char *FileName  = argv[1];
+		if (!cpu_load_rom_file(cpu, FileName))
+		{
+			printf("Error: Could not load file '%s'.\n", FileName);
+			cpu_destroy(cpu);
+			return 1;
+		}
+	}
+	else
+	{
+		printf("Error: Expecting FileName as argument.\nInvocation:\n\t'%s <file> [frame.ppm [audio.wav]]'.\n", argv[0]);
+		cpu_destroy(cpu);
+		return 1;
+	}
+
+	if ((4 == argc) && !cpu_save_audio(cpu, argv[3]))
+	{
+		cpu_destroy(cpu);
+		return 1;
+	}
+
+#if (0 < PRINT_PERFORMANCE)
+	clock_t start = clock();
+#endif
+
+	cpu_run(cpu, UINT64_MAX);
+	printf("\nCPU Stopped!\n");
+
+#if (0 < PRINT_PERFORMANCE)
+	double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+	uint64_t frames = cpu_get_frame_count(cpu);
+	uint64_t instructions = cpu_get_cycles(cpu);
+	cpu_stats_t stats;
+	cpu_get_stats(cpu, &stats);
+	printf("%llu T-cycles, %llu in HALT, %llu in %llu idle loops\n", (unsigned long long) cpu_get_time(cpu),
+	       (unsigned long long) stats.halt_cycles, (unsigned long long) stats.idle_cycles,
+	       (unsigned long long) stats.idle_loops);
+	printf("%llu frames (%.0f fps), %llu not drawn\n", (unsigned long long) frames,
+	       (double) frames / seconds, (unsigned long long) stats.frames_skipped);
+	printf("%llu instructions in %.3f s (%.2f MIPS)\n", (unsigned long long) instructions,
+	       seconds, (double) instructions / seconds / 1e6);
+#endif
+
+	if ((3 <= argc) && !cpu_save_frame(cpu, argv[2]))
+	{
+		cpu_destroy(cpu);
+		return 1;
+	}
+
+	cpu_destroy(cpu);
+	return 0;
+}
+
+/*---------------------------------------------------------------------*
+ *  eof                                                                *
+ *---------------------------------------------------------------------*/
@@ -0,0 +1,1166 @@
+/*---------------------------------------------------------------------*
+ *                                                                     *
+ *                         SM83 CPU Test Runner                        *
+ *                                                                     *
+ *                                                                     *
+ *       project: Gameboy Color Emulator                               *
+ *   module name: test_cpu.c                                           *
+ *        author: tstr92                                               *
+ *          date: 2024-04-09                                           *
+ *                                                                     *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  include files                                                      *
+ *---------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#include "cpu.h"
+
+/*---------------------------------------------------------------------*
+ *  local definitions                                                  *
+ *---------------------------------------------------------------------*/
+#define TEST_DEFAULT_PATH "sm83-test-data-master/cpu_tests/v1"
+#define TEST_MAX_RAM (32)	// RAM entries per state
+#define TEST_CHUNK (256)	// vectors per work item
+#define TEST_MAX_THREADS (256)
+#define TEST_BIN_MAGIC "SM83TV01"
+
+/*---------------------------------------------------------------------*
+ *  local data types                                                   *
+ *---------------------------------------------------------------------*/
+typedef struct
+{
+	uint8_t a, f, b, c, d, e, h, l;
+	uint16_t pc, sp;
+	uint32_t n_ram;
+	uint16_t ram_addr[TEST_MAX_RAM];
+	uint8_t ram_val[TEST_MAX_RAM];
+} test_state_t;
+
+typedef struct
+{
+	char name[64];
+	test_state_t initial;
+	test_state_t final;
+} test_vector_t;
+
+/* Precompiled test vectors, written by test_compile() and used in place
+ * after mapping the file. Little endian, every part is 4 byte aligned:
+ *   test_bin_header_t
+ *   test_bin_index_t[n_index]      one entry per opcode file
+ *   test_bin_vector_t[n_vectors]   vectors of all files, in index order
+ *   test_bin_ram_t[n_ram]          initial then final RAM of each vector */
+typedef struct
+{
+	char magic[8];
+	uint32_t n_index;
+	uint32_t n_vectors;
+	uint32_t n_ram;
+	uint32_t reserved;
+} test_bin_header_t;
+
+typedef struct
+{
+	char name[16];			// file name without ".json", zero terminated
+	uint32_t first;
+	uint32_t count;
+} test_bin_index_t;
+
+typedef struct
+{
+	uint8_t a, f, b, c, d, e, h, l;
+	uint16_t pc, sp;
+} test_bin_regs_t;
+
+typedef struct
+{
+	test_bin_regs_t initial;
+	test_bin_regs_t final;
+	uint32_t ram;			// first entry in the RAM table
+	uint8_t n_initial;
+	uint8_t n_final;
+	uint16_t reserved;
+} test_bin_vector_t;
+
+typedef struct
+{
+	uint16_t addr;
+	uint8_t val;
+	uint8_t reserved;
+} test_bin_ram_t;
+
+typedef struct
+{
+	uint32_t vector;
+	test_state_t result;	// RAM holds the values read back at the expected addresses
+} test_failure_t;
+
+typedef struct
+{
+	char *name;
+	test_vector_t *vectors;
+	uint32_t n_vectors;
+	uint32_t first;			// first vector in the binary file
+	bool error;				// file could not be read or parsed
+} test_file_t;
+
+// vectors [first, first + count) of one file
+typedef struct
+{
+	uint32_t file;
+	uint32_t first;
+	uint32_t count;
+	uint32_t passed;
+	test_failure_t *failures;
+	uint32_t n_failures;
+} test_chunk_t;
+
+/* Files are parsed in parallel, then all vectors are split into chunks
+ * that the workers take one by one, each with its own sm83_t. */
+typedef struct
+{
+	const char *dir;
+	test_file_t *files;
+	uint32_t n_files;
+	test_chunk_t *chunks;
+	uint32_t n_chunks;
+	uint32_t next;			// next file or chunk to take
+	const test_bin_vector_t *bin_vectors;	// set when running a binary file
+	const test_bin_ram_t *bin_ram;
+	void *map;
+	size_t map_size;
+} test_suite_t;
+
+/* The JSON is parsed in a single pass straight into test_vector_t, no
+ * document tree is built. */
+typedef struct
+{
+	const char *p;
+	const char *end;
+	bool error;
+} test_parser_t;
+
+/*---------------------------------------------------------------------*
+ *  external declarations                                              *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  public data                                                        *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  private data                                                       *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  private function declarations                                      *
+ *---------------------------------------------------------------------*/
+static void test_skip_value(test_parser_t *ps);
+
+/*---------------------------------------------------------------------*
+ *  private functions                                                  *
+ *---------------------------------------------------------------------*/
+static void test_skip_ws(test_parser_t *ps)
+{
+	while ((ps->p < ps->end) &&
+	       ((' ' == *ps->p) || ('\n' == *ps->p) || ('\r' == *ps->p) || ('\t' == *ps->p)))
+	{
+		ps->p++;
+	}
+}
+
+// consumes c (after whitespace), returns false if the next character differs
+static bool test_accept(test_parser_t *ps, char c)
+{
+	test_skip_ws(ps);
+	if ((ps->p < ps->end) && (c == *ps->p))
+	{
+		ps->p++;
+		return true;
+	}
+	return false;
+}
+
+static void test_expect(test_parser_t *ps, char c)
+{
+	if (!test_accept(ps, c))
+	{
+		ps->error = true;
+	}
+}
+
+// returns the raw string contents, escapes are not resolved
+static const char *test_parse_string(test_parser_t *ps, uint32_t *len)
+{
+	const char *start;
+
+	test_expect(ps, '"');
+	start = ps->p;
+	while ((ps->p < ps->end) && ('"' != *ps->p))
+	{
+		ps->p += ('\\' == *ps->p) ? 2 : 1;
+	}
+	if (ps->p >= ps->end)
+	{
+		ps->error = true;
+		*len = 0;
+		return start;
+	}
+	*len = ps->p - start;
+	ps->p++;
+
+	return start;
+}
+
+// "0x1f" (v1) and 31 (v2) are both accepted
+static uint32_t test_parse_uint(test_parser_t *ps)
+{
+	uint32_t val = 0;
+	int base = 10;
+
+	test_skip_ws(ps);
+	if ((ps->p < ps->end) && ('"' == *ps->p))
+	{
+		ps->p++;
+		base = 16;
+		if (((ps->p + 1) < ps->end) && ('0' == ps->p[0]) && (('x' == ps->p[1]) || ('X' == ps->p[1])))
+		{
+			ps->p += 2;
+		}
+	}
+
+	while (ps->p < ps->end)
+	{
+		char c = *ps->p;
+		uint32_t digit;
+		if (('0' <= c) && (c <= '9'))
+		{
+			digit = c - '0';
+		}
+		else if ((16 == base) && ('a' <= (c | 0x20)) && ((c | 0x20) <= 'f'))
+		{
+			digit = (c | 0x20) - 'a' + 10;
+		}
+		else
+		{
+			break;
+		}
+		val = val * base + digit;
+		ps->p++;
+	}
+
+	if (16 == base)
+	{
+		test_expect(ps, '"');
+	}
+
+	return val;
+}
+
+static void test_skip_value(test_parser_t *ps)
+{
+	uint32_t len;
+
+	test_skip_ws(ps);
+	if (ps->p >= ps->end)
+	{
+		ps->error = true;
+		return;
+	}
+
+	switch (*ps->p)
+	{
+	case '"':
+		test_parse_string(ps, &len);
+		break;
+
+	case '{':
+		ps->p++;
+		if (!test_accept(ps, '}'))
+		{
+			do
+			{
+				test_parse_string(ps, &len);
+				test_expect(ps, ':');
+				test_skip_value(ps);
+			} while (!ps->error && test_accept(ps, ','));
+			test_expect(ps, '}');
+		}
+		break;
+
+	case '[':
+		ps->p++;
+		if (!test_accept(ps, ']'))
+		{
+			do
+			{
+				test_skip_value(ps);
+			} while (!ps->error && test_accept(ps, ','));
+			test_expect(ps, ']');
+		}
+		break;
+
+	default:
+		// number, true, false, null
+		while ((ps->p < ps->end) && (NULL == strchr(",]} \t\r\n", *ps->p)))
+		{
+			ps->p++;
+		}
+		break;
+	}
+}
+
+static bool test_key_is(const char *key, uint32_t len, const char *name)
+{
+	return (strlen(name) == len) && (0 == memcmp(key, name, len));
+}
+
+// [["0xc000", "0x12"], ...] or [[49152, 18], ...]
+static void test_parse_ram(test_parser_t *ps, test_state_t *state)
+{
+	test_expect(ps, '[');
+	if (test_accept(ps, ']'))
+	{
+		return;
+	}
+
+	do
+	{
+		uint32_t addr, val;
+		test_expect(ps, '[');
+		addr = test_parse_uint(ps);
+		test_expect(ps, ',');
+		val = test_parse_uint(ps);
+		test_expect(ps, ']');
+		if (TEST_MAX_RAM <= state->n_ram)
+		{
+			ps->error = true;
+			return;
+		}
+		state->ram_addr[state->n_ram] = addr;
+		state->ram_val[state->n_ram] = val;
+		state->n_ram++;
+	} while (!ps->error && test_accept(ps, ','));
+
+	test_expect(ps, ']');
+}
+
+/* Registers and RAM, either nested as {"cpu": {...}, "ram": [...]} (v1)
+ * or flat as {"a": ..., "ram": [...]} (v2). */
+static void test_parse_state(test_parser_t *ps, test_state_t *state)
+{
+	uint32_t len;
+
+	test_expect(ps, '{');
+	if (test_accept(ps, '}'))
+	{
+		return;
+	}
+
+	do
+	{
+		const char *key = test_parse_string(ps, &len);
+		test_expect(ps, ':');
+
+		if (test_key_is(key, len, "cpu"))
+		{
+			test_parse_state(ps, state);
+		}
+		else if (test_key_is(key, len, "ram"))
+		{
+			test_parse_ram(ps, state);
+		}
+		else if (test_key_is(key, len, "a")) { state->a = test_parse_uint(ps); }
+		else if (test_key_is(key, len, "f")) { state->f = test_parse_uint(ps); }
+		else if (test_key_is(key, len, "b")) { state->b = test_parse_uint(ps); }
+		else if (test_key_is(key, len, "c")) { state->c = test_parse_uint(ps); }
+		else if (test_key_is(key, len, "d")) { state->d = test_parse_uint(ps); }
+		else if (test_key_is(key, len, "e")) { state->e = test_parse_uint(ps); }
+		else if (test_key_is(key, len, "h")) { state->h = test_parse_uint(ps); }
+		else if (test_key_is(key, len, "l")) { state->l = test_parse_uint(ps); }
+		else if (test_key_is(key, len, "pc")) { state->pc = test_parse_uint(ps); }
+		else if (test_key_is(key, len, "sp")) { state->sp = test_parse_uint(ps); }
+		else
+		{
+			test_skip_value(ps);
+		}
+	} while (!ps->error && test_accept(ps, ','));
+
+	test_expect(ps, '}');
+}
+
+static void test_parse_vector(test_parser_t *ps, test_vector_t *vector)
+{
+	uint32_t len;
+
+	memset(vector, 0, sizeof(*vector));
+	test_expect(ps, '{');
+	if (test_accept(ps, '}'))
+	{
+		return;
+	}
+
+	do
+	{
+		const char *key = test_parse_string(ps, &len);
+		test_expect(ps, ':');
+
+		if (test_key_is(key, len, "name"))
+		{
+			const char *name = test_parse_string(ps, &len);
+			len = (len < sizeof(vector->name)) ? len : (sizeof(vector->name) - 1);
+			memcpy(vector->name, name, len);
+		}
+		else if (test_key_is(key, len, "initial"))
+		{
+			test_parse_state(ps, &vector->initial);
+		}
+		else if (test_key_is(key, len, "final"))
+		{
+			test_parse_state(ps, &vector->final);
+		}
+		else
+		{
+			test_skip_value(ps);
+		}
+	} while (!ps->error && test_accept(ps, ','));
+
+	test_expect(ps, '}');
+}
+
+static void test_print_failure(const test_file_t *file, const test_vector_t *vector, const test_failure_t *failure)
+{
+	const test_state_t *exp = &vector->final;
+	const test_state_t *res = &failure->result;
+
+	printf("FAIL %s '%s':", file->name, vector->name);
+#define TEST_CHECK(_reg, _fmt) \
+	if (res->_reg != exp->_reg) \
+	{ \
+		printf(" " #_reg "=" _fmt " (expected " _fmt ")", res->_reg, exp->_reg); \
+	}
+	TEST_CHECK(a, "%02x")
+	TEST_CHECK(f, "%02x")
+	TEST_CHECK(b, "%02x")
+	TEST_CHECK(c, "%02x")
+	TEST_CHECK(d, "%02x")
+	TEST_CHECK(e, "%02x")
+	TEST_CHECK(h, "%02x")
+	TEST_CHECK(l, "%02x")
+	TEST_CHECK(pc, "%04x")
+	TEST_CHECK(sp, "%04x")
+#undef TEST_CHECK
+	for (uint32_t i = 0; i < exp->n_ram; i++)
+	{
+		if (res->ram_val[i] != exp->ram_val[i])
+		{
+			printf(" @%04x=%02x (expected %02x)", exp->ram_addr[i], res->ram_val[i], exp->ram_val[i]);
+		}
+	}
+	printf("\n");
+}
+
+static bool test_run_vector(sm83_t *cpu, const test_vector_t *vector, test_state_t *result)
+{
+	const test_state_t *init = &vector->initial;
+	const test_state_t *exp = &vector->final;
+	bool success;
+
+	cpu_setup(cpu, init->a, init->f, init->b, init->c, init->d, init->e, init->h, init->l, init->pc, init->sp);
+	for (uint32_t i = 0; i < init->n_ram; i++)
+	{
+		cpu_set_memory(cpu, init->ram_addr[i], init->ram_val[i]);
+	}
+
+	cpu_tick(cpu);
+
+	cpu_get_state(cpu, &result->a, &result->f, &result->b, &result->c, &result->d,
+	              &result->e, &result->h, &result->l, &result->pc, &result->sp);
+
+	success = (result->a == exp->a) && (result->f == exp->f) &&
+	          (result->b == exp->b) && (result->c == exp->c) &&
+	          (result->d == exp->d) && (result->e == exp->e) &&
+	          (result->h == exp->h) && (result->l == exp->l) &&
+	          (result->pc == exp->pc) && (result->sp == exp->sp);
+
+	result->n_ram = exp->n_ram;
+	for (uint32_t i = 0; i < exp->n_ram; i++)
+	{
+		result->ram_addr[i] = exp->ram_addr[i];
+		result->ram_val[i] = cpu_get_memory(cpu, exp->ram_addr[i]);
+		success = success && (result->ram_val[i] == exp->ram_val[i]);
+	}
+
+	return success;
+}
+
+static void test_bin_regs(test_bin_regs_t *regs, const test_state_t *state)
+{
+	regs->a = state->a;
+	regs->f = state->f;
+	regs->b = state->b;
+	regs->c = state->c;
+	regs->d = state->d;
+	regs->e = state->e;
+	regs->h = state->h;
+	regs->l = state->l;
+	regs->pc = state->pc;
+	regs->sp = state->sp;
+}
+
+static void test_bin_state(test_state_t *state, const test_bin_regs_t *regs, const test_bin_ram_t *ram, uint32_t n_ram)
+{
+	state->a = regs->a;
+	state->f = regs->f;
+	state->b = regs->b;
+	state->c = regs->c;
+	state->d = regs->d;
+	state->e = regs->e;
+	state->h = regs->h;
+	state->l = regs->l;
+	state->pc = regs->pc;
+	state->sp = regs->sp;
+	state->n_ram = n_ram;
+	for (uint32_t i = 0; i < n_ram; i++)
+	{
+		state->ram_addr[i] = ram[i].addr;
+		state->ram_val[i] = ram[i].val;
+	}
+}
+
+// converts a binary vector back, only needed to report a failure
+static void test_bin_unpack(const test_suite_t *suite, const test_file_t *file, uint32_t index, test_vector_t *vector)
+{
+	const test_bin_vector_t *bin = &suite->bin_vectors[file->first + index];
+	const test_bin_ram_t *ram = &suite->bin_ram[bin->ram];
+
+	snprintf(vector->name, sizeof(vector->name), "%s #%u", file->name, index);
+	test_bin_state(&vector->initial, &bin->initial, ram, bin->n_initial);
+	test_bin_state(&vector->final, &bin->final, &ram[bin->n_initial], bin->n_final);
+}
+
+static bool test_run_bin_vector(sm83_t *cpu, const test_bin_vector_t *vector, const test_bin_ram_t *ram)
+{
+	const test_bin_regs_t *init = &vector->initial;
+	const test_bin_regs_t *exp = &vector->final;
+	test_bin_regs_t res;
+	bool success;
+
+	ram = &ram[vector->ram];
+	cpu_setup(cpu, init->a, init->f, init->b, init->c, init->d, init->e, init->h, init->l, init->pc, init->sp);
+	for (uint32_t i = 0; i < vector->n_initial; i++)
+	{
+		cpu_set_memory(cpu, ram[i].addr, ram[i].val);
+	}
+
+	cpu_tick(cpu);
+
+	cpu_get_state(cpu, &res.a, &res.f, &res.b, &res.c, &res.d, &res.e, &res.h, &res.l, &res.pc, &res.sp);
+	success = (res.a == exp->a) && (res.f == exp->f) &&
+	          (res.b == exp->b) && (res.c == exp->c) &&
+	          (res.d == exp->d) && (res.e == exp->e) &&
+	          (res.h == exp->h) && (res.l == exp->l) &&
+	          (res.pc == exp->pc) && (res.sp == exp->sp);
+
+	ram = &ram[vector->n_initial];
+	for (uint32_t i = 0; (i < vector->n_final) && success; i++)
+	{
+		success = (cpu_get_memory(cpu, ram[i].addr) == ram[i].val);
+	}
+
+	return success;
+}
+
+static char *test_read_file(const char *path, uint32_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	char *data;
+	long len;
+
+	if (NULL == file)
+	{
+		printf("Error: Could not open file '%s'.\n", path);
+		return NULL;
+	}
+
+	fseek(file, 0, SEEK_END);
+	len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	data = malloc((0 < len) ? len : 1);
+	if ((NULL == data) || (len != (long) fread(data, 1, len, file)))
+	{
+		printf("Error: Could not read file '%s'.\n", path);
+		free(data);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+
+	*size = len;
+	return data;
+}
+
+static void test_parse_file(const char *dir, test_file_t *file)
+{
+	char path[1024];
+	uint32_t size;
+	uint32_t n_alloc = 0;
+	char *data;
+	test_parser_t ps;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file->name);
+	data = test_read_file(path, &size);
+	if (NULL == data)
+	{
+		file->error = true;
+		return;
+	}
+
+	ps.p = data;
+	ps.end = data + size;
+	ps.error = false;
+
+	test_expect(&ps, '[');
+	if (!test_accept(&ps, ']'))
+	{
+		do
+		{
+			if (file->n_vectors == n_alloc)
+			{
+				n_alloc = (0 == n_alloc) ? 1024 : (2 * n_alloc);
+				test_vector_t *tmp = realloc(file->vectors, n_alloc * sizeof(*tmp));
+				if (NULL == tmp)
+				{
+					ps.error = true;
+					break;
+				}
+				file->vectors = tmp;
+			}
+			test_parse_vector(&ps, &file->vectors[file->n_vectors]);
+			if (ps.error)
+			{
+				break;
+			}
+			file->n_vectors++;
+		} while (test_accept(&ps, ','));
+		test_expect(&ps, ']');
+	}
+
+	if (ps.error)
+	{
+		printf("%s: parse error at byte %lu\n", file->name, (unsigned long) (ps.p - data));
+		file->error = true;
+	}
+	free(data);
+}
+
+static void test_run_chunk(sm83_t *cpu, test_suite_t *suite, test_chunk_t *chunk)
+{
+	const test_file_t *file = &suite->files[chunk->file];
+	test_vector_t vector;
+	test_state_t result;
+
+	for (uint32_t i = chunk->first; i < (chunk->first + chunk->count); i++)
+	{
+		if (NULL != suite->bin_vectors)
+		{
+			if (test_run_bin_vector(cpu, &suite->bin_vectors[file->first + i], suite->bin_ram))
+			{
+				chunk->passed++;
+				continue;
+			}
+			// run it again to collect the complete result
+			test_bin_unpack(suite, file, i, &vector);
+			test_run_vector(cpu, &vector, &result);
+		}
+		else if (test_run_vector(cpu, &file->vectors[i], &result))
+		{
+			chunk->passed++;
+			continue;
+		}
+
+		test_failure_t *tmp = realloc(chunk->failures, (chunk->n_failures + 1) * sizeof(*tmp));
+		if (NULL != tmp)
+		{
+			chunk->failures = tmp;
+			chunk->failures[chunk->n_failures].vector = i;
+			chunk->failures[chunk->n_failures].result = result;
+			chunk->n_failures++;
+		}
+	}
+}
+
+static void *test_parse_worker(void *arg)
+{
+	test_suite_t *suite = arg;
+	uint32_t i;
+
+	while ((i = __atomic_fetch_add(&suite->next, 1, __ATOMIC_RELAXED)) < suite->n_files)
+	{
+		test_parse_file(suite->dir, &suite->files[i]);
+	}
+
+	return NULL;
+}
+
+static void *test_run_worker(void *arg)
+{
+	test_suite_t *suite = arg;
+	sm83_t *cpu = cpu_create();
+	uint32_t i;
+
+	if (NULL == cpu)
+	{
+		return NULL;
+	}
+
+	while ((i = __atomic_fetch_add(&suite->next, 1, __ATOMIC_RELAXED)) < suite->n_chunks)
+	{
+		test_run_chunk(cpu, suite, &suite->chunks[i]);
+	}
+
+	cpu_destroy(cpu);
+	return NULL;
+}
+
+static void test_parallel(test_suite_t *suite, void *(*worker)(void *), uint32_t n_threads)
+{
+	pthread_t threads[TEST_MAX_THREADS];
+
+	suite->next = 0;
+	for (uint32_t t = 0; t < n_threads; t++)
+	{
+		pthread_create(&threads[t], NULL, worker, suite);
+	}
+	for (uint32_t t = 0; t < n_threads; t++)
+	{
+		pthread_join(threads[t], NULL);
+	}
+}
+
+static bool test_build_chunks(test_suite_t *suite)
+{
+	uint32_t n = 0;
+
+	for (uint32_t i = 0; i < suite->n_files; i++)
+	{
+		n += (suite->files[i].n_vectors + TEST_CHUNK - 1) / TEST_CHUNK;
+	}
+
+	suite->chunks = calloc((0 < n) ? n : 1, sizeof(*suite->chunks));
+	if (NULL == suite->chunks)
+	{
+		return false;
+	}
+
+	for (uint32_t i = 0; i < suite->n_files; i++)
+	{
+		for (uint32_t first = 0; first < suite->files[i].n_vectors; first += TEST_CHUNK)
+		{
+			test_chunk_t *chunk = &suite->chunks[suite->n_chunks++];
+			chunk->file = i;
+			chunk->first = first;
+			chunk->count = suite->files[i].n_vectors - first;
+			chunk->count = (TEST_CHUNK < chunk->count) ? TEST_CHUNK : chunk->count;
+		}
+	}
+
+	return true;
+}
+
+static bool test_compile(const test_suite_t *suite, const char *path)
+{
+	test_bin_header_t header;
+	FILE *out;
+	uint32_t ram = 0;
+	bool ok = true;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TEST_BIN_MAGIC, sizeof(header.magic));
+	header.n_index = suite->n_files;
+	for (uint32_t i = 0; i < suite->n_files; i++)
+	{
+		header.n_vectors += suite->files[i].n_vectors;
+		for (uint32_t v = 0; v < suite->files[i].n_vectors; v++)
+		{
+			header.n_ram += suite->files[i].vectors[v].initial.n_ram + suite->files[i].vectors[v].final.n_ram;
+		}
+	}
+
+	out = fopen(path, "wb");
+	if (NULL == out)
+	{
+		printf("Error: Could not create file '%s'.\n", path);
+		return false;
+	}
+	ok = ok && (1 == fwrite(&header, sizeof(header), 1, out));
+
+	for (uint32_t i = 0, first = 0; i < suite->n_files; i++)
+	{
+		test_bin_index_t index;
+		size_t len = strlen(suite->files[i].name) - strlen(".json");
+
+		memset(&index, 0, sizeof(index));
+		memcpy(index.name, suite->files[i].name, (len < sizeof(index.name)) ? len : (sizeof(index.name) - 1));
+		index.first = first;
+		index.count = suite->files[i].n_vectors;
+		first += index.count;
+		ok = ok && (1 == fwrite(&index, sizeof(index), 1, out));
+	}
+
+	for (uint32_t i = 0; i < suite->n_files; i++)
+	{
+		for (uint32_t v = 0; v < suite->files[i].n_vectors; v++)
+		{
+			const test_vector_t *vector = &suite->files[i].vectors[v];
+			test_bin_vector_t bin;
+
+			memset(&bin, 0, sizeof(bin));
+			test_bin_regs(&bin.initial, &vector->initial);
+			test_bin_regs(&bin.final, &vector->final);
+			bin.ram = ram;
+			bin.n_initial = vector->initial.n_ram;
+			bin.n_final = vector->final.n_ram;
+			ram += bin.n_initial + bin.n_final;
+			ok = ok && (1 == fwrite(&bin, sizeof(bin), 1, out));
+		}
+	}
+
+	for (uint32_t i = 0; i < suite->n_files; i++)
+	{
+		for (uint32_t v = 0; v < suite->files[i].n_vectors; v++)
+		{
+			const test_state_t *states[2] = {&suite->files[i].vectors[v].initial, &suite->files[i].vectors[v].final};
+			for (uint32_t s = 0; s < 2; s++)
+			{
+				for (uint32_t r = 0; r < states[s]->n_ram; r++)
+				{
+					test_bin_ram_t entry = {states[s]->ram_addr[r], states[s]->ram_val[r], 0};
+					ok = ok && (1 == fwrite(&entry, sizeof(entry), 1, out));
+				}
+			}
+		}
+	}
+
+	ok = (0 == fclose(out)) && ok;
+	if (!ok)
+	{
+		printf("Error: Could not write file '%s'.\n", path);
+	}
+	else
+	{
+		printf("%s: %u vectors of %u files, %lu bytes\n", path, header.n_vectors, header.n_index,
+		       (unsigned long) (sizeof(header) + header.n_index * sizeof(test_bin_index_t) +
+		                        header.n_vectors * sizeof(test_bin_vector_t) + header.n_ram * sizeof(test_bin_ram_t)));
+	}
+	return ok;
+}
+
+static void test_unmap(test_suite_t *suite)
+{
+	if (NULL == suite->map)
+	{
+		return;
+	}
+#if defined(_WIN32)
+	UnmapViewOfFile(suite->map);
+#else
+	munmap(suite->map, suite->map_size);
+#endif
+	suite->map = NULL;
+}
+
+static bool test_map(test_suite_t *suite, const char *path)
+{
+	const test_bin_header_t *header;
+	const test_bin_index_t *index;
+	size_t size;
+
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	HANDLE mapping = NULL;
+	LARGE_INTEGER len;
+
+	if ((INVALID_HANDLE_VALUE != file) && GetFileSizeEx(file, &len))
+	{
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+	if (NULL != mapping)
+	{
+		suite->map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		suite->map_size = len.QuadPart;
+		CloseHandle(mapping);
+	}
+	if (INVALID_HANDLE_VALUE != file)
+	{
+		CloseHandle(file);
+	}
+#else
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+
+	if ((0 <= fd) && (0 == fstat(fd, &st)) && (0 < st.st_size))
+	{
+		suite->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		suite->map = (MAP_FAILED == suite->map) ? NULL : suite->map;
+		suite->map_size = st.st_size;
+	}
+	if (0 <= fd)
+	{
+		close(fd);
+	}
+#endif
+	if (NULL == suite->map)
+	{
+		printf("Error: Could not map file '%s'.\n", path);
+		return false;
+	}
+
+	// check that all tables lie within the file before using them in place
+	header = suite->map;
+	size = suite->map_size;
+	if ((size < sizeof(*header)) || (0 != memcmp(header->magic, TEST_BIN_MAGIC, sizeof(header->magic))) ||
+	    ((size - sizeof(*header)) / sizeof(test_bin_index_t) < header->n_index) ||
+	    (((size - sizeof(*header) - header->n_index * sizeof(test_bin_index_t)) / sizeof(test_bin_vector_t)) < header->n_vectors) ||
+	    (((size - sizeof(*header) - header->n_index * sizeof(test_bin_index_t) - header->n_vectors * sizeof(test_bin_vector_t)) /
+	      sizeof(test_bin_ram_t)) < header->n_ram))
+	{
+		printf("Error: '%s' is not a valid test vector file.\n", path);
+		test_unmap(suite);
+		return false;
+	}
+	index = (const test_bin_index_t *) &header[1];
+	suite->bin_vectors = (const test_bin_vector_t *) &index[header->n_index];
+	suite->bin_ram = (const test_bin_ram_t *) &suite->bin_vectors[header->n_vectors];
+
+	for (uint32_t v = 0; v < header->n_vectors; v++)
+	{
+		const test_bin_vector_t *vector = &suite->bin_vectors[v];
+		if ((TEST_MAX_RAM < vector->n_initial) || (TEST_MAX_RAM < vector->n_final) ||
+		    (header->n_ram < vector->ram) || ((header->n_ram - vector->ram) < (uint32_t) (vector->n_initial + vector->n_final)))
+		{
+			printf("Error: '%s' is not a valid test vector file.\n", path);
+			test_unmap(suite);
+			return false;
+		}
+	}
+
+	suite->files = calloc((0 < header->n_index) ? header->n_index : 1, sizeof(*suite->files));
+	if (NULL == suite->files)
+	{
+		test_unmap(suite);
+		return false;
+	}
+	for (uint32_t i = 0; i < header->n_index; i++)
+	{
+		test_file_t *file = &suite->files[suite->n_files++];
+		file->name = strndup(index[i].name, sizeof(index[i].name));
+		file->first = index[i].first;
+		file->n_vectors = index[i].count;
+		if ((header->n_vectors < file->first) || ((header->n_vectors - file->first) < file->n_vectors))
+		{
+			file->n_vectors = 0;
+			file->error = true;
+		}
+	}
+
+	return true;
+}
+
+static bool test_scan_dir(test_suite_t *suite)
+{
+	DIR *dir = opendir(suite->dir);
+	struct dirent *entry;
+
+	if (NULL == dir)
+	{
+		return false;
+	}
+
+	while (NULL != (entry = readdir(dir)))
+	{
+		size_t len = strlen(entry->d_name);
+		if ((5 < len) && (0 == strcmp(&entry->d_name[len - 5], ".json")))
+		{
+			test_file_t *tmp = realloc(suite->files, (suite->n_files + 1) * sizeof(*tmp));
+			if (NULL == tmp)
+			{
+				closedir(dir);
+				return false;
+			}
+			suite->files = tmp;
+			memset(&suite->files[suite->n_files], 0, sizeof(*tmp));
+			suite->files[suite->n_files++].name = strdup(entry->d_name);
+		}
+	}
+	closedir(dir);
+
+	return true;
+}
+
+static uint32_t test_cores(void)
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (0 < n) ? (uint32_t) n : 1;
+#endif
+}
+
+static double test_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int test_compare_names(const void *a, const void *b)
+{
+	return strcmp(((const test_file_t *) a)->name, ((const test_file_t *) b)->name);
+}
+
+/*---------------------------------------------------------------------*
+ *  public functions                                                   *
+ *---------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+	test_suite_t suite;
+	uint32_t n_threads = test_cores();
+	const char *compile = NULL;
+	struct stat st;
+	uint32_t passed = 0;
+	uint32_t total = 0;
+	uint32_t failed_files = 0;
+	double start, t_parse, t_run;
+
+	memset(&suite, 0, sizeof(suite));
+	suite.dir = TEST_DEFAULT_PATH;
+	for (int i = 1; i < argc; i++)
+	{
+		if ((0 == strcmp(argv[i], "-j")) && (i + 1 < argc))
+		{
+			n_threads = strtoul(argv[++i], NULL, 0);
+		}
+		else if ((0 == strcmp(argv[i], "-c")) && (i + 1 < argc))
+		{
+			compile = argv[++i];
+		}
+		else
+		{
+			suite.dir = argv[i];
+		}
+	}
+
+	if ((0 == n_threads) || (TEST_MAX_THREADS < n_threads) || (0 != stat(suite.dir, &st)))
+	{
+		printf("Error: Could not open '%s'.\nInvocation:\n\t'%s [-j <threads>] [-c <out.bin>] [<cpu_tests/v1> | <vectors.bin>]'.\n", suite.dir, argv[0]);
+		return 1;
+	}
+
+	start = test_time();
+	if (S_ISDIR(st.st_mode))
+	{
+		if (!test_scan_dir(&suite))
+		{
+			printf("Error: Could not read directory '%s'.\n", suite.dir);
+			return 1;
+		}
+		qsort(suite.files, suite.n_files, sizeof(*suite.files), test_compare_names);
+		test_parallel(&suite, test_parse_worker, n_threads);
+	}
+	else if ((NULL != compile) || !test_map(&suite, suite.dir))
+	{
+		printf("Error: '%s' is not a directory of JSON tests.\n", suite.dir);
+		return 1;
+	}
+	t_parse = test_time() - start;
+
+	if (NULL != compile)
+	{
+		for (uint32_t i = 0; i < suite.n_files; i++)
+		{
+			failed_files += suite.files[i].error ? 1 : 0;
+		}
+		return ((0 == failed_files) && test_compile(&suite, compile)) ? 0 : 1;
+	}
+
+	if (!test_build_chunks(&suite))
+	{
+		return 1;
+	}
+
+	start = test_time();
+	test_parallel(&suite, test_run_worker, n_threads);
+	t_run = test_time() - start;
+
+	// chunks are in file order, so results can be summed up file by file
+	for (uint32_t i = 0, c = 0; i < suite.n_files; i++)
+	{
+		test_file_t *file = &suite.files[i];
+		test_vector_t vector;
+		uint32_t file_passed = 0;
+
+		for (; (c < suite.n_chunks) && (i == suite.chunks[c].file); c++)
+		{
+			file_passed += suite.chunks[c].passed;
+			for (uint32_t f = 0; f < suite.chunks[c].n_failures; f++)
+			{
+				const test_failure_t *failure = &suite.chunks[c].failures[f];
+				if (NULL != suite.bin_vectors)
+				{
+					test_bin_unpack(&suite, file, failure->vector, &vector);
+					test_print_failure(file, &vector, failure);
+				}
+				else
+				{
+					test_print_failure(file, &file->vectors[failure->vector], failure);
+				}
+			}
+			free(suite.chunks[c].failures);
+		}
+
+		printf("%s: %u/%u passed (%.1f %%)%s\n", file->name, file_passed, file->n_vectors,
+		       (0 < file->n_vectors) ? (100.0 * file_passed / file->n_vectors) : 0.0,
+		       file->error ? ", parse error" : "");
+
+		failed_files += (file->error || (file_passed != file->n_vectors)) ? 1 : 0;
+		passed += file_passed;
+		total += file->n_vectors;
+		free(file->vectors);
+		free(file->name);
+	}
+	free(suite.chunks);
+	free(suite.files);
+	test_unmap(&suite);
+
+	printf("\n%u/%u files, %u/%u tests passed on %u threads\n",
+	       suite.n_files - failed_files, suite.n_files, passed, total, n_threads);
+	printf("load %.2f s, run %.2f s (%.0f tests/s), total %.0f tests/s\n", t_parse, t_run,
+	       (0 < t_run) ? (double) total / t_run : 0.0,
+	       (0 < (t_parse + t_run)) ? (double) total / (t_parse + t_run) : 0.0);
+
+	return ((0 == failed_files) && (0 < total)) ? 0 : 1;
+}
+
+/*---------------------------------------------------------------------*
+ *  eof                                                                *
+ *---------------------------------------------------------------------*/
@@ -2,7 +2,7 @@ import cffi
 import os, sys
 import json
 
-def run_cpu_test(emulator, cpu_state, test):
+def run_cpu_test(emulator, cpu, cpu_state, test):
     success = True
     (a, f, b, c, d, e, h, l, pc, sp) = cpu_state
     a[0] = int(test["initial"]["cpu"]["a"], 16)
@@ -19,26 +19,26 @@ def run_cpu_test(emulator, cpu_state, test):
     # print(test)
 
     # init cpu state
-    emulator.cpu_setup(a[0], f[0], b[0], c[0], d[0], e[0], h[0], l[0], pc[0], sp[0])
+    emulator.cpu_setup(cpu, a[0], f[0], b[0], c[0], d[0], e[0], h[0], l[0], pc[0], sp[0])
 
     # init cpu memory
     for ramData in test["initial"]["ram"]:
         [address, data] = [int(x, 16) for x in ramData]
-        emulator.cpu_set_memory(address, data)
+        emulator.cpu_set_memory(cpu, address, data)
         # readBack = emulator.cpu_get_memory(address)
         # print("Set: {:04x}: {:02x} (readBack={:02x})".format(address, data, readBack))
 
     # run test !
-    emulator.cpu_tick()
+    emulator.cpu_tick(cpu)
 
     # get results
-    emulator.cpu_get_state(a, f, b, c, d, e, h, l, pc, sp)
+    emulator.cpu_get_state(cpu, a, f, b, c, d, e, h, l, pc, sp)
 
     # check ram results
     ram_check = []
     for ramData in test["final"]["ram"]:
         [address, expected_data] = [int(x, 16) for x in ramData]
-        cpu_data = emulator.cpu_get_memory(address)
+        cpu_data = emulator.cpu_get_memory(cpu, address)
         ram_check.append((address, expected_data, cpu_data))
         # print("Get: {:04x}: {:02x} (exp: {:02x})".format(address, cpu_data, expected_data))
     
@@ -88,21 +88,28 @@ def main():
 
     ffi = cffi.FFI()
     ffi.cdef("""
-    uint8_t cpu_get_memory(uint16_t addr);
+    void *cpu_create(void);
     """)
     ffi.cdef("""
-    void cpu_set_memory(uint16_t addr, uint8_t val);
+    void cpu_destroy(void *cpu);
     """)
     ffi.cdef("""
-    void cpu_setup(uint8_t a, uint8_t f, uint8_t b, uint8_t c, uint8_t d, uint8_t e, uint8_t h, uint8_t l, uint16_t pc, uint16_t sp);
+    uint8_t cpu_get_memory(void *cpu, uint16_t addr);
     """)
     ffi.cdef("""
-    void cpu_get_state(uint8_t *a, uint8_t *f, uint8_t *b, uint8_t *c, uint8_t *d, uint8_t *e, uint8_t *h, uint8_t *l, uint16_t *pc, uint16_t *sp);
+    void cpu_set_memory(void *cpu, uint16_t addr, uint8_t val);
     """)
     ffi.cdef("""
-    void cpu_tick(void);
+    void cpu_setup(void *cpu, uint8_t a, uint8_t f, uint8_t b, uint8_t c, uint8_t d, uint8_t e, uint8_t h, uint8_t l, uint16_t pc, uint16_t sp);
+    """)
+    ffi.cdef("""
+    void cpu_get_state(void *cpu, uint8_t *a, uint8_t *f, uint8_t *b, uint8_t *c, uint8_t *d, uint8_t *e, uint8_t *h, uint8_t *l, uint16_t *pc, uint16_t *sp);
+    """)
+    ffi.cdef("""
+    void cpu_tick(void *cpu);
     """)
     emulator = ffi.dlopen(so_file)
+    cpu = emulator.cpu_create()
 
     a = ffi.new("uint8_t[1]")
     f = ffi.new("uint8_t[1]")
@@ -125,10 +132,12 @@ def main():
         for test_num, test in enumerate(test_list):
             print("Test {:>4d}/{:>4d}\r".format(test_num+1, len(test_list)), end="")
             sys.stdout.flush()
-            if not run_cpu_test(emulator, cpu_state, test):
+            if not run_cpu_test(emulator, cpu, cpu_state, test):
                 print("\nTest:\n{}".format(test))
+                emulator.cpu_destroy(cpu)
                 return
         print()
+    emulator.cpu_destroy(cpu)
     
 if __name__ == "__main__":
     main()
@@ -0,0 +1,296 @@
+/*---------------------------------------------------------------------*
+ *                                                                     *
+ *                       Emulator Regression Tests                     *
+ *                                                                     *
+ *                                                                     *
+ *       project: Gameboy Color Emulator                               *
+ *   module name: test_rom.c                                           *
+ *        author: tstr92                                               *
+ *          date: 2024-04-09                                           *
+ *                                                                     *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  include files                                                      *
+ *---------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "cpu.h"
+
+/*---------------------------------------------------------------------*
+ *  local definitions                                                  *
+ *---------------------------------------------------------------------*/
+#define TEST_ROM_SIZE (0x8000)
+#define TEST_CODE_SIZE (0x80)	// code at the entry point 0x0100
+#define TEST_ISR_SIZE (8)		// code at one interrupt vector
+
+/*---------------------------------------------------------------------*
+ *  local data types                                                   *
+ *---------------------------------------------------------------------*/
+/* A ROM built from a few instructions and the state it is expected to end
+ * in. Unset bytes of the code are NOPs (0x00). */
+typedef struct
+{
+	const char *name;
+	uint8_t cart_type;		// header 0x0147
+	uint8_t ram_size;		// header 0x0149
+	uint16_t isr_addr;		// 0: no interrupt handler
+	uint8_t isr[TEST_ISR_SIZE];
+	uint8_t code[TEST_CODE_SIZE];
+	uint64_t limit;			// instructions of cpu_run()
+
+	// expected end state
+	bool stopped;
+	uint64_t instructions;
+	uint16_t pc;
+	uint8_t a;
+	uint16_t de;
+} test_rom_t;
+
+/*---------------------------------------------------------------------*
+ *  external declarations                                              *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  public data                                                        *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  private data                                                       *
+ *---------------------------------------------------------------------*/
+static const test_rom_t test_roms[] =
+{
+	{
+		// no interrupt is enabled, nothing can end HALT while the LCD runs
+		.name = "halt_ie_clear",
+		.code =
+		{
+			0xF3,				// 0100: DI
+			0x3E, 0x80,			// 0101: LD A,$80
+			0xE0, 0x40,			// 0103: LDH ($40),A		LCD on
+			0xAF,				// 0105: XOR A
+			0xE0, 0xFF,			// 0106: LDH ($FF),A		IE = 0
+			0x76,				// 0108: HALT
+			0x00,				// 0109: NOP
+			0x18, 0xFD,			// 010A: JR $0109
+		},
+		.limit = 100000,
+		.stopped = true,
+		.instructions = 7,
+		.pc = 0x0109,
+		.a = 0x00,
+	},
+	{
+		// only the stopped timer is enabled, the LCD requests other interrupts
+		.name = "halt_limit",
+		.code =
+		{
+			0xF3,				// 0100: DI
+			0x3E, 0x80,			// 0101: LD A,$80
+			0xE0, 0x40,			// 0103: LDH ($40),A		LCD on
+			0x3E, 0x04,			// 0105: LD A,$04
+			0xE0, 0xFF,			// 0107: LDH ($FF),A		IE = timer
+			0x76,				// 0109: HALT
+			0x00,				// 010A: NOP
+			0x18, 0xFD,			// 010B: JR $010A
+		},
+		.limit = 100000,
+		.stopped = false,
+		.instructions = 100000,
+		.pc = 0x0109,
+		.a = 0x04,
+	},
+	{
+		// the timer interrupt ends HALT 100 times
+		.name = "halt_wake",
+		.isr_addr = 0x0050,
+		.isr =
+		{
+			0x13,				// 0050: INC DE
+			0xD9,				// 0051: RETI
+		},
+		.code =
+		{
+			0xF3,				// 0100: DI
+			0x31, 0xFE, 0xFF,	// 0101: LD SP,$FFFE
+			0x3E, 0xF8,			// 0104: LD A,$F8
+			0xE0, 0x06,			// 0106: LDH ($06),A		TMA
+			0x3E, 0x05,			// 0108: LD A,$05
+			0xE0, 0x07,			// 010A: LDH ($07),A		TAC = 262144 Hz
+			0x3E, 0x04,			// 010C: LD A,$04
+			0xE0, 0xFF,			// 010E: LDH ($FF),A		IE = timer
+			0xAF,				// 0110: XOR A
+			0xE0, 0x0F,			// 0111: LDH ($0F),A		IF = 0
+			0x11, 0x00, 0x00,	// 0113: LD DE,$0000
+			0x06, 0x64,			// 0116: LD B,100
+			0xFB,				// 0118: EI
+			0x76,				// 0119: HALT
+			0x05,				// 011A: DEC B
+			0x20, 0xFC,			// 011B: JR NZ,$0119
+			0x10, 0x00,			// 011D: STOP
+		},
+		.limit = 100000,
+		.stopped = true,
+		.instructions = 615,
+		.pc = 0x011F,
+		.a = 0x00,
+		.de = 100,
+	},
+	{
+		// timer interrupts within long blocks of straight-line code
+		.name = "timer_in_block",
+		.isr_addr = 0x0050,
+		.isr =
+		{
+			0x13,				// 0050: INC DE
+			0xD9,				// 0051: RETI
+		},
+		.code =
+		{
+			0xF3,				// 0100: DI
+			0x31, 0xFE, 0xFF,	// 0101: LD SP,$FFFE
+			0x3E, 0xF8,			// 0104: LD A,$F8
+			0xE0, 0x06,			// 0106: LDH ($06),A		TMA
+			0x3E, 0x05,			// 0108: LD A,$05
+			0xE0, 0x07,			// 010A: LDH ($07),A		TAC = 262144 Hz
+			0x3E, 0x04,			// 010C: LD A,$04
+			0xE0, 0xFF,			// 010E: LDH ($FF),A		IE = timer
+			0xAF,				// 0110: XOR A
+			0xE0, 0x0F,			// 0111: LDH ($0F),A		IF = 0
+			0x11, 0x00, 0x00,	// 0113: LD DE,$0000
+			0x01, 0xE8, 0x03,	// 0116: LD BC,1000
+			0xFB,				// 0119: EI
+								// 011A: 60 x NOP
+			[0x56] = 0x0B,		// 0156: DEC BC
+			0x78,				// 0157: LD A,B
+			0xB1,				// 0158: OR C
+			0x20, 0xBF,			// 0159: JR NZ,$011A
+			0xF3,				// 015B: DI
+			0x10, 0x00,			// 015C: STOP
+		},
+		.limit = 1000000,
+		.stopped = true,
+		.instructions = 70302,
+		.pc = 0x015E,
+		.a = 0x00,
+		.de = 0x0C47,
+	},
+	{
+		// read-modify-write of the external RAM, see DYNAREC_VERIFY
+		.name = "inc_cart_ram",
+		.cart_type = 0x03,		// MBC1+RAM+BATTERY
+		.ram_size = 0x02,		// 8 KiB
+		.code =
+		{
+			0xF3,				// 0100: DI
+			0x31, 0xFE, 0xFF,	// 0101: LD SP,$FFFE
+			0x3E, 0x0A,			// 0104: LD A,$0A
+			0xEA, 0x00, 0x00,	// 0106: LD ($0000),A		RAM enable
+			0x21, 0x00, 0xA0,	// 0109: LD HL,$A000
+			0xAF,				// 010C: XOR A
+			0x77,				// 010D: LD (HL),A
+			0x01, 0xE8, 0x03,	// 010E: LD BC,1000
+			0x34,				// 0111: INC (HL)
+			0x0B,				// 0112: DEC BC
+			0x78,				// 0113: LD A,B
+			0xB1,				// 0114: OR C
+			0x20, 0xFA,			// 0115: JR NZ,$0111
+			0x7E,				// 0117: LD A,(HL)
+			0x10, 0x00,			// 0118: STOP
+		},
+		.limit = 1000000,
+		.stopped = true,
+		.instructions = 5011,
+		.pc = 0x011A,
+		.a = 1000 & 0xFF,
+	},
+};
+
+/*---------------------------------------------------------------------*
+ *  private function declarations                                      *
+ *---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------*
+ *  private functions                                                  *
+ *---------------------------------------------------------------------*/
+static bool test_rom_run(sm83_t *cpu, const test_rom_t *test)
+{
+	static uint8_t rom[TEST_ROM_SIZE];
+	uint8_t a, f, b, c, d, e, h, l;
+	uint16_t pc, sp;
+	bool stopped;
+	uint64_t instructions;
+
+	memset(rom, 0, sizeof(rom));
+	// there is no boot ROM, the CPU starts at 0x0000: JP $0100
+	rom[0x0000] = 0xC3;
+	rom[0x0001] = 0x00;
+	rom[0x0002] = 0x01;
+	if (0 != test->isr_addr)
+	{
+		memcpy(&rom[test->isr_addr], test->isr, sizeof(test->isr));
+	}
+	memcpy(&rom[0x0100], test->code, sizeof(test->code));
+	// the header overlaps the code, code of cartridges with MBC ends before 0x0134
+	rom[0x0147] = test->cart_type;
+	rom[0x0149] = test->ram_size;
+
+	cpu_init(cpu);
+	cpu_set_putc_fd(cpu, -1);
+	if (!cpu_load_rom(cpu, rom, sizeof(rom)))
+	{
+		printf("%s: could not load the ROM\n", test->name);
+		return false;
+	}
+
+	cpu_run(cpu, test->limit);
+
+	cpu_get_state(cpu, &a, &f, &b, &c, &d, &e, &h, &l, &pc, &sp);
+	stopped = cpu_is_stopped(cpu);
+	instructions = cpu_get_cycles(cpu);
+	if ((stopped != test->stopped) || (instructions != test->instructions) ||
+	    (pc != test->pc) || (a != test->a) || (((d << 8) | e) != test->de))
+	{
+		printf("%s: failed\n", test->name);
+		printf("  expected: stopped %d, %llu instructions, PC %04x, A %02x, DE %04x\n",
+		       test->stopped, (unsigned long long) test->instructions, test->pc, test->a, test->de);
+		printf("  result:   stopped %d, %llu instructions, PC %04x, A %02x, DE %04x\n",
+		       stopped, (unsigned long long) instructions, pc, a, (d << 8) | e);
+		return false;
+	}
+
+	printf("%s: passed\n", test->name);
+	return true;
+}
+
+/*---------------------------------------------------------------------*
+ *  global functions                                                   *
+ *---------------------------------------------------------------------*/
+int main(void)
+{
+	uint32_t n_tests = sizeof(test_roms) / sizeof(test_roms[0]);
+	uint32_t passed = 0;
+	sm83_t *cpu = cpu_create();
+
+	if (NULL == cpu)
+	{
+		return 1;
+	}
+
+	for (uint32_t i = 0; i < n_tests; i++)
+	{
+		passed += test_rom_run(cpu, &test_roms[i]) ? 1 : 0;
+	}
+	cpu_destroy(cpu);
+
+	printf("\n%u/%u tests passed\n", passed, n_tests);
+
+	return (passed == n_tests) ? 0 : 1;
+}
+
+/*---------------------------------------------------------------------*
+ *  eof                                                                *
+ *---------------------------------------------------------------------*/